@@ -0,0 +1,185 @@
+#!/usr/bin/env python3
+"""Encode/decode throughput benchmark for the ziproto python module.
+
+Every payload shape is generated from a fixed seed so runs on different
+builds measure exactly the same data. For each shape the benchmark reports
+MB/s of encoded data, objects/s (every value, key and container counts as one
+object) and the python memory blocks left allocated per call. Results can be
+saved with --save and compared against an earlier run with --baseline, which
+exits non-zero when a shape got slower than --tolerance allows.
+
+    python3 benchmarks/bench.py
+    python3 benchmarks/bench.py --save before.json
+    python3 benchmarks/bench.py --baseline before.json --tolerance 0.05
+    python3 benchmarks/bench.py --compare          # also time msgpack/ormsgpack if installed
+"""
+import argparse
+import gc
+import json
+import random
+import string
+import sys
+import time
+
+import ziproto
+
+
+def shape_ints(rng):
+    limits = [0x7F, 0xFF, 0xFFFF, 0xFFFFFFFF, 2**63 - 1]
+    return [rng.randint(-rng.choice(limits) - 1, rng.choice(limits)) for _ in range(10000)]
+
+
+def word(rng, lo, hi):
+    return ''.join(rng.choices(string.ascii_lowercase, k=rng.randint(lo, hi)))
+
+
+def shape_strings(rng):
+    return [word(rng, 100, 1000) for _ in range(1000)]
+
+
+def shape_nested(rng, depth=6):
+    if not depth:
+        return rng.randint(0, 1000000)
+    return {key: shape_nested(rng, depth - 1) for key in ('alpha', 'beta', 'gamma', 'delta')}
+
+
+def shape_dicts(rng):
+    return [{'id': i, 'name': word(rng, 4, 12), 'score': rng.randrange(100000) / 7.0,
+        'active': rng.random() < 0.5} for i in range(2000)]
+
+
+def shape_blobs(rng):
+    return [rng.getrandbits(65536 * 8).to_bytes(65536, 'little') for _ in range(16)]
+
+
+def shape_records(rng):
+    return [{
+        'id': rng.getrandbits(48),
+        'name': word(rng, 5, 20),
+        'email': word(rng, 10, 30) + '@example.com',
+        'balance': rng.uniform(-1e6, 1e6),
+        'tags': [word(rng, 3, 10) for _ in range(rng.randint(0, 5))],
+        'address': {'street': word(rng, 10, 40), 'zip': rng.randint(10000, 99999), 'country': word(rng, 2, 2)},
+        'verified': rng.random() < 0.5,
+        'deleted_at': None,
+    } for _ in range(500)]
+
+
+SHAPES = {
+    'ints': shape_ints,
+    'strings': shape_strings,
+    'nested': shape_nested,
+    'dicts': shape_dicts,
+    'blobs': shape_blobs,
+    'records': shape_records,
+}
+
+
+def count_objects(obj):
+    if isinstance(obj, dict):
+        return 1 + sum(1 + count_objects(v) for v in obj.values())
+    if isinstance(obj, (list, tuple)):
+        return 1 + sum(count_objects(v) for v in obj)
+    return 1
+
+
+def best_time(func, arg, repeat, number):
+    best = float('inf')
+    for _ in range(repeat):
+        start = time.perf_counter()
+        for _ in range(number):
+            func(arg)
+        best = min(best, time.perf_counter() - start)
+    return best / number
+
+
+def blocks_per_call(func, arg, calls=10):
+    """Memory blocks still allocated after a call, i.e. the objects making up its result."""
+    results = [None] * calls
+    gc.collect()
+    before = sys.getallocatedblocks()
+    for i in range(calls):
+        results[i] = func(arg)
+    after = sys.getallocatedblocks()
+    return max(0, after - before) / calls
+
+
+def codecs(compare):
+    found = [('ziproto', ziproto.encode, ziproto.decode)]
+    if not compare:
+        return found
+    try:
+        import msgpack
+        found.append(('msgpack', msgpack.packb, msgpack.unpackb))
+    except ImportError:
+        print('msgpack not installed, skipping', file=sys.stderr)
+    try:
+        import ormsgpack
+        found.append(('ormsgpack', ormsgpack.packb, ormsgpack.unpackb))
+    except ImportError:
+        print('ormsgpack not installed, skipping', file=sys.stderr)
+    return found
+
+
+def run(args):
+    results = {}
+    gcenabled = gc.isenabled()
+    for name in args.shape or SHAPES:
+        data = SHAPES[name](random.Random(args.seed))
+        objects = count_objects(data)
+        for codec, encode, decode in codecs(args.compare):
+            encoded = encode(data)
+            for op, func, arg in (('encode', encode, data), ('decode', decode, encoded)):
+                if args.no_gc:
+                    gc.disable()
+                elapsed = best_time(func, arg, args.repeat, args.number)
+                if gcenabled:
+                    gc.enable()
+                row = {
+                    'MB/s': len(encoded) / elapsed / 1e6,
+                    'objects/s': objects / elapsed,
+                    'blocks/call': blocks_per_call(func, arg),
+                }
+                key = '%s %s %s' % (codec, name, op)
+                results[key] = row
+                print('%-26s %9.1f MB/s %13.0f objects/s %10.1f blocks/call' % (key, row['MB/s'], row['objects/s'], row['blocks/call']))
+    return results
+
+
+def check_baseline(results, path, tolerance):
+    with open(path) as f:
+        baseline = json.load(f)
+    failed = False
+    for key, row in results.items():
+        if key not in baseline:
+            continue
+        change = row['MB/s'] / baseline[key]['MB/s'] - 1.0
+        slower = change < -tolerance
+        failed |= slower
+        print('%-26s %+7.1f%%%s' % (key, change * 100, '  REGRESSION' if slower else ''))
+    return not failed
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('--seed', type=int, default=42, help='corpus seed (default 42)')
+    parser.add_argument('--shape', action='append', choices=list(SHAPES), help='only run this shape, may be repeated')
+    parser.add_argument('--repeat', type=int, default=5, help='timing runs, the best one is reported')
+    parser.add_argument('--number', type=int, default=20, help='calls per timing run')
+    parser.add_argument('--no-gc', action='store_true', help='disable the garbage collector while timing')
+    parser.add_argument('--compare', action='store_true', help='also time other MessagePack encoders if installed')
+    parser.add_argument('--save', metavar='FILE', help='write the results as json')
+    parser.add_argument('--baseline', metavar='FILE', help='compare MB/s against results saved with --save')
+    parser.add_argument('--tolerance', type=float, default=0.05, help='allowed slowdown against --baseline (default 0.05)')
+    args = parser.parse_args()
+
+    results = run(args)
+    if args.save:
+        with open(args.save, 'w') as f:
+            json.dump(results, f, indent=1, sort_keys=True)
+    if args.baseline and not check_baseline(results, args.baseline, args.tolerance):
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
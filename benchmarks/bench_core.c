@@ -0,0 +1,386 @@
+/**
+ * @file bench_core.c
+ * @brief Throughput benchmark for the libziproto C core.
+ *
+ * Every payload shape is generated once from a fixed seed as a flat list of
+ * encoder operations, so the timed loops only measure ZiEncodeTypeSingle,
+ * ZiReadNext and ZiSkipNext. Allocations are counted by linking with
+ * -Wl,--wrap=malloc,--wrap=realloc (see the Makefile next to this file).
+ *
+ *   ./bench_core [--seed N] [--iterations N] [--shape NAME]
+ */
+#define _POSIX_C_SOURCE 199309L
+#include <ziproto.h>
+#include <stdio.h>
+#include <time.h>
+
+/* Allocation counting */
+
+static size_t AllocCount = 0;
+
+extern void *__real_malloc(size_t size);
+extern void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+	AllocCount++;
+	return __real_malloc(size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	AllocCount++;
+	return __real_realloc(ptr, size);
+}
+
+/* Fixed seed corpus generation */
+
+typedef struct
+{
+	ZiValueType_t vType;
+	union
+	{
+		uint64_t u;
+		int64_t  i;
+		double   f;
+		bool     b;
+	} value;
+	const void *data; // STR/BIN payload, or &value for scalars
+	size_t size;
+} BenchOp_t;
+
+typedef struct
+{
+	BenchOp_t *ops;
+	size_t     count;
+	size_t     _alloc;
+	uint8_t   *pool;   // Backing storage for every STR/BIN payload
+	size_t     szpool;
+	size_t     _poolalloc;
+	uint64_t   rng;
+} BenchCorpus_t;
+
+// xorshift64*, good enough for corpus generation and identical on every platform
+static uint64_t Random(BenchCorpus_t *c)
+{
+	c->rng ^= c->rng >> 12;
+	c->rng ^= c->rng << 25;
+	c->rng ^= c->rng >> 27;
+	return c->rng * 0x2545F4914F6CDD1DULL;
+}
+
+static uint64_t RandomRange(BenchCorpus_t *c, uint64_t lo, uint64_t hi)
+{
+	return lo + Random(c) % (hi - lo + 1);
+}
+
+static BenchOp_t *AddOp(BenchCorpus_t *c, ZiValueType_t vType)
+{
+	if (c->count == c->_alloc)
+	{
+		c->_alloc = c->_alloc ? c->_alloc * 2 : 1024;
+		c->ops    = __real_realloc(c->ops, c->_alloc * sizeof(BenchOp_t));
+		if (!c->ops)
+			abort();
+	}
+	BenchOp_t *op = &c->ops[c->count++];
+	memset(op, 0, sizeof(BenchOp_t));
+	op->vType = vType;
+	return op;
+}
+
+static void AddScalar(BenchCorpus_t *c, ZiValueType_t vType, uint64_t bits, size_t size)
+{
+	BenchOp_t *op = AddOp(c, vType);
+	op->value.u   = bits;
+	op->size      = size;
+}
+
+static void AddUInt(BenchCorpus_t *c, uint64_t value) { AddScalar(c, ZI_UINT_TYPE, value, sizeof(uint64_t)); }
+static void AddCount(BenchCorpus_t *c, ZiValueType_t vType, uint64_t n) { AddScalar(c, vType, n, sizeof(uint64_t)); }
+
+static void AddInt(BenchCorpus_t *c, int64_t value)
+{
+	BenchOp_t *op = AddOp(c, ZI_INT_TYPE);
+	op->value.i   = value;
+	op->size      = sizeof(int64_t);
+}
+
+static void AddFloat(BenchCorpus_t *c, double value)
+{
+	BenchOp_t *op = AddOp(c, ZI_FLOAT_TYPE);
+	op->value.f   = value;
+	op->size      = sizeof(double);
+}
+
+static void AddBool(BenchCorpus_t *c, bool value)
+{
+	BenchOp_t *op = AddOp(c, ZI_BOOL_TYPE);
+	op->value.b   = value;
+	op->size      = sizeof(bool);
+}
+
+// Payloads are stored as pool offsets until the corpus is finished since the pool moves
+static void AddBytes(BenchCorpus_t *c, ZiValueType_t vType, const char *text, size_t length)
+{
+	if (c->szpool + length > c->_poolalloc)
+	{
+		while (c->szpool + length > c->_poolalloc)
+			c->_poolalloc = c->_poolalloc ? c->_poolalloc * 2 : 65536;
+		c->pool = __real_realloc(c->pool, c->_poolalloc);
+		if (!c->pool)
+			abort();
+	}
+
+	BenchOp_t *op = AddOp(c, vType);
+	op->value.u   = c->szpool;
+	op->size      = length;
+	for (size_t i = 0; i < length; ++i)
+		c->pool[c->szpool + i] = text ? (uint8_t)text[i] : (uint8_t)Random(c);
+	c->szpool += length;
+}
+
+static void AddKey(BenchCorpus_t *c, const char *key) { AddBytes(c, ZI_STR_TYPE, key, strlen(key)); }
+
+static void AddWord(BenchCorpus_t *c, size_t minlen, size_t maxlen)
+{
+	char   word[4096];
+	size_t length = RandomRange(c, minlen, maxlen);
+	for (size_t i = 0; i < length; ++i)
+		word[i] = 'a' + Random(c) % 26;
+	AddBytes(c, ZI_STR_TYPE, word, length);
+}
+
+static void FinishCorpus(BenchCorpus_t *c)
+{
+	for (size_t i = 0; i < c->count; ++i)
+	{
+		BenchOp_t *op = &c->ops[i];
+		if (op->vType == ZI_STR_TYPE || op->vType == ZI_BIN_TYPE)
+			op->data = c->pool + op->value.u;
+		else if (op->vType != ZI_NIL_TYPE)
+			op->data = &op->value;
+	}
+}
+
+static void ShapeInts(BenchCorpus_t *c)
+{
+	static const uint64_t limits[] = { 0x7F, 0xFF, 0xFFFF, 0xFFFFFFFF, UINT64_MAX };
+	AddCount(c, ZI_ARRAY_TYPE, 10000);
+	for (int i = 0; i < 10000; ++i)
+	{
+		uint64_t value = Random(c) % (limits[Random(c) % 5] / 2 + 1);
+		if (Random(c) & 1)
+			AddUInt(c, value);
+		else
+			AddInt(c, -(int64_t)value - 1);
+	}
+}
+
+static void ShapeStrings(BenchCorpus_t *c)
+{
+	AddCount(c, ZI_ARRAY_TYPE, 1000);
+	for (int i = 0; i < 1000; ++i)
+		AddWord(c, 100, 1000);
+}
+
+static void NestedMap(BenchCorpus_t *c, int depth)
+{
+	static const char *keys[] = { "alpha", "beta", "gamma", "delta" };
+	AddCount(c, ZI_MAP_TYPE, 4);
+	for (int i = 0; i < 4; ++i)
+	{
+		AddKey(c, keys[i]);
+		if (depth > 1)
+			NestedMap(c, depth - 1);
+		else
+			AddUInt(c, RandomRange(c, 0, 1000000));
+	}
+}
+
+static void ShapeNested(BenchCorpus_t *c)
+{
+	NestedMap(c, 6);
+}
+
+static void ShapeDicts(BenchCorpus_t *c)
+{
+	AddCount(c, ZI_ARRAY_TYPE, 2000);
+	for (int i = 0; i < 2000; ++i)
+	{
+		AddCount(c, ZI_MAP_TYPE, 4);
+		AddKey(c, "id");
+		AddUInt(c, i);
+		AddKey(c, "name");
+		AddWord(c, 4, 12);
+		AddKey(c, "score");
+		AddFloat(c, (double)(Random(c) % 100000) / 7.0);
+		AddKey(c, "active");
+		AddBool(c, Random(c) & 1);
+	}
+}
+
+static void ShapeBlobs(BenchCorpus_t *c)
+{
+	AddCount(c, ZI_ARRAY_TYPE, 16);
+	for (int i = 0; i < 16; ++i)
+		AddBytes(c, ZI_BIN_TYPE, NULL, 65536);
+}
+
+static void ShapeRecords(BenchCorpus_t *c)
+{
+	AddCount(c, ZI_ARRAY_TYPE, 500);
+	for (int i = 0; i < 500; ++i)
+	{
+		AddCount(c, ZI_MAP_TYPE, 8);
+		AddKey(c, "id");
+		AddUInt(c, Random(c) >> 16);
+		AddKey(c, "name");
+		AddWord(c, 5, 20);
+		AddKey(c, "email");
+		AddWord(c, 10, 30);
+		AddKey(c, "balance");
+		AddFloat(c, (double)(int64_t)Random(c) / 1e12);
+		AddKey(c, "tags");
+		uint64_t tags = RandomRange(c, 0, 5);
+		AddCount(c, ZI_ARRAY_TYPE, tags);
+		for (uint64_t t = 0; t < tags; ++t)
+			AddWord(c, 3, 10);
+		AddKey(c, "address");
+		AddCount(c, ZI_MAP_TYPE, 3);
+		AddKey(c, "street");
+		AddWord(c, 10, 40);
+		AddKey(c, "zip");
+		AddUInt(c, RandomRange(c, 10000, 99999));
+		AddKey(c, "country");
+		AddWord(c, 2, 2);
+		AddKey(c, "verified");
+		AddBool(c, Random(c) & 1);
+		AddKey(c, "deleted_at");
+		AddOp(c, ZI_NIL_TYPE);
+	}
+}
+
+static const struct
+{
+	const char *name;
+	void (*generate)(BenchCorpus_t *c);
+} Shapes[] = {
+	{ "ints",    ShapeInts },
+	{ "strings", ShapeStrings },
+	{ "nested",  ShapeNested },
+	{ "dicts",   ShapeDicts },
+	{ "blobs",   ShapeBlobs },
+	{ "records", ShapeRecords },
+};
+
+/* Timed loops */
+
+static double Now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static ZiHandle_t *EncodeCorpus(const BenchCorpus_t *c)
+{
+	ZiHandle_t *handle = ZiAllocHandle(64);
+	for (size_t i = 0; handle && i < c->count; ++i)
+	{
+		const BenchOp_t *op = &c->ops[i];
+		ZiHandle_t *next = ZiEncodeTypeSingle(handle, op->vType, op->data, op->size);
+		if (!next)
+			ZiFreeHandle(handle);
+		handle = next;
+	}
+	return handle;
+}
+
+static size_t ReadCorpus(ZiHandle_t *handle)
+{
+	ZiValue_t value;
+	size_t    values = 0;
+	handle->_cursor  = 0;
+	while (ZiReadNext(handle, &value) == ZI_DECODE_OK)
+		values++;
+	return values;
+}
+
+static void Report(const char *shape, const char *op, size_t bytes, size_t values, int iterations, double elapsed, size_t allocs)
+{
+	printf("%-8s %-7s %10.1f MB/s %12.0f values/s %8.1f allocs/call\n", shape, op,
+		(double)bytes * iterations / elapsed / 1e6, (double)values * iterations / elapsed,
+		(double)allocs / iterations);
+}
+
+static void RunShape(int shape, uint64_t seed, int iterations)
+{
+	BenchCorpus_t corpus;
+	memset(&corpus, 0, sizeof(corpus));
+	corpus.rng = seed ? seed : 1;
+	Shapes[shape].generate(&corpus);
+	FinishCorpus(&corpus);
+
+	ZiHandle_t *encoded = EncodeCorpus(&corpus);
+	if (!encoded)
+	{
+		fprintf(stderr, "%s: encoding failed\n", Shapes[shape].name);
+		exit(1);
+	}
+	size_t bytes = ZiGetSize(encoded);
+
+	AllocCount = 0;
+	double start = Now();
+	for (int i = 0; i < iterations; ++i)
+		ZiFreeHandle(EncodeCorpus(&corpus));
+	Report(Shapes[shape].name, "encode", bytes, corpus.count, iterations, Now() - start, AllocCount);
+
+	AllocCount = 0;
+	size_t values = 0;
+	start = Now();
+	for (int i = 0; i < iterations; ++i)
+		values = ReadCorpus(encoded);
+	Report(Shapes[shape].name, "read", bytes, values, iterations, Now() - start, AllocCount);
+
+	AllocCount = 0;
+	start = Now();
+	for (int i = 0; i < iterations; ++i)
+	{
+		encoded->_cursor = 0;
+		if (ZiSkipNext(encoded) != ZI_DECODE_OK)
+			abort();
+	}
+	Report(Shapes[shape].name, "skip", bytes, values, iterations, Now() - start, AllocCount);
+
+	ZiFreeHandle(encoded);
+	free(corpus.ops);
+	free(corpus.pool);
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t    seed       = 42;
+	int         iterations = 200;
+	const char *only       = NULL;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		if (!strcmp(argv[i], "--seed") && i + 1 < argc)
+			seed = strtoull(argv[++i], NULL, 10);
+		else if (!strcmp(argv[i], "--iterations") && i + 1 < argc)
+			iterations = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--shape") && i + 1 < argc)
+			only = argv[++i];
+		else
+		{
+			fprintf(stderr, "usage: %s [--seed N] [--iterations N] [--shape NAME]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	for (size_t i = 0; i < sizeof(Shapes) / sizeof(*Shapes); ++i)
+		if (!only || !strcmp(only, Shapes[i].name))
+			RunShape(i, seed, iterations > 0 ? iterations : 1);
+	return 0;
+}
@@ -0,0 +1,293 @@
+#include "ziproto.h"
+
+#define likely(x)      __builtin_expect(!!(x), 1)
+#define unlikely(x)    __builtin_expect(!!(x), 0)
+
+// Size of the compressor's match table, 8192 positions take 32 KiB of stack
+#define HASH_BITS 13
+// Shortest match worth encoding, it costs a token byte and a two byte offset
+#define MIN_MATCH 4
+// Farthest back a match can reach with a two byte offset
+#define MAX_OFFSET 0xFFFF
+
+/*
+ * Block format
+ *
+ * A block is a series of sequences, each being a token byte, the literals
+ * and a match copied from earlier output. The high nibble of the token is
+ * the number of literals and the low nibble the match length minus
+ * MIN_MATCH. A nibble of 15 is followed by bytes added to it, where 255
+ * means another byte follows. The literals are followed by the big endian
+ * 16 bit distance back to the match. The last sequence only has literals
+ * and ends the block.
+ */
+
+static inline uint32_t Load32(const uint8_t *data)
+{
+	uint32_t value;
+	memcpy(&value, data, sizeof(value));
+	return value;
+}
+
+static inline uint32_t HashSequence(uint32_t sequence)
+{
+	return (sequence * 2654435761U) >> (32 - HASH_BITS);
+}
+
+// Write the bytes extending a nibble of 15, returns the new output position.
+static inline uint8_t *PutLength(uint8_t *op, size_t length)
+{
+	for (; length >= 255; length -= 255)
+		*op++ = 255;
+	*op++ = (uint8_t)length;
+	return op;
+}
+
+// Read the bytes extending a nibble of 15, returns false if the input runs out.
+static inline bool GetLength(const uint8_t **ip, const uint8_t *end, size_t *length)
+{
+	uint8_t byte;
+	do
+	{
+		if (unlikely(*ip >= end))
+			return false;
+		byte     = *(*ip)++;
+		*length += byte;
+	}
+	while (byte == 255);
+	return true;
+}
+
+// Append one sequence, returns null if it doesn't fit before oend.
+static uint8_t *PutSequence(uint8_t *op, uint8_t *oend, const uint8_t *literals, size_t szliterals, size_t offset, size_t matchlen)
+{
+	// Worst case for the token, both lengths, the literals and the offset
+	if (unlikely((size_t)(oend - op) < 1 + szliterals / 255 + 1 + szliterals + 2 + matchlen / 255 + 1))
+		return NULL;
+
+	uint8_t *token = op++;
+	*token         = (szliterals < 15 ? szliterals : 15) << 4;
+	if (szliterals >= 15)
+		op = PutLength(op, szliterals - 15);
+	memcpy(op, literals, szliterals);
+	op += szliterals;
+
+	if (!matchlen)
+		return op;
+
+	ZiStoreBE16(op, (uint16_t)offset);
+	op += 2;
+
+	matchlen -= MIN_MATCH;
+	*token   |= matchlen < 15 ? matchlen : 15;
+	if (matchlen >= 15)
+		op = PutLength(op, matchlen - 15);
+	return op;
+}
+
+/**
+ * @brief Upper bound of the compressed size of size bytes, for sizing the output of ZiCompressBlock.
+ */
+size_t ZiCompressBound(size_t size)
+{
+	return size + size / 255 + 16;
+}
+
+/**
+ * @brief Compresses a block with a greedy LZ77 match finder.
+ *
+ * Every position is hashed on its next four bytes into a table holding the
+ * last position with the same hash, which is checked for a match. Runs
+ * without matches are stepped over faster the longer they get, so data that
+ * doesn't compress costs little time.
+ *
+ * @param[in]  src    Data to compress
+ * @param[in]  srclen Size of src
+ * @param[out] dst    Output buffer
+ * @param[in]  dstcap Size of dst, ZiCompressBound(srclen) always fits
+ * @returns The compressed size, or 0 if it doesn't fit in dstcap.
+ */
+size_t ZiCompressBlock(const uint8_t *src, size_t srclen, uint8_t *dst, size_t dstcap)
+{
+	uint32_t       table[1 << HASH_BITS] = {0};
+	const uint8_t *ip     = src;
+	const uint8_t *anchor = src;
+	const uint8_t *end    = src + srclen;
+	uint8_t       *op     = dst;
+	uint8_t       *oend   = dst + dstcap;
+
+	// Positions are stored as 32 bit offsets into src
+	if (unlikely(srclen > UINT32_MAX))
+		return 0;
+
+	while (srclen >= MIN_MATCH && ip <= end - MIN_MATCH)
+	{
+		uint32_t       sequence = Load32(ip);
+		uint32_t       hash     = HashSequence(sequence);
+		const uint8_t *ref      = src + table[hash];
+		table[hash]             = (uint32_t)(ip - src);
+
+		if (ref >= ip || ip - ref > MAX_OFFSET || Load32(ref) != sequence)
+		{
+			ip += 1 + ((ip - anchor) >> 6);
+			continue;
+		}
+
+		// Grow the match backwards over literals and forwards as far as it goes
+		while (ip > anchor && ref > src && ip[-1] == ref[-1])
+		{
+			ip--;
+			ref--;
+		}
+
+		size_t matchlen = MIN_MATCH;
+		while (ip + matchlen < end && ip[matchlen] == ref[matchlen])
+			matchlen++;
+
+		if (!(op = PutSequence(op, oend, anchor, ip - anchor, ip - ref, matchlen)))
+			return 0;
+
+		ip    += matchlen;
+		anchor = ip;
+
+		// Remember a position inside the match so the next one can start right after it
+		if (ip - 2 >= src && ip <= end - MIN_MATCH)
+			table[HashSequence(Load32(ip - 2))] = (uint32_t)(ip - 2 - src);
+	}
+
+	if (!(op = PutSequence(op, oend, anchor, end - anchor, 0, 0)))
+		return 0;
+	return op - dst;
+}
+
+/**
+ * @brief Decompresses a block written by ZiCompressBlock.
+ *
+ * Every length and offset is checked against both buffers, so damaged or
+ * hostile input can't read or write out of bounds.
+ *
+ * @param[in]  src    Compressed block
+ * @param[in]  srclen Size of src
+ * @param[out] dst    Output buffer
+ * @param[in]  dstlen Exact decompressed size
+ * @returns ZI_DECODE_OK if the block decompressed to exactly dstlen bytes, ZI_DECODE_TRUNCATED
+ *          if the block ends early or ZI_DECODE_MALFORMED if it doesn't fit dstlen.
+ */
+ZiDecodeStatus_t ZiDecompressBlock(const uint8_t *src, size_t srclen, uint8_t *dst, size_t dstlen)
+{
+	const uint8_t *ip   = src;
+	const uint8_t *iend = src + srclen;
+	uint8_t       *op   = dst;
+	uint8_t       *oend = dst + dstlen;
+
+	for (;;)
+	{
+		if (unlikely(ip >= iend))
+			return ZI_DECODE_TRUNCATED;
+
+		uint8_t token      = *ip++;
+		size_t  szliterals = token >> 4;
+		if (szliterals == 15 && unlikely(!GetLength(&ip, iend, &szliterals)))
+			return ZI_DECODE_TRUNCATED;
+
+		if (unlikely(szliterals > (size_t)(iend - ip)))
+			return ZI_DECODE_TRUNCATED;
+		if (unlikely(szliterals > (size_t)(oend - op)))
+			return ZI_DECODE_MALFORMED;
+		memcpy(op, ip, szliterals);
+		ip += szliterals;
+		op += szliterals;
+
+		// The literals-only sequence at the end of the block
+		if (ip == iend)
+			return op == oend ? ZI_DECODE_OK : ZI_DECODE_MALFORMED;
+
+		if (unlikely(iend - ip < 2))
+			return ZI_DECODE_TRUNCATED;
+		size_t offset = ZiLoadBE16(ip);
+		ip += 2;
+
+		size_t matchlen = token & 0x0F;
+		if (matchlen == 15 && unlikely(!GetLength(&ip, iend, &matchlen)))
+			return ZI_DECODE_TRUNCATED;
+		matchlen += MIN_MATCH;
+
+		if (unlikely(offset == 0 || offset > (size_t)(op - dst) || matchlen > (size_t)(oend - op)))
+			return ZI_DECODE_MALFORMED;
+
+		// Overlapping matches repeat the bytes just written, so they are copied forwards one at a time
+		const uint8_t *ref = op - offset;
+		if (offset >= matchlen)
+			memcpy(op, ref, matchlen);
+		else
+		{
+			for (size_t i = 0; i < matchlen; ++i)
+				op[i] = ref[i];
+		}
+		op += matchlen;
+	}
+}
+
+/**
+ * @brief Writes a compressed frame holding src.
+ *
+ * The frame is the ZI_FRAME_COMPRESSED byte, the big endian 32 bit sizes of
+ * the decompressed data and of the block, then the block.
+ *
+ * @param[in]  src    Encoded data to compress
+ * @param[in]  srclen Size of src
+ * @param[out] dst    Output buffer
+ * @param[in]  dstcap Size of dst, srclen bytes is always enough
+ * @returns The frame size, or 0 if the frame wouldn't be smaller than src and src should be sent as is.
+ */
+size_t ZiCompressFrame(const uint8_t *src, size_t srclen, uint8_t *dst, size_t dstcap)
+{
+	if (srclen > UINT32_MAX || srclen <= ZI_FRAME_HEADER_SIZE + 1 || dstcap <= ZI_FRAME_HEADER_SIZE)
+		return 0;
+
+	// Give up as soon as the frame would be no smaller than the data
+	size_t limit = srclen - ZI_FRAME_HEADER_SIZE - 1;
+	if (limit > dstcap - ZI_FRAME_HEADER_SIZE)
+		limit = dstcap - ZI_FRAME_HEADER_SIZE;
+
+	size_t szblock = ZiCompressBlock(src, srclen, dst + ZI_FRAME_HEADER_SIZE, limit);
+	if (!szblock)
+		return 0;
+
+	dst[0] = ZI_FRAME_COMPRESSED;
+	ZiStoreBE32(dst + 1, (uint32_t)srclen);
+	ZiStoreBE32(dst + 5, (uint32_t)szblock);
+	return ZI_FRAME_HEADER_SIZE + szblock;
+}
+
+/**
+ * @brief Reads the header of a compressed frame.
+ *
+ * @param[in]  data      Frame starting with ZI_FRAME_COMPRESSED
+ * @param[in]  size      Bytes available at data
+ * @param[out] rawsize   Size of the decompressed data
+ * @param[out] framesize Size of the whole frame including the header
+ * @returns ZI_DECODE_OK, ZI_DECODE_TRUNCATED if the frame is incomplete or ZI_DECODE_MALFORMED
+ *          if it isn't a frame or claims a size its block can't decompress to.
+ */
+ZiDecodeStatus_t ZiReadFrameHeader(const uint8_t *data, size_t size, size_t *rawsize, size_t *framesize)
+{
+	if (size && data[0] != ZI_FRAME_COMPRESSED)
+		return ZI_DECODE_MALFORMED;
+	if (size < ZI_FRAME_HEADER_SIZE)
+		return ZI_DECODE_TRUNCATED;
+
+	uint64_t raw   = ZiLoadBE32(data + 1);
+	uint64_t block = ZiLoadBE32(data + 5);
+
+	// A length byte of 255 expands to at most 255 bytes, so anything larger
+	// can't be a real frame and shouldn't get a buffer allocated for it.
+	if (raw > block * 255)
+		return ZI_DECODE_MALFORMED;
+	if (block > size - ZI_FRAME_HEADER_SIZE)
+		return ZI_DECODE_TRUNCATED;
+
+	*rawsize   = raw;
+	*framesize = ZI_FRAME_HEADER_SIZE + block;
+	return ZI_DECODE_OK;
+}
@@ -0,0 +1,298 @@
+/**
+ * @file ziproto.h
+ * @brief Python independent ZiProto encoding and decoding primitives
+ *
+ * This is the core shared by the python module and native programs. It has
+ * no dependency on the python interpreter and builds as libziproto.a and
+ * libziproto.so, see the Makefile next to this directory.
+ */
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ZI_NODISCARD __attribute__((warn_unused_result))
+
+// Value types as defined in:
+// https://github.com/Netkas/ZiProto-Python/blob/master/ziproto/ValueType.py
+typedef enum
+{
+	ZI_NIL_TYPE,
+	ZI_BOOL_TYPE,
+	ZI_INT_TYPE,
+	ZI_FLOAT_TYPE,
+	ZI_BIN_TYPE,
+	ZI_STR_TYPE,
+	ZI_ARRAY_TYPE,
+	ZI_MAP_TYPE,
+	// in the Python version of ZiProto this
+	// does not exist, I had to create it becase
+	// there is no way to differentiate a signed
+	// or unsigned type in C based on value.
+	ZI_UINT_TYPE,
+	// Index of a string written earlier in the same message,
+	// only valid after a ZI_FRAME_STRING_REFS byte.
+	ZI_STRREF_TYPE,
+	// Format bytes that are not part of ZiProto
+	ZI_INVALID_TYPE = 0xFF
+} ZiValueType_t;
+
+typedef enum
+{
+	ZI_POSITIVE_FIXINT = 0x00,
+	ZI_FIXMAP          = 0x80,
+	ZI_FIXARRAY        = 0x90,
+	ZI_FIXSTR          = 0xA0,
+	ZI_NIL             = 0xC0,
+	ZI_FALSE           = 0xC2,
+	ZI_TRUE            = 0xC3,
+	ZI_BIN8            = 0xC4,
+	ZI_BIN16           = 0xC5,
+	ZI_BIN32           = 0xC6,
+	ZI_FLOAT32         = 0xCA,
+	ZI_FLOAT64         = 0xCB,
+	ZI_UINT8           = 0xCC,
+	ZI_UINT16          = 0xCD,
+	ZI_UINT32          = 0xCE,
+	ZI_UINT64          = 0xCF,
+	ZI_INT8            = 0xD0,
+	ZI_INT16           = 0xD1,
+	ZI_INT32           = 0xD2,
+	ZI_INT64           = 0xD3,
+	ZI_STRREF8         = 0xD4,
+	ZI_STRREF16        = 0xD5,
+	ZI_STRREF32        = 0xD6,
+	ZI_STR8            = 0xD9,
+	ZI_STR16           = 0xDA,
+	ZI_STR32           = 0xDB,
+	ZI_ARRAY16         = 0xDC,
+	ZI_ARRAY32         = 0xDD,
+	ZI_MAP16           = 0xDE,
+	ZI_MAP32           = 0xDF,
+	ZI_NEGATIVE_FIXINT = 0xE0
+} ZiProtoFormat_t;
+
+// Unaligned safe big endian loads and stores. memcpy of a constant size
+// compiles to a single move and the swap to a single bswap instruction.
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+# define ZI_BE16(x) __builtin_bswap16(x)
+# define ZI_BE32(x) __builtin_bswap32(x)
+# define ZI_BE64(x) __builtin_bswap64(x)
+#else
+# define ZI_BE16(x) (x)
+# define ZI_BE32(x) (x)
+# define ZI_BE64(x) (x)
+#endif
+
+static inline uint16_t ZiLoadBE16(const uint8_t *data)
+{
+	uint16_t value;
+	memcpy(&value, data, sizeof(value));
+	return ZI_BE16(value);
+}
+
+static inline uint32_t ZiLoadBE32(const uint8_t *data)
+{
+	uint32_t value;
+	memcpy(&value, data, sizeof(value));
+	return ZI_BE32(value);
+}
+
+static inline uint64_t ZiLoadBE64(const uint8_t *data)
+{
+	uint64_t value;
+	memcpy(&value, data, sizeof(value));
+	return ZI_BE64(value);
+}
+
+static inline void ZiStoreBE16(uint8_t *data, uint16_t value)
+{
+	value = ZI_BE16(value);
+	memcpy(data, &value, sizeof(value));
+}
+
+static inline void ZiStoreBE32(uint8_t *data, uint32_t value)
+{
+	value = ZI_BE32(value);
+	memcpy(data, &value, sizeof(value));
+}
+
+static inline void ZiStoreBE64(uint8_t *data, uint64_t value)
+{
+	value = ZI_BE64(value);
+	memcpy(data, &value, sizeof(value));
+}
+
+/**
+ * @struct ZiFormatInfo_t
+ * @brief Layout of the element introduced by a format byte
+ *
+ * An element is the type byte, szlen bytes of big endian length (or element
+ * count for arrays and maps), then szdata bytes of fixed size payload. For
+ * the FIX* formats the length is packed into the type byte under mask.
+ */
+typedef struct
+{
+	/*@{*/
+	uint8_t kind;   /**< ZiValueType_t of the element, ZI_INVALID_TYPE for unused format bytes */
+	uint8_t szlen;  /**< Size of the length field following the type byte */
+	uint8_t szdata; /**< Size of the fixed payload (ints and floats) */
+	uint8_t mask;   /**< Mask extracting the length from FIX* type bytes */
+	/*@}*/
+} ZiFormatInfo_t;
+
+extern const ZiFormatInfo_t ZiFormatTable[256];
+
+// Read a big-endian unsigned integer of `size` bytes
+static inline uint64_t ZiReadUnsigned(const uint8_t *data, int size)
+{
+	switch (size)
+	{
+		case sizeof(uint8_t):  return *data;
+		case sizeof(uint16_t): return ZiLoadBE16(data);
+		case sizeof(uint32_t): return ZiLoadBE32(data);
+		case sizeof(uint64_t): return ZiLoadBE64(data);
+		default:               return 0;
+	}
+}
+
+// Read a big-endian two's complement integer of `size` bytes
+static inline int64_t ZiReadSigned(const uint8_t *data, int size)
+{
+	switch (size)
+	{
+		case sizeof(int8_t):  return (int8_t)*data;
+		case sizeof(int16_t): return (int16_t)ZiLoadBE16(data);
+		case sizeof(int32_t): return (int32_t)ZiLoadBE32(data);
+		case sizeof(int64_t): return (int64_t)ZiLoadBE64(data);
+		default:              return 0;
+	}
+}
+
+// Write a type byte followed by a big-endian integer of `size` bytes, returns the bytes written
+static inline size_t ZiPutUnsigned(uint8_t *header, uint8_t format, int size, uint64_t value)
+{
+	header[0] = format;
+	switch (size)
+	{
+		case sizeof(uint8_t):  header[1] = (uint8_t)value; break;
+		case sizeof(uint16_t): ZiStoreBE16(header + 1, (uint16_t)value); break;
+		case sizeof(uint32_t): ZiStoreBE32(header + 1, (uint32_t)value); break;
+		default:               ZiStoreBE64(header + 1, value); break;
+	}
+	return sizeof(uint8_t) + size;
+}
+
+/**
+ * @struct ZiStats_t
+ * @brief Encoder counters, updated through every handle pointing at them
+ */
+typedef struct
+{
+	/*@{*/
+	uint64_t reallocs;      /**< Times an encode buffer had to grow */
+	uint64_t reallocbytes;  /**< Bytes added to encode buffers by growing them */
+	uint64_t peakalloc;     /**< Largest encode buffer grown to */
+	uint64_t formats[256];  /**< Encoded elements by ZiProtoFormat_t type byte */
+	/*@}*/
+} ZiStats_t;
+
+/**
+ * @struct ZiHandle_t
+ * @brief Handle to ZiProto state and encoded data
+ */
+typedef struct 
+{
+	/*@{*/
+	size_t szEncodedData;   /**< Size of the raw ZiProto data buffer */
+	size_t _allocsz;        /**< Allocated size of the EncodedData object */
+	size_t _cursor;         /**< Current position in the EncodedData buffer */
+	uint8_t *EncodedData;   /**< Raw ZiProto encoded data */
+	bool _fixed;            /**< EncodedData is caller owned, never realloc or free it */
+	ZiStats_t *stats;       /**< Counters to update while encoding, null to collect none */
+	/*@}*/
+} ZiHandle_t;
+
+/**
+ * @struct ZiValue_t
+ * @brief One element read by ZiReadNext
+ */
+typedef struct
+{
+	/*@{*/
+	ZiValueType_t vType;    /**< Type of the element */
+	union
+	{
+		uint64_t u;         /**< ZI_UINT_TYPE value or ZI_STRREF_TYPE index */
+		int64_t  i;         /**< ZI_INT_TYPE value */
+		double   f;         /**< ZI_FLOAT_TYPE value */
+		bool     b;         /**< ZI_BOOL_TYPE value */
+	} value;
+	const uint8_t *data;    /**< ZI_STR_TYPE and ZI_BIN_TYPE payload, points into the handle's buffer */
+	uint64_t length;        /**< Bytes of STR/BIN payload, elements of an ARRAY or entries of a MAP */
+	/*@}*/
+} ZiValue_t;
+
+// Deepest nesting ZiValidateNext can check, its stack lives on the C stack
+#define ZI_MAX_DEPTH 1024
+
+// First byte of a compressed frame, a format byte ZiProto doesn't use
+#define ZI_FRAME_COMPRESSED 0xC7
+// The frame byte followed by the 32 bit decompressed and compressed sizes
+#define ZI_FRAME_HEADER_SIZE 9
+// First byte of a message whose strings are numbered in order of appearance,
+// later copies of a string can be written as a STRREF of its number
+#define ZI_FRAME_STRING_REFS 0xC8
+
+typedef enum
+{
+	ZI_DECODE_OK,        // A complete object was decoded
+	ZI_DECODE_TRUNCATED, // Ran out of data, the cursor points at the incomplete element
+	ZI_DECODE_MALFORMED, // The cursor points at a byte that isn't a valid format
+	ZI_DECODE_TOO_DEEP,  // The cursor points at a container nested deeper than allowed
+	ZI_DECODE_ERROR      // Failure reported by the caller (a python exception in the module)
+} ZiDecodeStatus_t;
+
+// Handle lifecycle
+extern ZiHandle_t *ZiAllocHandle(size_t size);
+extern void ZiFreeHandle(ZiHandle_t *handle);
+
+// Encoding
+extern ZiHandle_t ZI_NODISCARD *ZiEncodeTypeSingle(ZiHandle_t *handle, ZiValueType_t vType, const void *TypeBuffer, size_t szTypeBuffer);
+extern size_t ZiSizeTypeSingle(ZiValueType_t vType, const void *TypeBuffer, size_t szTypeBuffer);
+extern ZiHandle_t ZI_NODISCARD *ZiEncodeNumberArray(ZiHandle_t *handle, ZiValueType_t vType, size_t itemsize, const void *items, size_t count);
+extern size_t ZiSizeNumberArray(ZiValueType_t vType, size_t itemsize, const void *items, size_t count);
+extern ZiHandle_t ZI_NODISCARD *ZiEncodeRaw(ZiHandle_t *handle, const void *data, size_t size);
+
+// Decoding
+extern ZiDecodeStatus_t ZiReadNext(ZiHandle_t *handle, ZiValue_t *value);
+extern ZiDecodeStatus_t ZiSkipNext(ZiHandle_t *handle);
+extern ZiDecodeStatus_t ZiSkipMessage(ZiHandle_t *handle);
+extern ZiDecodeStatus_t ZiValidateNext(ZiHandle_t *handle, size_t maxdepth);
+
+// Strings
+extern bool ZiIsAscii(const uint8_t *data, size_t length);
+
+// Compression
+extern size_t ZiCompressBound(size_t size);
+extern size_t ZiCompressBlock(const uint8_t *src, size_t srclen, uint8_t *dst, size_t dstcap);
+extern ZiDecodeStatus_t ZiDecompressBlock(const uint8_t *src, size_t srclen, uint8_t *dst, size_t dstlen);
+extern size_t ZiCompressFrame(const uint8_t *src, size_t srclen, uint8_t *dst, size_t dstcap);
+extern ZiDecodeStatus_t ZiReadFrameHeader(const uint8_t *data, size_t size, size_t *rawsize, size_t *framesize);
+
+// Macros to make things seem function-like
+#define ZiGetSize(x) ((x)->szEncodedData)
+#define ZiGetData(x) ((x)->EncodedData)
+#define ZiGetCursor(x) ((x)->_cursor)
+#define ZiSetCursor(x, offset) ((x)->_cursor = (offset))
+
+
+#ifdef __cplusplus
+}
+#endif
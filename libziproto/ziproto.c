@@ -0,0 +1,944 @@
+#include "ziproto.h"
+#include <tgmath.h> // For fabs()
+
+#if defined(__AVX2__) || defined(__SSE2__)
+# include <immintrin.h>
+#endif
+
+#define likely(x)      __builtin_expect(!!(x), 1)
+#define unlikely(x)    __builtin_expect(!!(x), 0)
+
+// Element layout for every format byte, see ZiFormatInfo_t.
+const ZiFormatInfo_t ZiFormatTable[256] = {
+	[ZI_POSITIVE_FIXINT ... 0x7F]       = { ZI_UINT_TYPE,    0, 0, 0 },
+	[ZI_FIXMAP ... ZI_FIXMAP + 0xF]     = { ZI_MAP_TYPE,     0, 0, 0x0F },
+	[ZI_FIXARRAY ... ZI_FIXARRAY + 0xF] = { ZI_ARRAY_TYPE,   0, 0, 0x0F },
+	[ZI_FIXSTR ... ZI_FIXSTR + 0x1F]    = { ZI_STR_TYPE,     0, 0, 0x1F },
+	[ZI_NIL]                            = { ZI_NIL_TYPE,     0, 0, 0 },
+	[0xC1]                              = { ZI_INVALID_TYPE, 0, 0, 0 },
+	[ZI_FALSE]                          = { ZI_BOOL_TYPE,    0, 0, 0 },
+	[ZI_TRUE]                           = { ZI_BOOL_TYPE,    0, 0, 0 },
+	[ZI_BIN8]                           = { ZI_BIN_TYPE,     sizeof(uint8_t),  0, 0 },
+	[ZI_BIN16]                          = { ZI_BIN_TYPE,     sizeof(uint16_t), 0, 0 },
+	[ZI_BIN32]                          = { ZI_BIN_TYPE,     sizeof(uint32_t), 0, 0 },
+	[0xC7 ... 0xC9]                     = { ZI_INVALID_TYPE, 0, 0, 0 },
+	[ZI_FLOAT32]                        = { ZI_FLOAT_TYPE,   0, sizeof(float),  0 },
+	[ZI_FLOAT64]                        = { ZI_FLOAT_TYPE,   0, sizeof(double), 0 },
+	[ZI_UINT8]                          = { ZI_UINT_TYPE,    0, sizeof(uint8_t),  0 },
+	[ZI_UINT16]                         = { ZI_UINT_TYPE,    0, sizeof(uint16_t), 0 },
+	[ZI_UINT32]                         = { ZI_UINT_TYPE,    0, sizeof(uint32_t), 0 },
+	[ZI_UINT64]                         = { ZI_UINT_TYPE,    0, sizeof(uint64_t), 0 },
+	[ZI_INT8]                           = { ZI_INT_TYPE,     0, sizeof(int8_t),  0 },
+	[ZI_INT16]                          = { ZI_INT_TYPE,     0, sizeof(int16_t), 0 },
+	[ZI_INT32]                          = { ZI_INT_TYPE,     0, sizeof(int32_t), 0 },
+	[ZI_INT64]                          = { ZI_INT_TYPE,     0, sizeof(int64_t), 0 },
+	[ZI_STRREF8]                        = { ZI_STRREF_TYPE,  0, sizeof(uint8_t),  0 },
+	[ZI_STRREF16]                       = { ZI_STRREF_TYPE,  0, sizeof(uint16_t), 0 },
+	[ZI_STRREF32]                       = { ZI_STRREF_TYPE,  0, sizeof(uint32_t), 0 },
+	[0xD7 ... 0xD8]                     = { ZI_INVALID_TYPE, 0, 0, 0 },
+	[ZI_STR8]                           = { ZI_STR_TYPE,     sizeof(uint8_t),  0, 0 },
+	[ZI_STR16]                          = { ZI_STR_TYPE,     sizeof(uint16_t), 0, 0 },
+	[ZI_STR32]                          = { ZI_STR_TYPE,     sizeof(uint32_t), 0, 0 },
+	[ZI_ARRAY16]                        = { ZI_ARRAY_TYPE,   sizeof(uint16_t), 0, 0 },
+	[ZI_ARRAY32]                        = { ZI_ARRAY_TYPE,   sizeof(uint32_t), 0, 0 },
+	[ZI_MAP16]                          = { ZI_MAP_TYPE,     sizeof(uint16_t), 0, 0 },
+	[ZI_MAP32]                          = { ZI_MAP_TYPE,     sizeof(uint32_t), 0, 0 },
+	[ZI_NEGATIVE_FIXINT ... 0xFF]       = { ZI_INT_TYPE,     0, 0, 0 },
+};
+
+/**
+ * @brief Allocates an empty ZiHandle_t.
+ *
+ * @param[in] size Initial capacity of the encoded data buffer in bytes.
+ * @returns The new handle or null if the allocation failed.
+ */
+ZiHandle_t *ZiAllocHandle(size_t size)
+{
+	ZiHandle_t *handle = malloc(sizeof(ZiHandle_t));
+	if (unlikely(!handle))
+		return NULL;
+
+	memset(handle, 0, sizeof(ZiHandle_t));
+	if (size)
+	{
+		handle->EncodedData = malloc(size);
+		if (unlikely(!handle->EncodedData))
+		{
+			free(handle);
+			return NULL;
+		}
+		handle->_allocsz = size;
+	}
+	return handle;
+}
+
+/**
+ * @brief Frees a ZiHandle_t and, unless it is caller owned, its encoded data.
+ */
+void ZiFreeHandle(ZiHandle_t *handle)
+{
+	if (!handle)
+		return;
+	if (!handle->_fixed)
+		free(handle->EncodedData);
+	free(handle);
+}
+
+/**
+ * @brief Makes room for size more bytes of encoded data.
+ *
+ * @param[in] handle The ZiHandle object to grow
+ * @param[in] size   Number of bytes about to be appended
+ * @returns false if the handle is fixed and too small or the allocation failed.
+ */
+static bool ReserveZiHandle(ZiHandle_t *handle, size_t size)
+{
+	if (likely(handle->_allocsz >= handle->szEncodedData + size))
+		return true;
+
+	// Fixed buffers belong to someone else and can't grow.
+	if (unlikely(handle->_fixed))
+		return false;
+
+	size_t newsz = handle->_allocsz + size;
+	newsz += newsz + (newsz & 7);
+	// Add 8 byte alignment to help reduce the number of realloc calls.
+	void *newdata = realloc(handle->EncodedData, newsz);
+	if (unlikely(!newdata))
+		return false;
+
+	// Null out the new space
+	memset(((uint8_t*)newdata) + handle->_allocsz, 0, newsz - handle->_allocsz);
+
+	if (unlikely(handle->stats))
+	{
+		handle->stats->reallocs++;
+		handle->stats->reallocbytes += newsz - handle->_allocsz;
+		if (newsz > handle->stats->peakalloc)
+			handle->stats->peakalloc = newsz;
+	}
+
+	// Update our handle object.
+	handle->EncodedData = newdata;
+	handle->_allocsz    = newsz;
+	return true;
+}
+
+// Largest finite float, doubles within it are written as ZI_FLOAT32
+#define ZI_FLOAT32_MAX 340282346638528859811704183484516925440.000000
+
+// Write the smallest encoding of an unsigned integer, returns the bytes written
+static inline size_t PutUInt(uint8_t *out, uint64_t value)
+{
+	if (value <= 0x7F)
+	{
+		out[0] = (uint8_t)value;
+		return sizeof(uint8_t);
+	}
+	else if (value <= 0xFF)
+		return ZiPutUnsigned(out, ZI_UINT8, sizeof(uint8_t), value);
+	else if (value <= 0xFFFF)
+		return ZiPutUnsigned(out, ZI_UINT16, sizeof(uint16_t), value);
+	else if (value <= 0xFFFFFFFF)
+		return ZiPutUnsigned(out, ZI_UINT32, sizeof(uint32_t), value);
+	return ZiPutUnsigned(out, ZI_UINT64, sizeof(uint64_t), value);
+}
+
+// Write the smallest encoding of a negative integer, returns the bytes written
+static inline size_t PutInt(uint8_t *out, int64_t value)
+{
+	// Two's complement truncation keeps the sign for every width we pick
+	if (value >= -32)
+	{
+		out[0] = (uint8_t)value;
+		return sizeof(uint8_t);
+	}
+	else if (value >= -128)
+		return ZiPutUnsigned(out, ZI_INT8, sizeof(int8_t), (uint64_t)value);
+	else if (value >= -32768)
+		return ZiPutUnsigned(out, ZI_INT16, sizeof(int16_t), (uint64_t)value);
+	else if (value >= -2147483648)
+		return ZiPutUnsigned(out, ZI_INT32, sizeof(int32_t), (uint64_t)value);
+	return ZiPutUnsigned(out, ZI_INT64, sizeof(int64_t), (uint64_t)value);
+}
+
+static inline size_t PutFloat(uint8_t *out, float value)
+{
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	out[0] = ZI_FLOAT32;
+	ZiStoreBE32(out + 1, bits);
+	return sizeof(uint8_t) + sizeof(float);
+}
+
+// Write a double, as a ZI_FLOAT32 whenever it is in range
+static inline size_t PutDouble(uint8_t *out, double value)
+{
+	// Fun: https://evanw.github.io/float-toy/
+	// Maybe some day this comparison can be done with
+	// integer values or something to make it faster but oh well.
+	// ref: https://stackoverflow.com/a/16857716
+	// Written so NaN fails the test and keeps its full payload as a float64
+	if (fabs(value) <= ZI_FLOAT32_MAX)
+		return PutFloat(out, (float)value);
+
+	uint64_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	out[0] = ZI_FLOAT64;
+	ZiStoreBE64(out + 1, bits);
+	return sizeof(uint8_t) + sizeof(double);
+}
+
+static inline size_t UIntSize(uint64_t value)
+{
+	if (value <= 0x7F)
+		return sizeof(uint8_t);
+	else if (value <= 0xFF)
+		return sizeof(uint8_t) + sizeof(uint8_t);
+	else if (value <= 0xFFFF)
+		return sizeof(uint8_t) + sizeof(uint16_t);
+	else if (value <= 0xFFFFFFFF)
+		return sizeof(uint8_t) + sizeof(uint32_t);
+	return sizeof(uint8_t) + sizeof(uint64_t);
+}
+
+static inline size_t IntSize(int64_t value)
+{
+	if (value >= -32)
+		return sizeof(uint8_t);
+	else if (value >= -128)
+		return sizeof(uint8_t) + sizeof(int8_t);
+	else if (value >= -32768)
+		return sizeof(uint8_t) + sizeof(int16_t);
+	else if (value >= -2147483648)
+		return sizeof(uint8_t) + sizeof(int32_t);
+	return sizeof(uint8_t) + sizeof(int64_t);
+}
+
+static inline size_t DoubleSize(double value)
+{
+	return fabs(value) <= ZI_FLOAT32_MAX ? sizeof(uint8_t) + sizeof(float) : sizeof(uint8_t) + sizeof(double);
+}
+
+/**
+ * @brief Computes the number of bytes ZiEncodeTypeSingle will write.
+ *
+ * This must make exactly the same choices as ZiEncodeTypeSingle so that a
+ * buffer sized from it never has to grow.
+ *
+ * @param[in] vType        The type of the object about to be encoded
+ * @param[in] TypeBuffer   The raw platform-dependent data being encoded
+ * @param[in] szTypeBuffer Size of the data in TypeBuffer.
+ * @returns The encoded size in bytes or 0 if the value can't be encoded.
+ */
+size_t ZiSizeTypeSingle(ZiValueType_t vType, const void *TypeBuffer, size_t szTypeBuffer)
+{
+	switch (vType)
+	{
+		case ZI_NIL_TYPE:
+		case ZI_BOOL_TYPE:
+			return sizeof(uint8_t);
+		case ZI_UINT_TYPE:
+			return UIntSize(*(uint64_t *)TypeBuffer);
+		case ZI_INT_TYPE:
+			return IntSize(*(int64_t *)TypeBuffer);
+		case ZI_FLOAT_TYPE:
+			if (szTypeBuffer > sizeof(float))
+				return DoubleSize(*(double *)TypeBuffer);
+			return sizeof(uint8_t) + sizeof(float);
+		case ZI_BIN_TYPE:
+			if (!TypeBuffer || !szTypeBuffer || szTypeBuffer <= 0xFF)
+				return sizeof(uint8_t) + sizeof(uint8_t) + szTypeBuffer;
+			else if (szTypeBuffer <= 0xFFFF)
+				return sizeof(uint8_t) + sizeof(uint16_t) + szTypeBuffer;
+			else if (szTypeBuffer <= 0xFFFFFFFF)
+				return sizeof(uint8_t) + sizeof(uint32_t) + szTypeBuffer;
+			return 0;
+		case ZI_STR_TYPE:
+			if (!TypeBuffer || szTypeBuffer < 32)
+				return sizeof(uint8_t) + szTypeBuffer;
+			else if (szTypeBuffer <= 0xFF)
+				return sizeof(uint8_t) + sizeof(uint8_t) + szTypeBuffer;
+			else if (szTypeBuffer <= 0xFFFF)
+				return sizeof(uint8_t) + sizeof(uint16_t) + szTypeBuffer;
+			else if (szTypeBuffer <= 0xFFFFFFFF)
+				return sizeof(uint8_t) + sizeof(uint32_t) + szTypeBuffer;
+			return 0;
+		case ZI_STRREF_TYPE:
+		{
+			uint64_t index = *(uint64_t *)TypeBuffer;
+			if (index <= 0xFF)
+				return sizeof(uint8_t) + sizeof(uint8_t);
+			else if (index <= 0xFFFF)
+				return sizeof(uint8_t) + sizeof(uint16_t);
+			else if (index <= 0xFFFFFFFF)
+				return sizeof(uint8_t) + sizeof(uint32_t);
+			return 0;
+		}
+		case ZI_ARRAY_TYPE:
+		case ZI_MAP_TYPE:
+		{
+			uint64_t length = *(uint64_t *)TypeBuffer;
+			if (length <= 0xF)
+				return sizeof(uint8_t);
+			else if (length <= 0xFFFF)
+				return sizeof(uint8_t) + sizeof(uint16_t);
+			else if (length <= 0xFFFFFFFF)
+				return sizeof(uint8_t) + sizeof(uint32_t);
+			return 0;
+		}
+		default:
+			return 0;
+	}
+}
+
+/**
+ * @brief Encodes POD types to ZiProto bytes.
+ *
+ * This function encodes different Plain-ol-Data (POD) types into the ZiProto format.
+ * These types are ints, floats, bools, strings, and "Null" but not the array and map
+ * types which will be encoded in a separate function that calls this function
+ *
+ * @param[in] handle       The ZiHandle object with current encoding state
+ * @param[in] Type         The type of the object about to be encoded
+ * @param[in] TypeBuffer   The raw platform-dependent data being encoded
+ * @param[in] szTypeBuffer Size of the data in TypeBuffer.
+ * @returns ZiHandle_t object with the updated state (may be reallocated) or null on failure.
+ */
+ZiHandle_t ZI_NODISCARD *ZiEncodeTypeSingle(ZiHandle_t *handle, ZiValueType_t vType, const void *TypeBuffer, size_t szTypeBuffer)
+{
+	// The type byte followed by up to 8 bytes of big endian length or value,
+	// anything longer (STR and BIN bodies) is copied from TypeBuffer afterwards.
+	uint8_t     header[1 + sizeof(uint64_t)];
+	size_t      szheader  = sizeof(uint8_t);
+	const void *payload   = NULL;
+	size_t      szpayload = 0;
+
+	switch (vType)
+	{ 
+		case ZI_NIL_TYPE:
+			header[0] = ZI_NIL;
+			break;
+		case ZI_BOOL_TYPE:
+			header[0] = *(bool *)TypeBuffer ? ZI_TRUE : ZI_FALSE;
+			break;
+		case ZI_UINT_TYPE:
+			szheader = PutUInt(header, *(uint64_t *)TypeBuffer);
+			break;
+		case ZI_INT_TYPE:
+			szheader = PutInt(header, *(int64_t *)TypeBuffer);
+			break;
+		case ZI_FLOAT_TYPE:
+			if (szTypeBuffer > sizeof(float))
+				szheader = PutDouble(header, *(double *)TypeBuffer);
+			else
+				szheader = PutFloat(header, *(float *)TypeBuffer);
+			break;
+		case ZI_BIN_TYPE:
+			if (!TypeBuffer)
+				szTypeBuffer = 0;
+
+			if (szTypeBuffer <= 0xFF)
+				szheader = ZiPutUnsigned(header, ZI_BIN8, sizeof(uint8_t), szTypeBuffer);
+			else if (szTypeBuffer <= 0xFFFF)
+				szheader = ZiPutUnsigned(header, ZI_BIN16, sizeof(uint16_t), szTypeBuffer);
+			else if (szTypeBuffer <= 0xFFFFFFFF)
+				szheader = ZiPutUnsigned(header, ZI_BIN32, sizeof(uint32_t), szTypeBuffer);
+			else
+				return NULL;
+			payload = TypeBuffer, szpayload = szTypeBuffer;
+			break;
+		case ZI_STR_TYPE:
+			if (!TypeBuffer)
+				szTypeBuffer = 0;
+
+			if (szTypeBuffer < 32)
+				header[0] = ZI_FIXSTR + (uint8_t)szTypeBuffer;
+			else if (szTypeBuffer <= 0xFF)
+				szheader = ZiPutUnsigned(header, ZI_STR8, sizeof(uint8_t), szTypeBuffer);
+			else if (szTypeBuffer <= 0xFFFF)
+				szheader = ZiPutUnsigned(header, ZI_STR16, sizeof(uint16_t), szTypeBuffer);
+			else if (szTypeBuffer <= 0xFFFFFFFF)
+				szheader = ZiPutUnsigned(header, ZI_STR32, sizeof(uint32_t), szTypeBuffer);
+			else
+				return NULL;
+			payload = TypeBuffer, szpayload = szTypeBuffer;
+			break;
+		case ZI_STRREF_TYPE:
+		{
+			uint64_t index = *(uint64_t *)TypeBuffer;
+			if (index <= 0xFF)
+				szheader = ZiPutUnsigned(header, ZI_STRREF8, sizeof(uint8_t), index);
+			else if (index <= 0xFFFF)
+				szheader = ZiPutUnsigned(header, ZI_STRREF16, sizeof(uint16_t), index);
+			else if (index <= 0xFFFFFFFF)
+				szheader = ZiPutUnsigned(header, ZI_STRREF32, sizeof(uint32_t), index);
+			else
+				return NULL;
+			break;
+		}
+		// Arrays and maps only write their header, the caller
+		// encodes the elements that follow.
+		case ZI_ARRAY_TYPE:
+		case ZI_MAP_TYPE:
+		{
+			uint64_t length = *(uint64_t *)TypeBuffer;
+			bool     ismap  = vType == ZI_MAP_TYPE;
+			if (length <= 0xF)
+				header[0] = (ismap ? ZI_FIXMAP : ZI_FIXARRAY) + (uint8_t)length;
+			else if (length <= 0xFFFF)
+				szheader = ZiPutUnsigned(header, ismap ? ZI_MAP16 : ZI_ARRAY16, sizeof(uint16_t), length);
+			else if (length <= 0xFFFFFFFF)
+				szheader = ZiPutUnsigned(header, ismap ? ZI_MAP32 : ZI_ARRAY32, sizeof(uint32_t), length);
+			else
+				return NULL;
+			break;
+		}
+		default:
+			return NULL;
+	}
+
+	// If the handle doesn't exist, create one.
+	// The size of the handle includes the length of the data as well
+	// In this instance we allocate the size of the ZiHandle_t struct
+	// plus the size of the byte we're about to encode as well as the
+	// size of the ZiProtoFormat_t type byte.
+	size_t szNextSize = szheader + szpayload;
+	bool wasallocated = false;
+	if (unlikely(!handle))
+	{
+		handle = malloc(sizeof(ZiHandle_t));
+		memset(handle, 0, sizeof(ZiHandle_t));
+		handle->EncodedData = malloc(szNextSize);
+		memset(handle->EncodedData, 0, szNextSize);
+		handle->_allocsz = szNextSize;
+		wasallocated = true;
+	}
+	
+	// We'll need to realloc if this is true, it's likely this will happen.
+	if (unlikely(!ReserveZiHandle(handle, szNextSize)))
+	{
+		// Don't memleak on failure
+		if (wasallocated)
+			ZiFreeHandle(handle);
+		return NULL;
+	}
+
+	// Write the header then the body (if applicable)
+	uint8_t *out = handle->EncodedData + handle->_cursor;
+	memcpy(out, header, szheader);
+	if (szpayload)
+		memcpy(out + szheader, payload, szpayload);
+
+	handle->_cursor       += szNextSize;
+	handle->szEncodedData += szNextSize;
+
+	if (unlikely(handle->stats))
+		handle->stats->formats[header[0]]++;
+
+	// We're done!
+	return handle;
+}
+
+// Signed array items that aren't negative are written as UINTs, like python ints
+static inline size_t SignedSize(int64_t value) { return value < 0 ? IntSize(value) : UIntSize(value); }
+static inline size_t PutSigned(uint8_t *out, int64_t value) { return value < 0 ? PutInt(out, value) : PutUInt(out, value); }
+static inline size_t BoolSize(bool value) { (void)value; return sizeof(uint8_t); }
+
+static inline size_t PutBool(uint8_t *out, bool value)
+{
+	out[0] = value ? ZI_TRUE : ZI_FALSE;
+	return sizeof(uint8_t);
+}
+
+// Picks the loop for the item type, LOOP(ctype, sizefunc, putfunc) is defined by the caller.
+// float items go through the double path so infinities and NaN come out as they would from python.
+#define NUMBER_CASES                                                     \
+	case ZI_INT_TYPE * 16 + 1:   LOOP(int8_t,   SignedSize, PutSigned)     \
+	case ZI_INT_TYPE * 16 + 2:   LOOP(int16_t,  SignedSize, PutSigned)     \
+	case ZI_INT_TYPE * 16 + 4:   LOOP(int32_t,  SignedSize, PutSigned)     \
+	case ZI_INT_TYPE * 16 + 8:   LOOP(int64_t,  SignedSize, PutSigned)     \
+	case ZI_UINT_TYPE * 16 + 1:  LOOP(uint8_t,  UIntSize,   PutUInt)       \
+	case ZI_UINT_TYPE * 16 + 2:  LOOP(uint16_t, UIntSize,   PutUInt)       \
+	case ZI_UINT_TYPE * 16 + 4:  LOOP(uint32_t, UIntSize,   PutUInt)       \
+	case ZI_UINT_TYPE * 16 + 8:  LOOP(uint64_t, UIntSize,   PutUInt)       \
+	case ZI_FLOAT_TYPE * 16 + 4: LOOP(float,    DoubleSize, PutDouble)     \
+	case ZI_FLOAT_TYPE * 16 + 8: LOOP(double,   DoubleSize, PutDouble)     \
+	case ZI_BOOL_TYPE * 16 + 1:  LOOP(bool,     BoolSize,   PutBool)
+
+// Items may be unaligned (memoryview slices, packed structs) so they're loaded with memcpy
+#define LOAD_ITEM(ctype, items, i, v) \
+	ctype v;                          \
+	memcpy(&v, (const uint8_t *)(items) + (i) * sizeof(ctype), sizeof(v))
+
+/**
+ * @brief Computes the number of bytes ZiEncodeNumberArray will write.
+ *
+ * @param[in] vType    ZI_INT_TYPE, ZI_UINT_TYPE, ZI_FLOAT_TYPE or ZI_BOOL_TYPE
+ * @param[in] itemsize Size of each item: 1, 2, 4 or 8 for integers, 4 or 8 for floats, 1 for bools
+ * @param[in] items    The items in native byte order
+ * @param[in] count    Number of items
+ * @returns The encoded size in bytes or 0 if the array can't be encoded.
+ */
+size_t ZiSizeNumberArray(ZiValueType_t vType, size_t itemsize, const void *items, size_t count)
+{
+	uint64_t length = count;
+	size_t   size   = ZiSizeTypeSingle(ZI_ARRAY_TYPE, &length, sizeof(length));
+	if (!size || itemsize > 8)
+		return 0;
+
+#define LOOP(ctype, sizefunc, putfunc)     \
+	for (size_t i = 0; i < count; ++i)     \
+	{                                      \
+		LOAD_ITEM(ctype, items, i, v);     \
+		size += sizefunc(v);               \
+	}                                      \
+	return size;
+
+	switch (vType * 16 + itemsize)
+	{
+		NUMBER_CASES
+		default:
+			return 0;
+	}
+#undef LOOP
+}
+
+/**
+ * @brief Encodes a native array of numbers as a ZiProto array.
+ *
+ * Produces exactly what encoding each item with ZiEncodeTypeSingle would, but
+ * writes the array header once, reserves the whole output up front and runs
+ * one tight loop over the raw items.
+ *
+ * @param[in] handle   The ZiHandle object with current encoding state
+ * @param[in] vType    ZI_INT_TYPE, ZI_UINT_TYPE, ZI_FLOAT_TYPE or ZI_BOOL_TYPE
+ * @param[in] itemsize Size of each item: 1, 2, 4 or 8 for integers, 4 or 8 for floats, 1 for bools
+ * @param[in] items    The items in native byte order
+ * @param[in] count    Number of items
+ * @returns ZiHandle_t object with the updated state or null on failure.
+ */
+ZiHandle_t ZI_NODISCARD *ZiEncodeNumberArray(ZiHandle_t *handle, ZiValueType_t vType, size_t itemsize, const void *items, size_t count)
+{
+	size_t size = ZiSizeNumberArray(vType, itemsize, items, count);
+	if (unlikely(!size || !handle || !ReserveZiHandle(handle, size)))
+		return NULL;
+
+	uint64_t length = count;
+	if (unlikely(!ZiEncodeTypeSingle(handle, ZI_ARRAY_TYPE, &length, sizeof(length))))
+		return NULL;
+
+	uint8_t *start = handle->EncodedData + handle->_cursor, *out = start;
+
+#define LOOP(ctype, sizefunc, putfunc)     \
+	for (size_t i = 0; i < count; ++i)     \
+	{                                      \
+		LOAD_ITEM(ctype, items, i, v);     \
+		out += putfunc(out, v);            \
+	}                                      \
+	break;
+
+	switch (vType * 16 + itemsize)
+	{
+		NUMBER_CASES
+	}
+#undef LOOP
+
+	// Items are all scalars, so each one is its type byte plus a fixed size payload.
+	if (unlikely(handle->stats))
+	{
+		for (const uint8_t *item = start; item < out; item += 1 + ZiFormatTable[*item].szdata)
+			handle->stats->formats[*item]++;
+	}
+
+	handle->_cursor       += out - start;
+	handle->szEncodedData += out - start;
+	return handle;
+}
+
+#undef LOAD_ITEM
+#undef NUMBER_CASES
+
+/**
+ * @brief Appends data that is already ZiProto encoded.
+ *
+ * @param[in] handle The ZiHandle object with current encoding state
+ * @param[in] data   The encoded bytes, usually a cached encoding of a common value
+ * @param[in] size   Number of bytes to append
+ * @returns ZiHandle_t object with the updated state or null on failure.
+ */
+ZiHandle_t ZI_NODISCARD *ZiEncodeRaw(ZiHandle_t *handle, const void *data, size_t size)
+{
+	if (unlikely(!handle || !ReserveZiHandle(handle, size)))
+		return NULL;
+
+	memcpy(handle->EncodedData + handle->_cursor, data, size);
+	handle->_cursor       += size;
+	handle->szEncodedData += size;
+	return handle;
+}
+
+/**
+ * @brief Reads the element at the cursor and advances past it.
+ *
+ * Scalars are read completely, STR and BIN payloads are returned as pointers
+ * into the handle's buffer. For arrays and maps only the header is read and
+ * length is set to the number of elements (or entries) that follow, which
+ * the caller reads with further calls. The cursor is only advanced when the
+ * whole element (or header) is inside the buffer. An array or map that claims
+ * more elements than there are bytes left is reported as truncated.
+ *
+ * @param[in]  handle The ZiHandle object with the current decoding state
+ * @param[out] value  The element read
+ * @returns ZI_DECODE_OK, ZI_DECODE_TRUNCATED or ZI_DECODE_MALFORMED with the cursor unchanged.
+ */
+ZiDecodeStatus_t ZiReadNext(ZiHandle_t *handle, ZiValue_t *value)
+{
+	if (unlikely(handle->_cursor >= handle->szEncodedData))
+		return ZI_DECODE_TRUNCATED;
+
+	const uint8_t        *data   = handle->EncodedData + handle->_cursor + 1;
+	uint8_t               byte   = data[-1];
+	const ZiFormatInfo_t *format = &ZiFormatTable[byte];
+	// Bytes available after the type byte
+	size_t                avail  = handle->szEncodedData - handle->_cursor - 1;
+	uint64_t              length = byte & format->mask;
+
+	if (unlikely(format->kind == ZI_INVALID_TYPE))
+		return ZI_DECODE_MALFORMED;
+
+	if (format->szlen)
+	{
+		if (unlikely(format->szlen > avail))
+			return ZI_DECODE_TRUNCATED;
+		length = ZiReadUnsigned(data, format->szlen);
+		data  += format->szlen;
+		avail -= format->szlen;
+	}
+
+	if (unlikely(format->szdata > avail))
+		return ZI_DECODE_TRUNCATED;
+
+	value->vType  = format->kind;
+	value->data   = NULL;
+	value->length = 0;
+	size_t used   = format->szlen + format->szdata;
+
+	switch (format->kind)
+	{
+		case ZI_NIL_TYPE:
+			break;
+		case ZI_BOOL_TYPE:
+			value->value.b = byte == ZI_TRUE;
+			break;
+		case ZI_UINT_TYPE:
+			value->value.u = format->szdata ? ZiReadUnsigned(data, format->szdata) : byte;
+			break;
+		case ZI_STRREF_TYPE:
+			value->value.u = ZiReadUnsigned(data, format->szdata);
+			break;
+		case ZI_INT_TYPE:
+			value->value.i = format->szdata ? ZiReadSigned(data, format->szdata) : (int8_t)byte;
+			break;
+		case ZI_FLOAT_TYPE:
+			if (byte == ZI_FLOAT32)
+			{
+				uint32_t bits = ZiLoadBE32(data);
+				float fvalue;
+				memcpy(&fvalue, &bits, sizeof(fvalue));
+				value->value.f = fvalue;
+			}
+			else
+			{
+				uint64_t bits = ZiLoadBE64(data);
+				memcpy(&value->value.f, &bits, sizeof(double));
+			}
+			break;
+		case ZI_STR_TYPE:
+		case ZI_BIN_TYPE:
+			if (unlikely(length > avail))
+				return ZI_DECODE_TRUNCATED;
+			value->data   = data;
+			value->length = length;
+			used         += length;
+			break;
+		case ZI_ARRAY_TYPE:
+		case ZI_MAP_TYPE:
+			// Every element takes at least one byte so a header claiming more
+			// elements than there are bytes left can never be satisfied.
+			if (unlikely(length > avail || (format->kind == ZI_MAP_TYPE && length * 2 > avail)))
+				return ZI_DECODE_TRUNCATED;
+			value->length = length;
+			break;
+		default:
+			return ZI_DECODE_MALFORMED;
+	}
+
+	handle->_cursor += sizeof(uint8_t) + used;
+	return ZI_DECODE_OK;
+}
+
+/**
+ * @brief Advances the cursor past one complete element without decoding it.
+ *
+ * Nested arrays and maps are skipped by counting the elements still pending
+ * rather than keeping a stack, so this never allocates and never touches the
+ * python API. It's safe to call with the GIL released.
+ *
+ * @param[in] handle The ZiHandle object with the current decoding state
+ * @returns ZI_DECODE_OK with the cursor after the element, otherwise
+ *          ZI_DECODE_TRUNCATED or ZI_DECODE_MALFORMED with the cursor at the offending element.
+ */
+ZiDecodeStatus_t ZiSkipNext(ZiHandle_t *handle)
+{
+	const uint8_t *data    = handle->EncodedData;
+	const size_t   end     = handle->szEncodedData;
+	size_t         cursor  = handle->_cursor;
+	uint64_t       pending = 1;
+
+	while (pending)
+	{
+		// Every pending element needs at least its type byte.
+		if (unlikely(pending > end - cursor))
+			goto truncated;
+
+		uint8_t               byte   = data[cursor];
+		const ZiFormatInfo_t *format = &ZiFormatTable[byte];
+		size_t                avail  = end - cursor - 1;
+		uint64_t              length = byte & format->mask;
+
+		if (unlikely(format->kind == ZI_INVALID_TYPE))
+		{
+			handle->_cursor = cursor;
+			return ZI_DECODE_MALFORMED;
+		}
+
+		if (format->szlen)
+		{
+			if (unlikely(format->szlen > avail))
+				goto truncated;
+			length = ZiReadUnsigned(data + cursor + 1, format->szlen);
+		}
+
+		uint64_t body = format->szlen + format->szdata;
+		if (format->kind == ZI_ARRAY_TYPE)
+			pending += length;
+		else if (format->kind == ZI_MAP_TYPE)
+			pending += length * 2;
+		else if (format->kind == ZI_STR_TYPE || format->kind == ZI_BIN_TYPE)
+			body += length;
+
+		if (unlikely(body > avail))
+			goto truncated;
+
+		cursor += 1 + body;
+		pending--;
+	}
+
+	handle->_cursor = cursor;
+	return ZI_DECODE_OK;
+
+truncated:
+	handle->_cursor = cursor;
+	return ZI_DECODE_TRUNCATED;
+}
+
+/**
+ * @brief Skips over one message, advancing the cursor past it.
+ *
+ * A message is either a single element, optionally after a
+ * ZI_FRAME_STRING_REFS byte, or a compressed frame, which is stepped over
+ * using the sizes in its header without being decompressed. Use this
+ * instead of ZiSkipNext to find message boundaries in data that may hold
+ * frames.
+ *
+ * @param[in] handle The ZiHandle object with a message at its cursor
+ * @returns ZI_DECODE_OK with the cursor after the message, otherwise ZI_DECODE_TRUNCATED
+ *          or ZI_DECODE_MALFORMED with the cursor at the offending element.
+ */
+ZiDecodeStatus_t ZiSkipMessage(ZiHandle_t *handle)
+{
+	size_t cursor = handle->_cursor;
+
+	if (cursor < handle->szEncodedData && handle->EncodedData[cursor] == ZI_FRAME_COMPRESSED)
+	{
+		size_t           rawsize = 0, framesize = 0;
+		ZiDecodeStatus_t status  = ZiReadFrameHeader(handle->EncodedData + cursor, handle->szEncodedData - cursor, &rawsize, &framesize);
+		if (status == ZI_DECODE_OK)
+			handle->_cursor = cursor + framesize;
+		return status;
+	}
+
+	if (cursor < handle->szEncodedData && handle->EncodedData[cursor] == ZI_FRAME_STRING_REFS)
+		handle->_cursor = cursor + 1;
+	return ZiSkipNext(handle);
+}
+
+/**
+ * @brief Checks that one complete element is well formed, advancing the cursor past it.
+ *
+ * Walks the element like ZiSkipNext using only the format table and length
+ * headers, but keeps the number of elements left in every open container on
+ * a fixed size stack so the nesting depth can be limited. Nothing is
+ * allocated and the python API is never touched, so it's safe to call with
+ * the GIL released on data from anywhere.
+ *
+ * A compressed frame at the cursor is only checked up to its header, its
+ * contents have to be decompressed and checked on their own. After a
+ * ZI_FRAME_STRING_REFS byte the strings are counted so every reference can
+ * be checked to point at an earlier string, anywhere else a reference is
+ * malformed.
+ *
+ * @param[in] handle   The ZiHandle object with the data to check at its cursor
+ * @param[in] maxdepth Deepest allowed nesting of arrays and maps, at most ZI_MAX_DEPTH
+ * @returns ZI_DECODE_OK with the cursor after the element, otherwise ZI_DECODE_TRUNCATED,
+ *          ZI_DECODE_MALFORMED or ZI_DECODE_TOO_DEEP with the cursor at the offending element.
+ */
+ZiDecodeStatus_t ZiValidateNext(ZiHandle_t *handle, size_t maxdepth)
+{
+	uint64_t       remaining[ZI_MAX_DEPTH];
+	size_t         depth   = 0;
+	const uint8_t *data    = handle->EncodedData;
+	const size_t   end     = handle->szEncodedData;
+	size_t         cursor  = handle->_cursor;
+	uint64_t       pending = 1;
+	bool           refs    = false;
+	uint64_t       strings = 0;
+	ZiDecodeStatus_t status;
+
+	if (maxdepth > ZI_MAX_DEPTH)
+		maxdepth = ZI_MAX_DEPTH;
+
+	if (cursor < end && data[cursor] == ZI_FRAME_COMPRESSED)
+		return ZiSkipMessage(handle);
+
+	if (cursor < end && data[cursor] == ZI_FRAME_STRING_REFS)
+	{
+		refs = true;
+		cursor++;
+	}
+
+	do
+	{
+		// Every pending element needs at least its type byte, which
+		// rejects huge element counts before anything else is read.
+		status = ZI_DECODE_TRUNCATED;
+		if (unlikely(pending > end - cursor))
+			goto fail;
+
+		uint8_t               byte     = data[cursor];
+		const ZiFormatInfo_t *format   = &ZiFormatTable[byte];
+		size_t                avail    = end - cursor - 1;
+		uint64_t              length   = byte & format->mask;
+		uint64_t              children = 0;
+
+		status = ZI_DECODE_MALFORMED;
+		if (unlikely(format->kind == ZI_INVALID_TYPE))
+			goto fail;
+
+		status = ZI_DECODE_TRUNCATED;
+		if (format->szlen)
+		{
+			if (unlikely(format->szlen > avail))
+				goto fail;
+			length = ZiReadUnsigned(data + cursor + 1, format->szlen);
+		}
+
+		uint64_t body = format->szlen + format->szdata;
+		if (format->kind == ZI_ARRAY_TYPE)
+			children = length;
+		else if (format->kind == ZI_MAP_TYPE)
+			children = length * 2;
+		else if (format->kind == ZI_STR_TYPE || format->kind == ZI_BIN_TYPE)
+			body += length;
+
+		if (unlikely(body > avail))
+			goto fail;
+
+		if (format->kind == ZI_STR_TYPE)
+			strings++;
+		else if (format->kind == ZI_STRREF_TYPE)
+		{
+			status = ZI_DECODE_MALFORMED;
+			if (unlikely(!refs || ZiReadUnsigned(data + cursor + 1, format->szdata) >= strings))
+				goto fail;
+		}
+
+		if (format->kind == ZI_ARRAY_TYPE || format->kind == ZI_MAP_TYPE)
+		{
+			status = ZI_DECODE_TOO_DEEP;
+			if (unlikely(depth >= maxdepth))
+				goto fail;
+		}
+
+		cursor  += 1 + body;
+		pending += children;
+		pending--;
+
+		// Open the container, or count the element against the containers it completes.
+		if (children)
+			remaining[depth++] = children;
+		else
+		{
+			while (depth && !--remaining[depth - 1])
+				depth--;
+		}
+	}
+	while (depth);
+
+	handle->_cursor = cursor;
+	return ZI_DECODE_OK;
+
+fail:
+	handle->_cursor = cursor;
+	return status;
+}
+
+/**
+ * @brief Checks whether a string is pure 7-bit ASCII.
+ *
+ * Uses AVX2 when the library is built with it enabled (-mavx2), SSE2 on any
+ * other x86-64 build and 8 bytes at a time everywhere else. Short strings,
+ * which are most map keys, never reach the vector loops.
+ *
+ * @param[in] data   The bytes to check
+ * @param[in] length Number of bytes in data
+ * @returns true if no byte has the high bit set.
+ */
+bool ZiIsAscii(const uint8_t *data, size_t length)
+{
+	const uint8_t *end = data + length;
+
+#if defined(__AVX2__)
+	if (length >= 32)
+	{
+		__m256i acc = _mm256_setzero_si256();
+		for (; end - data >= 32; data += 32)
+			acc = _mm256_or_si256(acc, _mm256_loadu_si256((const __m256i *)data));
+		if (_mm256_movemask_epi8(acc))
+			return false;
+	}
+#endif
+#if defined(__SSE2__)
+	if (end - data >= 16)
+	{
+		__m128i acc = _mm_setzero_si128();
+		for (; end - data >= 16; data += 16)
+			acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)data));
+		if (_mm_movemask_epi8(acc))
+			return false;
+	}
+#endif
+
+	uint64_t acc = 0;
+	for (; end - data >= 8; data += 8)
+	{
+		uint64_t word;
+		memcpy(&word, data, sizeof(word));
+		acc |= word;
+	}
+	for (; data < end; ++data)
+		acc |= *data;
+
+	return !(acc & 0x8080808080808080ULL);
+}
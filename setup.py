@@ -30,7 +30,11 @@ setup(name='ziproto',
         # ],
         ext_modules=[
             Extension('ziproto',
-                sources=['ziproto/encoder.c', 'ziproto/decoder.c', 'ziproto/python.c', 'ziproto/common.c'],
+                sources=['libziproto/ziproto.c', 'libziproto/compress.c', 'ziproto/encoder.c', 'ziproto/decoder.c', 'ziproto/python.c',
+                    'ziproto/packer.c', 'ziproto/unpacker.c', 'ziproto/lazyview.c', 'ziproto/schema.c',
+                    'ziproto/file.c', 'ziproto/records.c',
+                    'ziproto/stats.c', 'ziproto/extract.c'],
+                include_dirs=['libziproto/include'],
                 extra_compile_args=['-std=c17'],
                 #extra_link_args=['-fsanitize=address']
             )
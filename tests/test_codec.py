@@ -0,0 +1,88 @@
+import unittest
+
+import ziproto
+
+
+SCALARS = [
+    None, True, False, 0, 1, -1, 127, 128, 255, 256, 65535, 65536,
+    2**32 - 1, 2**32, 2**63 - 1, 2**64 - 1, -32, -33, -128, -129,
+    -32768, -32769, -2**31, -2**31 - 1, -2**63, 0.0, 1.5, -2.25, 1e300,
+    "", "a", "x" * 31, "x" * 32, "x" * 255, "x" * 256, "x" * 65536,
+    "é", "ключ", "\U0001f600", b"", b"\x00", b"y" * 300, b"z" * 70000,
+]
+
+
+def nested(depth):
+    obj = {"leaf": [1, "two", 3.0, None]}
+    for i in range(depth):
+        obj = {"level": i, "child": obj, "items": [obj, i]}
+    return obj
+
+
+class RoundTripTest(unittest.TestCase):
+
+    def test_scalars(self):
+        for obj in SCALARS:
+            with self.subTest(obj=obj if not isinstance(obj, (str, bytes)) else obj[:8]):
+                data = ziproto.encode(obj)
+                self.assertIsInstance(data, bytes)
+                self.assertEqual(ziproto.decode(data), obj)
+
+    def test_containers(self):
+        for obj in ([], {}, [[[]]], list(range(16)), list(range(70000)),
+                    {str(i): i for i in range(16)}, {str(i): i for i in range(70000)},
+                    {1: "int key", None: "nil key", 1.5: "float key"}, nested(5)):
+            with self.subTest(size=len(obj)):
+                self.assertEqual(ziproto.decode(ziproto.encode(obj)), obj)
+
+    def test_unsupported_type(self):
+        with self.assertRaises(OverflowError):
+            ziproto.encode(object())
+        with self.assertRaises(OverflowError):
+            ziproto.encode([1, {"a": object()}])
+
+    def test_bad_input(self):
+        for data in (b"", b"\xc1", b"\x92\x01", b"\xa5abc", b"\xdd\xff\xff\xff\xff"):
+            with self.subTest(data=data):
+                with self.assertRaises(ValueError):
+                    ziproto.decode(data)
+
+    def test_deep_nesting_decodes_without_recursion(self):
+        depth = 200000
+        obj = ziproto.decode(b"\x91" * depth + b"\x90")
+        for _ in range(depth):
+            obj = obj[0]
+        self.assertEqual(obj, [])
+
+    def test_truncated_container_is_released(self):
+        data = ziproto.encode({"a": [1, 2, {"b": "c"}]})
+        for cut in range(len(data)):
+            with self.assertRaisesRegex(ValueError, "Truncated"):
+                ziproto.decode(data[:cut])
+
+
+class StringsTest(unittest.TestCase):
+
+    def test_non_ascii_at_every_position(self):
+        # Covers each lane of the 8, 16 and 32 byte ASCII scans and the tail after them
+        for length in (1, 7, 8, 9, 15, 16, 17, 31, 32, 33, 63, 64, 65, 100):
+            for pos in range(length):
+                text = "a" * pos + "é" + "b" * (length - pos - 1)
+                with self.subTest(length=length, pos=pos):
+                    self.assertEqual(ziproto.decode(ziproto.encode(text)), text)
+                    self.assertEqual(ziproto.decode(ziproto.encode({text: 1})), {text: 1})
+
+    def test_ascii(self):
+        for length in (0, 1, 8, 16, 32, 33, 1000):
+            text = "".join(chr(32 + i % 95) for i in range(length))
+            decoded = ziproto.decode(ziproto.encode({text: text}))
+            self.assertEqual(decoded, {text: text})
+            self.assertTrue(next(iter(decoded)).isascii())
+
+    def test_invalid_utf8(self):
+        with self.assertRaises(ValueError):
+            ziproto.decode(b"\xa2\xc3\x28")
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,137 @@
+import io
+import os
+import tempfile
+import unittest
+
+import ziproto
+
+
+BIG = {"id": 7, "name": "n", "vals": list(range(2000)), "text": "abc" * 500}
+SMALL = {"id": 8, "name": "m"}
+
+
+class ReaderChecks:
+    """Checks that every reader accepts the (data, object) pairs returned by messages()."""
+
+    def setUp(self):
+        self.pairs = self.messages()
+        self.stream = b"".join(data for data, _ in self.pairs)
+        self.objects = [obj for _, obj in self.pairs]
+
+    def test_decode(self):
+        for data, obj in self.pairs:
+            self.assertEqual(ziproto.decode(data), obj)
+
+    def test_validate(self):
+        for data, _ in self.pairs:
+            self.assertEqual(ziproto.validate(data), len(data))
+            self.assertEqual(ziproto.validate(data + b"\x01"), len(data))
+
+    def test_decode_all(self):
+        self.assertEqual(ziproto.decode_all(self.stream), self.objects)
+        self.assertEqual(ziproto.decode_all(self.stream * 10, threads=4), self.objects * 10)
+
+    def test_unpacker(self):
+        for size in (1, 7, 512, len(self.stream)):
+            with self.subTest(size=size):
+                unpacker = ziproto.Unpacker()
+                out = []
+                for i in range(0, len(self.stream), size):
+                    unpacker.feed(self.stream[i:i + size])
+                    out.extend(unpacker)
+                self.assertEqual(out, self.objects)
+
+    def test_files(self):
+        with tempfile.TemporaryDirectory() as tmp:
+            path = os.path.join(tmp, "stream.zp")
+            with open(path, "wb") as f:
+                f.write(self.stream)
+            self.assertEqual(list(ziproto.iter_file(path)), self.objects)
+            for data, obj in self.pairs:
+                with open(path, "wb") as f:
+                    f.write(data)
+                self.assertEqual(ziproto.load(path), obj)
+
+    def test_extract(self):
+        records = [(data, obj) for data, obj in self.pairs if isinstance(obj, dict)]
+        stream = b"".join(data for data, _ in records)
+        ids = [obj["id"] for _, obj in records]
+        names = [obj["name"] for _, obj in records]
+        for source in (stream, io.BytesIO(stream), [data for data, _ in records]):
+            with self.subTest(source=type(source).__name__):
+                got_ids, got_names = ziproto.extract(source, ["id", "name"])
+                self.assertEqual(list(got_ids), ids)
+                self.assertEqual(got_names, names)
+
+
+class CompressTest(unittest.TestCase):
+
+    def test_frame_marker(self):
+        self.assertEqual(ziproto.encode(BIG, compress=True)[0], 0xC7)
+
+    def test_small_or_incompressible_left_alone(self):
+        self.assertEqual(ziproto.encode(SMALL, compress=True), ziproto.encode(SMALL))
+        noise = bytes(os.urandom(4096))
+        self.assertEqual(ziproto.encode(noise, compress=True), ziproto.encode(noise))
+
+    def test_compress_shrinks(self):
+        self.assertLess(len(ziproto.encode(BIG, compress=True)), len(ziproto.encode(BIG)))
+
+
+class CompressedReadersTest(ReaderChecks, unittest.TestCase):
+
+    def messages(self):
+        return [(ziproto.encode(BIG, compress=True), BIG), (ziproto.encode(SMALL), SMALL)]
+
+    def test_decode_typed_arrays(self):
+        vals = ziproto.decode(ziproto.encode(BIG, compress=True), typed_arrays=True)["vals"]
+        self.assertEqual(vals.typecode, "q")
+
+    def test_lazyview(self):
+        view = ziproto.LazyView(ziproto.encode(BIG, compress=True))
+        self.assertEqual(view["id"], 7)
+        self.assertEqual(view["vals"][1999], 1999)
+        self.assertEqual(view.decode(), BIG)
+
+    def test_schema(self):
+        schema = ziproto.Schema(["a", "b"])
+        values = ["x" * 2000, [1] * 500]
+        self.assertEqual(schema.unpack(ziproto.encode(values, compress=True)), dict(zip("ab", values)))
+
+
+class DamagedFramesTest(unittest.TestCase):
+
+    def test_truncated(self):
+        data = ziproto.encode(BIG, compress=True)
+        for cut in (1, 5, 9, len(data) // 2, len(data) - 1):
+            with self.subTest(cut=cut):
+                with self.assertRaises(ValueError):
+                    ziproto.decode(data[:cut])
+                with self.assertRaises(ValueError):
+                    ziproto.validate(data[:cut])
+                unpacker = ziproto.Unpacker()
+                unpacker.feed(data[:cut])
+                self.assertEqual(list(unpacker), [])
+
+    def test_damaged_block(self):
+        data = bytearray(ziproto.encode(BIG, compress=True))
+        data[-5] ^= 0xFF
+        for reader in (ziproto.decode, ziproto.validate, ziproto.decode_all, ziproto.LazyView):
+            with self.subTest(reader=reader.__name__):
+                with self.assertRaises(ValueError):
+                    reader(bytes(data))
+
+    def test_max_len_bounds_decompressed_size(self):
+        data = ziproto.encode(BIG, compress=True)
+        with self.assertRaisesRegex(ValueError, "max_len"):
+            ziproto.validate(data, max_len=len(data) + 10)
+
+    def test_max_depth_inside_frame(self):
+        data = ziproto.encode([[[["x" * 2000]]]], compress=True)
+        self.assertEqual(data[0], 0xC7)
+        with self.assertRaisesRegex(ValueError, "Nesting too deep"):
+            ziproto.validate(data, max_depth=2)
+
+
+if __name__ == "__main__":
+    unittest.main()
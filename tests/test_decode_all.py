@@ -0,0 +1,29 @@
+import unittest
+
+import ziproto
+
+
+class DecodeAllTest(unittest.TestCase):
+
+    def test_stream(self):
+        objects = [i if i % 3 else {"id": i, "name": "n%d" % i} for i in range(1000)]
+        data = b"".join(ziproto.encode(obj) for obj in objects)
+        self.assertEqual(ziproto.decode_all(data), objects)
+        for threads in (1, 2, 8):
+            self.assertEqual(ziproto.decode_all(data, threads=threads), objects)
+
+    def test_empty(self):
+        self.assertEqual(ziproto.decode_all(b""), [])
+
+    def test_errors(self):
+        data = ziproto.encode(1) + ziproto.encode("two")
+        with self.assertRaisesRegex(ValueError, "Truncated"):
+            ziproto.decode_all(data[:-1])
+        with self.assertRaises(ValueError):
+            ziproto.decode_all(data + b"\xc1")
+        with self.assertRaises(ValueError):
+            ziproto.decode_all(data, threads=0)
+
+
+if __name__ == "__main__":
+    unittest.main()
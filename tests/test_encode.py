@@ -0,0 +1,188 @@
+import array
+import threading
+import unittest
+
+import ziproto
+
+from test_codec import SCALARS, nested
+
+
+def self_referencing():
+    items = []
+    items.append(items)
+    mapping = {}
+    mapping["self"] = mapping
+    return [items, mapping]
+
+
+def deeply_nested(depth=300000):
+    obj = []
+    for _ in range(depth):
+        obj = [obj]
+    return obj
+
+
+class EncodedSizeTest(unittest.TestCase):
+
+    def test_matches_encode(self):
+        for obj in SCALARS + [nested(4), list(range(1000))]:
+            self.assertEqual(ziproto.encoded_size(obj), len(ziproto.encode(obj)))
+
+
+class EncodeTypesTest(unittest.TestCase):
+
+    def test_tuples_and_iterables_encode_as_arrays(self):
+        self.assertEqual(ziproto.encode((1, 2)), ziproto.encode([1, 2]))
+        self.assertEqual(ziproto.encode(range(5)), ziproto.encode(list(range(5))))
+        self.assertEqual(ziproto.decode(ziproto.encode(bytearray(b"ab"))), b"ab")
+
+    def test_subclasses_encode_like_builtins(self):
+        class Int(int):
+            pass
+
+        class Str(str):
+            pass
+
+        class Dict(dict):
+            pass
+
+        class List(list):
+            pass
+
+        obj = Dict({Str("a"): List([Int(1), 2.5, Str("b")])})
+        self.assertEqual(ziproto.encode(obj), ziproto.encode({"a": [1, 2.5, "b"]}))
+
+    def test_list_changed_size_while_encoding(self):
+        class Shrink:
+            def __len__(self):
+                return 0
+
+            def __iter__(self):
+                items.clear()
+                return iter([])
+
+        items = [Shrink(), 1, 2]
+        with self.assertRaisesRegex(RuntimeError, "changed size"):
+            ziproto.encode(items)
+
+
+class EncodeIntoTest(unittest.TestCase):
+
+    def test_encode_into(self):
+        buf = bytearray(64)
+        n = ziproto.encode_into({"foo": "bar"}, buf)
+        n += ziproto.encode_into([1, 2, 3], buf, n)
+        self.assertEqual(bytes(buf[:n]), ziproto.encode({"foo": "bar"}) + ziproto.encode([1, 2, 3]))
+        self.assertEqual(ziproto.encode_into(1, memoryview(buf), 63), 1)
+
+    def test_encode_into_too_small(self):
+        buf = bytearray(4)
+        with self.assertRaisesRegex(ValueError, "required"):
+            ziproto.encode_into("x" * 10, buf)
+        self.assertEqual(buf, bytearray(4))
+        for offset in (-1, 5):
+            with self.assertRaises(ValueError):
+                ziproto.encode_into(1, buf, offset)
+        with self.assertRaises(TypeError):
+            ziproto.encode_into(1, b"readonly")
+
+    def test_recursion(self):
+        buf = bytearray(64)
+        for obj in self_referencing() + [deeply_nested()]:
+            with self.assertRaises(RecursionError):
+                ziproto.encode_into(obj, buf)
+        self.assertEqual(buf, bytearray(64))
+
+
+class ReleaseGilTest(unittest.TestCase):
+
+    def test_matches(self):
+        for obj in SCALARS + [nested(4)]:
+            self.assertEqual(ziproto.encode(obj, release_gil=True), ziproto.encode(obj))
+
+    def test_from_threads(self):
+        obj = nested(6)
+        expected = ziproto.encode(obj)
+        results = []
+
+        def work():
+            results.extend(ziproto.encode(obj, release_gil=True) for _ in range(20))
+
+        threads = [threading.Thread(target=work) for _ in range(4)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        self.assertEqual(results, [expected] * 80)
+
+    def test_iterables_need_a_length(self):
+        def gen():
+            yield 1
+
+        for release_gil in (False, True):
+            with self.subTest(release_gil=release_gil):
+                with self.assertRaises((TypeError, OverflowError)):
+                    ziproto.encode(gen(), release_gil=release_gil)
+                with self.assertRaises((TypeError, OverflowError)):
+                    ziproto.encode({"a": gen()}, release_gil=release_gil)
+                self.assertEqual(ziproto.decode(ziproto.encode(range(5), release_gil=release_gil)), [0, 1, 2, 3, 4])
+
+    def test_dict_changed_while_captured(self):
+        class Mutator:
+            def __len__(self):
+                return 1
+
+            def __iter__(self):
+                target.clear()
+                target.update({i: i for i in range(10)})
+                return iter([1])
+
+        # The map header counts the entries actually captured, so the result stays well formed
+        target = {"x": Mutator(), "y": 2}
+        data = ziproto.encode(target, release_gil=True)
+        self.assertEqual(ziproto.decode(data)["x"], [1])
+
+    def test_recursion(self):
+        for obj in self_referencing() + [deeply_nested()]:
+            with self.assertRaises(RecursionError):
+                ziproto.encode(obj, release_gil=True)
+
+
+class NumberArraysTest(unittest.TestCase):
+
+    def test_encode_like_lists(self):
+        for typecode, items in (("b", [-1, 2]), ("B", [0, 255]), ("h", [-300, 300]), ("H", [65535]),
+                                ("i", [-2**31]), ("I", [2**32 - 1]), ("q", [-2**63, 2**63 - 1]),
+                                ("Q", [2**64 - 1]), ("f", [0.5, -2.0]), ("d", [1e300, -0.25])):
+            with self.subTest(typecode=typecode):
+                self.assertEqual(ziproto.encode(array.array(typecode, items)), ziproto.encode(list(items)))
+        self.assertEqual(ziproto.encode(memoryview(array.array("i", [1, 2]))), ziproto.encode([1, 2]))
+
+
+    def test_size_and_release_gil(self):
+        for obj in (array.array("d", [1.5, 2.5]), {"a": array.array("q", range(1000))}, memoryview(b"\x01\x02")):
+            self.assertEqual(ziproto.encoded_size(obj), len(ziproto.encode(obj)))
+            self.assertEqual(ziproto.encode(obj, release_gil=True), ziproto.encode(obj))
+
+
+class RecursionTest(unittest.TestCase):
+
+    def test_self_reference(self):
+        for obj in self_referencing():
+            with self.subTest(type=type(obj).__name__):
+                with self.assertRaisesRegex(RecursionError, "ZiProto"):
+                    ziproto.encoded_size(obj)
+                with self.assertRaisesRegex(RecursionError, "ZiProto"):
+                    ziproto.encode(obj)
+
+    def test_deep_nesting(self):
+        obj = deeply_nested()
+        with self.assertRaises(RecursionError):
+            ziproto.encoded_size(obj)
+        with self.assertRaises(RecursionError):
+            ziproto.encode(obj)
+        self.assertEqual(ziproto.decode(ziproto.encode(deeply_nested(100))), deeply_nested(100))
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,94 @@
+import array
+import io
+import unittest
+
+import ziproto
+
+
+RECORDS = [{"id": i, "name": "n%d" % i, "score": i * 0.5, "tags": [i], "neg": -i} for i in range(1000)]
+BUFFERS = [ziproto.encode(record) for record in RECORDS]
+STREAM = b"".join(BUFFERS)
+FIELDS = ["id", "name", "score", "tags", "neg"]
+
+
+def encode_all(records):
+    return b"".join(ziproto.encode(record) for record in records)
+
+
+class ExtractTest(unittest.TestCase):
+
+    def check_columns(self, columns):
+        ids, names, scores, tags, negs = columns
+        self.assertEqual(ids, array.array("q", range(1000)))
+        self.assertEqual(names, [record["name"] for record in RECORDS])
+        self.assertEqual((scores.typecode, list(scores)), ("d", [record["score"] for record in RECORDS]))
+        self.assertEqual(tags, [[i] for i in range(1000)])
+        self.assertEqual((negs.typecode, list(negs)), ("q", [-i for i in range(1000)]))
+
+    def test_buffer(self):
+        self.check_columns(ziproto.extract(STREAM, FIELDS))
+
+    def test_iterable_of_buffers(self):
+        self.check_columns(ziproto.extract(BUFFERS, FIELDS))
+        self.check_columns(ziproto.extract(iter(BUFFERS), FIELDS))
+
+    def test_file_like(self):
+        self.check_columns(ziproto.extract(io.BytesIO(STREAM), FIELDS))
+
+    def test_file_like_short_reads(self):
+        class Trickle(io.RawIOBase):
+            def __init__(self, data):
+                self.data = memoryview(data)
+
+            def readable(self):
+                return True
+
+            def readinto(self, buffer):
+                n = min(len(buffer), len(self.data), 7)
+                buffer[:n] = self.data[:n]
+                self.data = self.data[n:]
+                return n
+
+        self.check_columns(ziproto.extract(Trickle(STREAM), FIELDS))
+
+    def test_truncated_stream(self):
+        with self.assertRaisesRegex(ValueError, "Truncated"):
+            ziproto.extract(io.BytesIO(STREAM[:-1]), ["id"])
+        with self.assertRaises(ValueError):
+            ziproto.extract(STREAM[:-1], ["id"])
+
+    def test_missing_and_mixed(self):
+        a, b = ziproto.extract(encode_all([{"a": 1}, {"b": 2}, {"a": "x"}, {"a": 2**64 - 1}]), ["a", "b"])
+        self.assertEqual(a, [1, None, "x", 2**64 - 1])
+        self.assertEqual(b, [None, 2, None, None])
+
+    def test_number_columns(self):
+        a, = ziproto.extract(encode_all([{"a": 1}, {"a": 2**64 - 1}]), ["a"])
+        self.assertEqual((a.typecode, list(a)), ("Q", [1, 2**64 - 1]))
+        a, = ziproto.extract(encode_all([{"a": -1}, {"a": 2**64 - 1}]), ["a"])
+        self.assertEqual(a, [-1, 2**64 - 1])
+        a, = ziproto.extract(encode_all([{"a": 1}, {"a": 2.5}]), ["a"])
+        self.assertEqual(a, [1, 2.5])
+        a, = ziproto.extract(STREAM, ["id"], typed_arrays=False)
+        self.assertEqual(a, list(range(1000)))
+
+    def test_other_keys_skipped(self):
+        data = ziproto.encode({1: 2, (1, 2): 3, "a": 5, None: 1})
+        self.assertEqual(ziproto.extract(data, ["a"]), [array.array("q", [5])])
+
+    def test_empty(self):
+        self.assertEqual(ziproto.extract(b"", ["a", "b"]), [[], []])
+        self.assertEqual(ziproto.extract(STREAM, []), [])
+
+    def test_errors(self):
+        with self.assertRaises(ValueError):
+            ziproto.extract(ziproto.encode([1]), ["id"])
+        for args in ((STREAM, [1]), (5, ["a"]), ([5], ["a"])):
+            with self.assertRaises(TypeError):
+                ziproto.extract(*args)
+        with self.assertRaises(ValueError):
+            ziproto.extract(STREAM, ["a", "a"])
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,76 @@
+import os
+import pathlib
+import tempfile
+import unittest
+
+import ziproto
+
+
+RECORDS = [{"id": i, "name": "n%d" % i, "blob": bytes(i % 50)} for i in range(2000)]
+
+
+class FileTestCase(unittest.TestCase):
+
+    def setUp(self):
+        self.tmp = tempfile.TemporaryDirectory()
+        self.addCleanup(self.tmp.cleanup)
+
+    def path(self, name):
+        return os.path.join(self.tmp.name, name)
+
+    def write(self, name, data):
+        path = self.path(name)
+        with open(path, "wb") as f:
+            f.write(data)
+        return path
+
+
+class IterFileTest(FileTestCase):
+
+    def test_iter_file(self):
+        path = self.path("records.zp")
+        with open(path, "wb") as f:
+            packer = ziproto.Packer(f)
+            for record in RECORDS:
+                packer.pack(record)
+            packer.flush()
+        self.assertEqual(list(ziproto.iter_file(path)), RECORDS)
+        self.assertEqual(list(ziproto.iter_file(pathlib.Path(path))), RECORDS)
+        self.assertEqual(ziproto.load(path), RECORDS[0])
+
+    def test_load(self):
+        path = self.write("one.zp", ziproto.encode(RECORDS))
+        self.assertEqual(ziproto.load(path), RECORDS)
+
+    def test_close(self):
+        path = self.write("records.zp", ziproto.encode(1) + ziproto.encode(2))
+        with ziproto.iter_file(path) as it:
+            self.assertEqual(next(it), 1)
+        self.assertEqual(list(it), [])
+        it = ziproto.iter_file(path)
+        it.close()
+        self.assertEqual(list(it), [])
+
+    def test_empty(self):
+        path = self.write("empty.zp", b"")
+        self.assertEqual(list(ziproto.iter_file(path)), [])
+        with self.assertRaises(ValueError):
+            ziproto.load(path)
+
+    def test_truncated(self):
+        path = self.write("bad.zp", ziproto.encode(1) + ziproto.encode("abc")[:-1])
+        it = ziproto.iter_file(path)
+        self.assertEqual(next(it), 1)
+        with self.assertRaises(ValueError):
+            next(it)
+        self.assertEqual(list(it), [])
+
+    def test_missing(self):
+        with self.assertRaises(FileNotFoundError):
+            ziproto.load(self.path("missing"))
+        with self.assertRaises(OSError):
+            ziproto.load(self.tmp.name)
+
+
+if __name__ == "__main__":
+    unittest.main()
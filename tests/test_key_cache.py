@@ -0,0 +1,52 @@
+import sys
+import unittest
+
+import ziproto
+
+
+class KeyCacheTest(unittest.TestCase):
+
+    def tearDown(self):
+        ziproto.set_key_cache_size(1024)
+
+    def test_keys_are_shared(self):
+        records = ziproto.decode(ziproto.encode([{"name": i} for i in range(3)]))
+        keys = [next(iter(record)) for record in records]
+        if not hasattr(sys, "_is_gil_enabled") or sys._is_gil_enabled():
+            self.assertIs(keys[0], keys[1])
+
+    def test_resize_and_disable(self):
+        obj = [{"k%d" % (i % 50): i, sys.intern("interned"): i} for i in range(500)]
+        for size in (0, 1, 7, 4096):
+            ziproto.set_key_cache_size(size)
+            self.assertEqual(ziproto.decode(ziproto.encode(obj)), obj)
+        with self.assertRaises(ValueError):
+            ziproto.set_key_cache_size(-1)
+
+
+class EncodedKeyCacheTest(unittest.TestCase):
+
+    def tearDown(self):
+        ziproto.set_key_cache_size(1024)
+
+    def test_interned_keys_encode_the_same(self):
+        keys = [sys.intern("field%d" % i) for i in range(3000)] + [sys.intern("é" * 10), sys.intern("")]
+        obj = [{key: i} for i, key in enumerate(keys)] * 2
+        ziproto.set_key_cache_size(0)
+        expected = ziproto.encode(obj)
+        for size in (1, 7, 1024):
+            with self.subTest(size=size):
+                ziproto.set_key_cache_size(size)
+                self.assertEqual(ziproto.encode(obj), expected)
+                self.assertEqual(ziproto.encoded_size(obj), len(expected))
+                self.assertEqual(ziproto.encode(obj, release_gil=True), expected)
+        self.assertEqual(ziproto.decode(expected), obj)
+
+    def test_long_and_uninterned_keys(self):
+        obj = {"k" * 1000: 1, "".join(["dyn", "amic"]): 2, sys.intern("short"): 3}
+        for _ in range(2):
+            self.assertEqual(ziproto.decode(ziproto.encode(obj)), obj)
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,72 @@
+import unittest
+
+import ziproto
+
+
+DOC = {"a": 1, "b": "s", "c": [1, {"x": 2}], "d": {"e": None}, "f": 1.5, "g": b"raw"}
+
+
+def materialize(value):
+    if isinstance(value, ziproto.LazyView):
+        return value.decode()
+    return value
+
+
+class LazyViewTest(unittest.TestCase):
+
+    def setUp(self):
+        self.view = ziproto.LazyView(ziproto.encode(DOC))
+
+    def test_map_access(self):
+        view = self.view
+        self.assertEqual((view["a"], view["b"], view["f"], view["g"]), (1, "s", 1.5, b"raw"))
+        self.assertIsNone(view["d"]["e"])
+        self.assertEqual(len(view), len(DOC))
+        self.assertEqual(list(view), list(DOC))
+        self.assertIn("a", view.keys())
+        self.assertEqual(view.get("missing"), None)
+        self.assertEqual(view.get("missing", 5), 5)
+        with self.assertRaises(KeyError):
+            view["missing"]
+
+    def test_nested_views(self):
+        self.assertIsInstance(self.view["c"], ziproto.LazyView)
+        self.assertIsInstance(self.view["c"][1], ziproto.LazyView)
+        self.assertEqual(self.view["c"][1]["x"], 2)
+        self.assertEqual(self.view["c"].decode(), DOC["c"])
+
+    def test_items_and_values(self):
+        self.assertEqual({k: materialize(v) for k, v in self.view.items()}, DOC)
+        self.assertEqual([materialize(v) for v in self.view.values()], list(DOC.values()))
+        self.assertEqual(self.view.decode(), DOC)
+
+    def test_array_access(self):
+        view = ziproto.LazyView(ziproto.encode(list(range(1000))))
+        self.assertEqual(len(view), 1000)
+        self.assertEqual(view[0], 0)
+        self.assertEqual(view[999], 999)
+        self.assertEqual(view[-1], 999)
+        self.assertEqual(list(view), list(range(1000)))
+        with self.assertRaises(IndexError):
+            view[1000]
+        with self.assertRaises(TypeError):
+            view["key"]
+
+    def test_view_outlives_buffer(self):
+        data = bytearray(ziproto.encode(DOC))
+        view = ziproto.LazyView(data)
+        child = view["c"]
+        del view
+        self.assertEqual(child[1]["x"], 2)
+
+    def test_scalar_root_rejected(self):
+        with self.assertRaises(ValueError):
+            ziproto.LazyView(ziproto.encode(1))
+
+    def test_truncated(self):
+        with self.assertRaises(ValueError):
+            ziproto.LazyView(b"\x92\x01")[1]
+
+
+if __name__ == "__main__":
+    unittest.main()
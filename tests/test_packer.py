@@ -0,0 +1,179 @@
+import io
+import unittest
+
+import ziproto
+
+
+class ShortWrites:
+    """Takes at most step bytes per write() call."""
+
+    def __init__(self, step):
+        self.step = step
+        self.data = bytearray()
+
+    def write(self, data):
+        taken = bytes(data[:self.step])
+        self.data += taken
+        return len(taken)
+
+
+class PackerTest(unittest.TestCase):
+
+    def test_writes_to_stream(self):
+        stream = io.BytesIO()
+        packer = ziproto.Packer(stream, high_water=10)
+        for i in range(100):
+            packer.pack(i)
+        packer.flush()
+        self.assertEqual(stream.getvalue(), b"".join(ziproto.encode(i) for i in range(100)))
+        self.assertEqual(len(packer), 0)
+
+    def test_high_water(self):
+        stream = io.BytesIO()
+        packer = ziproto.Packer(stream, high_water=1000)
+        self.assertEqual(packer.high_water, 1000)
+        packer.pack("x" * 10)
+        self.assertEqual(stream.getvalue(), b"")
+        self.assertEqual(len(packer), len(ziproto.encode("x" * 10)))
+        packer.pack("y" * 2000)
+        self.assertEqual(len(packer), 0)
+        self.assertEqual(ziproto.decode_all(stream.getvalue()), ["x" * 10, "y" * 2000])
+
+    def test_without_stream(self):
+        packer = ziproto.Packer()
+        packer.pack({"a": 1})
+        packer.pack([1, 2])
+        self.assertEqual(packer.flush(), ziproto.encode({"a": 1}) + ziproto.encode([1, 2]))
+        self.assertEqual(packer.flush(), b"")
+
+    def test_reset(self):
+        packer = ziproto.Packer()
+        packer.pack(1)
+        packer.reset()
+        self.assertEqual(len(packer), 0)
+        packer.pack(2)
+        self.assertEqual(packer.flush(), ziproto.encode(2))
+
+    def test_unsupported_object_leaves_buffer(self):
+        packer = ziproto.Packer()
+        packer.pack(1)
+        with self.assertRaises(OverflowError):
+            packer.pack([2, object()])
+        self.assertEqual(packer.flush(), ziproto.encode(1))
+
+    def test_short_writes_are_retried(self):
+        expected = b"".join(ziproto.encode("hello%d" % i) for i in range(50))
+        for step in (1, 3, 64):
+            with self.subTest(step=step):
+                stream = ShortWrites(step)
+                packer = ziproto.Packer(stream, high_water=16)
+                for i in range(50):
+                    packer.pack("hello%d" % i)
+                packer.flush()
+                self.assertEqual(bytes(stream.data), expected)
+
+    def test_write_returning_none_keeps_unwritten_bytes(self):
+        class Blocking(ShortWrites):
+            calls = 0
+
+            def write(self, data):
+                self.calls += 1
+                if self.calls == 2:
+                    return None
+                return super().write(data)
+
+        stream = Blocking(3)
+        packer = ziproto.Packer(stream, high_water=1000)
+        for i in range(5):
+            packer.pack("hello%d" % i)
+        full = b"".join(ziproto.encode("hello%d" % i) for i in range(5))
+        with self.assertRaises(BlockingIOError):
+            packer.flush()
+        self.assertEqual(len(packer), len(full) - 3)
+        packer.flush()
+        self.assertEqual(bytes(stream.data), full)
+
+    def test_write_taking_nothing(self):
+        class Zero:
+            def write(self, data):
+                return 0
+
+        packer = ziproto.Packer(Zero(), high_water=1)
+        with self.assertRaises(OSError):
+            packer.pack(1)
+        self.assertEqual(len(packer), 1)
+
+    def test_write_returning_too_much(self):
+        class Liar:
+            def write(self, data):
+                return len(data) + 1
+
+        packer = ziproto.Packer(Liar())
+        packer.pack(1)
+        with self.assertRaises(OSError):
+            packer.flush()
+        self.assertEqual(len(packer), 1)
+
+    def test_write_returning_non_int(self):
+        class Bad:
+            def write(self, data):
+                return "x"
+
+        packer = ziproto.Packer(Bad())
+        packer.pack(1)
+        with self.assertRaises(TypeError):
+            packer.flush()
+        self.assertEqual(len(packer), 1)
+
+    def test_write_raising_keeps_buffer(self):
+        class Flaky(ShortWrites):
+            fail = True
+
+            def write(self, data):
+                if self.fail:
+                    self.fail = False
+                    raise ValueError("boom")
+                return super().write(data)
+
+        stream = Flaky(1 << 20)
+        packer = ziproto.Packer(stream)
+        packer.pack([1, 2, 3])
+        with self.assertRaisesRegex(ValueError, "boom"):
+            packer.flush()
+        self.assertEqual(len(packer), len(ziproto.encode([1, 2, 3])))
+        packer.flush()
+        self.assertEqual(bytes(stream.data), ziproto.encode([1, 2, 3]))
+
+
+    def test_stream_writing_back_into_packer(self):
+        errors = []
+
+        class Reentrant:
+            def write(self, data):
+                for call in (lambda: packer.pack("x" * 100000), packer.flush, packer.reset,
+                             lambda: packer.__init__(io.BytesIO())):
+                    try:
+                        call()
+                    except RuntimeError as e:
+                        errors.append(e)
+                return len(data)
+
+        packer = ziproto.Packer(Reentrant())
+        packer.pack([1, 2, 3])
+        packer.flush()
+        self.assertEqual(len(errors), 4)
+        self.assertEqual(len(packer), 0)
+        packer.pack(1)
+        self.assertEqual(len(packer), 1)
+
+    def test_self_reference(self):
+        items = []
+        items.append(items)
+        packer = ziproto.Packer()
+        packer.pack(1)
+        with self.assertRaises(RecursionError):
+            packer.pack(items)
+        self.assertEqual(packer.flush(), ziproto.encode(1))
+
+if __name__ == "__main__":
+    unittest.main()
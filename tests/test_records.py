@@ -0,0 +1,92 @@
+import bisect
+import unittest
+
+import ziproto
+
+from test_iter_file import RECORDS, FileTestCase
+
+
+class RecordFileTest(FileTestCase):
+
+    def test_random_access(self):
+        path = self.path("r.zpr")
+        with ziproto.RecordWriter(path, index_interval=16) as writer:
+            for record in RECORDS:
+                writer.write(record)
+            self.assertEqual(len(writer), len(RECORDS))
+
+        with ziproto.RecordReader(path) as reader:
+            self.assertEqual((len(reader), reader.index_interval), (len(RECORDS), 16))
+            for i in (0, 1, 15, 16, 17, 1000, len(RECORDS) - 1, -1):
+                self.assertEqual(reader[i], RECORDS[i])
+            self.assertEqual(list(reader), RECORDS)
+            self.assertEqual(list(reader.records(1990)), RECORDS[1990:])
+            self.assertEqual(list(reader.records(-3)), RECORDS[-3:])
+            self.assertEqual(list(reader.records(len(RECORDS) + 5)), [])
+            self.assertEqual(bisect.bisect_left(reader, 500, key=lambda r: r["id"]), 500)
+            with self.assertRaises(IndexError):
+                reader[len(RECORDS)]
+        with self.assertRaises(ValueError):
+            reader[0]
+
+    def test_append(self):
+        path = self.path("r.zpr")
+        with ziproto.RecordWriter(path, index_interval=4) as writer:
+            for i in range(100):
+                writer.write(i)
+        with ziproto.RecordWriter(path, append=True) as writer:
+            self.assertEqual((len(writer), writer.index_interval), (100, 4))
+            for i in range(100, 150):
+                writer.write(i)
+        with ziproto.RecordReader(path) as reader:
+            self.assertEqual(list(reader), list(range(150)))
+            self.assertEqual(reader[120], 120)
+
+    def test_recovers_after_crash(self):
+        path = self.path("crash.zpr")
+        writer = ziproto.RecordWriter(path, index_interval=4)
+        for i in range(3000):
+            writer.write(i)
+        writer.flush()
+        with open(path, "rb") as f:
+            crashed = f.read()
+        writer.close()
+
+        for cut in (len(crashed), len(crashed) - 1, len(crashed) - 7, 20, 25, 3000):
+            with self.subTest(cut=cut):
+                cutpath = self.write("cut.zpr", crashed[:cut])
+                with ziproto.RecordReader(cutpath) as reader:
+                    n = len(reader)
+                    self.assertEqual(list(reader), list(range(n)))
+                with ziproto.RecordWriter(cutpath, append=True) as appender:
+                    for i in range(n, n + 700):
+                        appender.write(i)
+                with ziproto.RecordReader(cutpath) as reader:
+                    self.assertEqual(list(reader), list(range(n + 700)))
+                    self.assertEqual(reader[n + 333], n + 333)
+
+    def test_errors(self):
+        path = self.path("e.zpr")
+        ziproto.RecordWriter(path).close()
+        self.assertEqual(list(ziproto.RecordReader(path)), [])
+        for bad in (b"", b"garbage" * 10):
+            self.write("e.zpr", bad)
+            with self.assertRaises(ValueError):
+                ziproto.RecordReader(path)
+        with self.assertRaises(ValueError):
+            ziproto.RecordWriter(path, append=True)
+        with self.assertRaises(ValueError):
+            ziproto.RecordWriter(path, index_interval=0)
+
+        writer = ziproto.RecordWriter(path)
+        with self.assertRaises(OverflowError):
+            writer.write(object())
+        writer.write(1)
+        writer.close()
+        with self.assertRaises(ValueError):
+            writer.write(1)
+        self.assertEqual(list(ziproto.RecordReader(path)), [1])
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,51 @@
+import types
+import unittest
+
+import ziproto
+
+
+class SchemaTest(unittest.TestCase):
+
+    def setUp(self):
+        self.schema = ziproto.Schema(["id", "name", "score"])
+        self.record = {"name": "bob", "id": 7, "score": 1.5}
+
+    def test_round_trip(self):
+        data = self.schema.pack(self.record)
+        self.assertEqual(data, ziproto.encode([7, "bob", 1.5]))
+        self.assertLess(len(data), len(ziproto.encode(self.record)))
+        unpacked = self.schema.unpack(data)
+        self.assertEqual(unpacked, self.record)
+        self.assertEqual(list(unpacked), ["id", "name", "score"])
+
+    def test_fields(self):
+        self.assertEqual(self.schema.fields, ("id", "name", "score"))
+        self.assertEqual(len(self.schema), 3)
+
+    def test_mappings_and_buffers(self):
+        data = self.schema.pack(types.MappingProxyType(self.record))
+        self.assertEqual(self.schema.unpack(bytearray(data)), self.record)
+        self.assertEqual(self.schema.unpack(memoryview(data)), self.record)
+
+    def test_pack_errors(self):
+        with self.assertRaises(KeyError):
+            self.schema.pack({"id": 1, "name": "x"})
+        with self.assertRaises(ValueError):
+            self.schema.pack({"id": 1, "name": "x", "score": 1, "extra": 2})
+
+    def test_unpack_errors(self):
+        data = self.schema.pack(self.record)
+        for bad in (ziproto.encode([1, 2]), ziproto.encode({"a": 1}), data[:-1]):
+            with self.subTest(bad=bad):
+                with self.assertRaises(ValueError):
+                    self.schema.unpack(bad)
+
+    def test_bad_fields(self):
+        with self.assertRaises(ValueError):
+            ziproto.Schema(["a", "a"])
+        with self.assertRaises(TypeError):
+            ziproto.Schema(["a", 1])
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,83 @@
+import array
+import threading
+import unittest
+
+import ziproto
+
+
+class StatsTest(unittest.TestCase):
+
+    def setUp(self):
+        ziproto.enable_stats()
+        ziproto.reset_stats()
+
+    def tearDown(self):
+        ziproto.enable_stats(False)
+        ziproto.reset_stats()
+
+    def test_disabled_counts_nothing(self):
+        ziproto.enable_stats(False)
+        ziproto.encode([1, 2])
+        stats = ziproto.stats()
+        self.assertIs(stats["enabled"], False)
+        self.assertEqual(stats["encode"]["calls"], 0)
+        self.assertEqual(stats["formats"], {})
+
+    def test_encode(self):
+        data = ziproto.encode({"a": 1, "b": "x" * 40, "c": -5, "d": 1.5, "e": None, "f": [True, 300]})
+        ziproto.encode(array.array("q", [1, 2, 70000]))
+        stats = ziproto.stats()
+        self.assertEqual(stats["encode"]["calls"], 2)
+        self.assertGreater(stats["encode"]["bytes_out"], len(data))
+        formats = stats["formats"]
+        self.assertEqual((formats["FIXMAP"], formats["FIXSTR"], formats["STR8"]), (1, 6, 1))
+        self.assertEqual((formats["UINT16"], formats["UINT32"], formats["FIXARRAY"]), (1, 1, 2))
+        self.assertEqual((formats["TRUE"], formats["NEGATIVE_FIXINT"], formats["POSITIVE_FIXINT"]), (1, 1, 3))
+
+    def test_readers(self):
+        data = ziproto.encode({"a": [1, 2, 3]})
+        ziproto.decode(data)
+        ziproto.decode_all(data + data)
+        ziproto.encode_into([1], bytearray(10))
+        unpacker = ziproto.Unpacker()
+        unpacker.feed(data[:3])
+        list(unpacker)
+        unpacker.feed(data[3:])
+        list(unpacker)
+        stats = ziproto.stats()
+        self.assertEqual((stats["decode"]["calls"], stats["decode"]["bytes_in"]), (1, len(data)))
+        self.assertEqual(stats["decode_all"]["bytes_in"], 2 * len(data))
+        self.assertEqual(stats["encode_into"]["bytes_out"], 2)
+        self.assertEqual((stats["Unpacker"]["calls"], stats["Unpacker"]["bytes_in"]), (1, len(data)))
+
+    def test_packer(self):
+        packer = ziproto.Packer(high_water=0)
+        for _ in range(1000):
+            packer.pack("x" * 100)
+        stats = ziproto.stats()
+        self.assertEqual(stats["Packer.pack"]["calls"], 1000)
+        self.assertGreater(stats["reallocs"], 0)
+        self.assertGreaterEqual(stats["peak_buffer"], 100000)
+
+    def test_threads_are_summed(self):
+        def work():
+            for _ in range(100):
+                ziproto.encode([1])
+
+        threads = [threading.Thread(target=work) for _ in range(4)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        self.assertEqual(ziproto.stats()["encode"]["calls"], 400)
+
+    def test_reset(self):
+        ziproto.encode(1)
+        ziproto.reset_stats()
+        stats = ziproto.stats()
+        self.assertEqual(stats["encode"]["calls"], 0)
+        self.assertEqual(stats["formats"], {})
+
+
+if __name__ == "__main__":
+    unittest.main()
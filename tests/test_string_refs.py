@@ -0,0 +1,74 @@
+import unittest
+
+import ziproto
+
+from test_compress import BIG, SMALL, ReaderChecks
+
+
+RECORDS = [{"kind": "alpha", "name": "n%d" % (i % 3), "id": i} for i in range(300)]
+BETA = {"id": 9, "name": "beta", "kind": "beta"}
+
+
+class StringRefsTest(unittest.TestCase):
+
+    def test_frame_markers(self):
+        self.assertEqual(ziproto.encode(RECORDS, string_refs=True)[0], 0xC8)
+        self.assertEqual(ziproto.encode(RECORDS, string_refs=True, compress=True)[0], 0xC7)
+
+    def test_shrinks(self):
+        self.assertLess(len(ziproto.encode(RECORDS, string_refs=True)), len(ziproto.encode(RECORDS)))
+
+    def test_share_objects(self):
+        decoded = ziproto.decode(ziproto.encode(RECORDS, string_refs=True))
+        self.assertIs(decoded[0]["kind"], decoded[1]["kind"])
+
+    def test_release_gil(self):
+        for obj in (RECORDS, {"a": "x" * 40, "b": "x" * 40}, ["s", "s", 1]):
+            with self.subTest(obj=obj if len(obj) < 10 else "records"):
+                self.assertEqual(ziproto.encode(obj, string_refs=True, release_gil=True),
+                                 ziproto.encode(obj, string_refs=True))
+
+    def test_recursion(self):
+        items = []
+        items.append(items)
+        for release_gil in (False, True):
+            with self.assertRaises(RecursionError):
+                ziproto.encode(items, string_refs=True, release_gil=release_gil)
+
+
+class StringRefsReadersTest(ReaderChecks, unittest.TestCase):
+
+    def messages(self):
+        return [
+            (ziproto.encode(BIG, compress=True), BIG),
+            (ziproto.encode(SMALL), SMALL),
+            (ziproto.encode(RECORDS, string_refs=True), RECORDS),
+            (ziproto.encode(BETA, string_refs=True), BETA),
+            (ziproto.encode(RECORDS, string_refs=True, compress=True), RECORDS),
+        ]
+
+    def test_lazyview_rejected(self):
+        for data in (ziproto.encode(RECORDS, string_refs=True),
+                     ziproto.encode(RECORDS, string_refs=True, compress=True)):
+            with self.assertRaisesRegex(ValueError, "string_refs"):
+                ziproto.LazyView(data)
+
+    def test_schema(self):
+        schema = ziproto.Schema(["a", "b"])
+        self.assertEqual(schema.unpack(ziproto.encode(["q", "q"], string_refs=True)), {"a": "q", "b": "q"})
+
+    def test_bad_references(self):
+        for data in (b"\xc8\x92\xa3abc\xd4\x01", b"\x92\xa3abc\xd4\x00", b"\xc8\xd5\x00\x00"):
+            with self.subTest(data=data):
+                with self.assertRaisesRegex(ValueError, "(?i)string reference"):
+                    ziproto.decode(data)
+                with self.assertRaisesRegex(ValueError, "(?i)string reference"):
+                    ziproto.validate(data)
+                unpacker = ziproto.Unpacker()
+                unpacker.feed(data)
+                with self.assertRaises(ValueError):
+                    list(unpacker)
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,34 @@
+import array
+import unittest
+
+import ziproto
+
+
+class TypedArraysTest(unittest.TestCase):
+
+    def decode(self, obj):
+        return ziproto.decode(ziproto.encode(obj), typed_arrays=True)
+
+    def test_homogeneous_arrays(self):
+        floats = self.decode([0.5, 1.5])
+        self.assertEqual((floats.typecode, list(floats)), ("d", [0.5, 1.5]))
+        ints = self.decode([1, -2, 3])
+        self.assertEqual((ints.typecode, list(ints)), ("q", [1, -2, 3]))
+        large = self.decode([1, 2**64 - 1])
+        self.assertEqual((large.typecode, list(large)), ("Q", [1, 2**64 - 1]))
+
+    def test_other_arrays_stay_lists(self):
+        for obj in ([], [1, "a"], [1, 2.0], [-1, 2**64 - 1], [["a"], "x"], [None]):
+            with self.subTest(obj=obj):
+                self.assertEqual(self.decode(obj), obj)
+                self.assertIsInstance(self.decode(obj), list)
+
+    def test_nested(self):
+        obj = self.decode({"t": [0.5, 1.5], "tags": ["a", 1], "rows": [[1, 2], [3, 4]]})
+        self.assertEqual(obj["t"], array.array("d", [0.5, 1.5]))
+        self.assertEqual(obj["tags"], ["a", 1])
+        self.assertEqual(obj["rows"], [array.array("q", [1, 2]), array.array("q", [3, 4])])
+
+
+if __name__ == "__main__":
+    unittest.main()
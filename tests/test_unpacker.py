@@ -0,0 +1,104 @@
+import unittest
+
+import ziproto
+
+
+OBJECTS = [{"k%d" % i: [i, "x" * i, i * 1.5, None, {"deep": [b"b" * i]}]} for i in range(300)]
+DATA = b"".join(ziproto.encode(obj) for obj in OBJECTS)
+
+
+def unpack_in_chunks(data, size, **kwargs):
+    unpacker = ziproto.Unpacker(**kwargs)
+    out = []
+    for i in range(0, len(data), size):
+        unpacker.feed(data[i:i + size])
+        out.extend(unpacker)
+    return out
+
+
+class UnpackerTest(unittest.TestCase):
+
+    def test_whole_buffer(self):
+        self.assertEqual(unpack_in_chunks(DATA, len(DATA)), OBJECTS)
+
+    def test_chunk_sizes(self):
+        for size in (1, 2, 3, 7, 64, 1000):
+            with self.subTest(size=size):
+                self.assertEqual(unpack_in_chunks(DATA, size), OBJECTS)
+
+    def test_every_split_point(self):
+        data = ziproto.encode({"a": [1, 2, {"b": "text", "c": b"bin"}], "d": 2**40}) + ziproto.encode("tail")
+        for cut in range(len(data) + 1):
+            unpacker = ziproto.Unpacker()
+            unpacker.feed(data[:cut])
+            out = list(unpacker)
+            unpacker.feed(data[cut:])
+            out.extend(unpacker)
+            self.assertEqual(out, [{"a": [1, 2, {"b": "text", "c": b"bin"}], "d": 2**40}, "tail"], cut)
+
+    def test_deep_nesting_across_feeds(self):
+        unpacker = ziproto.Unpacker()
+        data = b"\x91" * 100000 + b"\x90"
+        unpacker.feed(data[:50000])
+        self.assertEqual(list(unpacker), [])
+        unpacker.feed(data[50000:])
+        self.assertEqual(len(list(unpacker)), 1)
+
+    def test_accepts_buffers(self):
+        unpacker = ziproto.Unpacker()
+        unpacker.feed(bytearray(ziproto.encode(1)))
+        unpacker.feed(memoryview(ziproto.encode(2)))
+        self.assertEqual(list(unpacker), [1, 2])
+
+    def test_malformed_discards_buffer(self):
+        unpacker = ziproto.Unpacker()
+        unpacker.feed(ziproto.encode(1) + b"\xc1" + ziproto.encode(2))
+        iterator = iter(unpacker)
+        self.assertEqual(next(iterator), 1)
+        with self.assertRaises(ValueError):
+            next(iterator)
+        self.assertEqual(list(unpacker), [])
+        unpacker.feed(ziproto.encode([1, 2]))
+        self.assertEqual(list(unpacker), [[1, 2]])
+
+    def test_malformed_inside_partial_container(self):
+        unpacker = ziproto.Unpacker()
+        unpacker.feed(b"\x93\x01\x02")
+        self.assertEqual(list(unpacker), [])
+        unpacker.feed(b"\xc1\x03")
+        with self.assertRaises(ValueError):
+            list(unpacker)
+        unpacker.feed(ziproto.encode("fresh"))
+        self.assertEqual(list(unpacker), ["fresh"])
+
+    def test_reset(self):
+        unpacker = ziproto.Unpacker()
+        unpacker.feed(ziproto.encode([1, 2, 3])[:2])
+        self.assertEqual(list(unpacker), [])
+        unpacker.reset()
+        unpacker.feed(ziproto.encode("after"))
+        self.assertEqual(list(unpacker), ["after"])
+
+    def test_max_buffer_size(self):
+        unpacker = ziproto.Unpacker(max_buffer_size=16)
+        unpacker.feed(b"\x01" * 16)
+        with self.assertRaises(BufferError):
+            unpacker.feed(b"\x01")
+        self.assertEqual(list(unpacker), [1] * 16)
+        unpacker.feed(b"\x02" * 16)
+        self.assertEqual(list(unpacker), [2] * 16)
+        with self.assertRaises(ValueError):
+            ziproto.Unpacker(max_buffer_size=-1)
+
+    def test_long_stream_stays_bounded(self):
+        unpacker = ziproto.Unpacker(max_buffer_size=4096)
+        chunk = ziproto.encode({"id": 1, "name": "x" * 100})
+        for _ in range(2000):
+            unpacker.feed(chunk[:50])
+            self.assertEqual(list(unpacker), [])
+            unpacker.feed(chunk[50:])
+            self.assertEqual(list(unpacker), [{"id": 1, "name": "x" * 100}])
+
+
+if __name__ == "__main__":
+    unittest.main()
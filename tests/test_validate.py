@@ -0,0 +1,57 @@
+import unittest
+
+import ziproto
+
+
+VALUES = [1, "x", {"a": [1, 2, {"b": b"zz"}]}, [], {}, None, 1.5, -5, 2**63, [[[]]],
+          "é" * 300, list(range(70000))]
+
+
+class ValidateTest(unittest.TestCase):
+
+    def test_valid(self):
+        for value in VALUES:
+            data = ziproto.encode(value)
+            self.assertEqual(ziproto.validate(data), len(data))
+            self.assertEqual(ziproto.validate(data + b"\x01"), len(data))
+            self.assertEqual(ziproto.validate(bytearray(data)), len(data))
+
+    def test_every_truncation(self):
+        for value in VALUES[:-1]:
+            data = ziproto.encode(value)
+            for cut in range(len(data)):
+                with self.assertRaisesRegex(ValueError, "Truncated"):
+                    ziproto.validate(data[:cut])
+
+    def test_malformed(self):
+        with self.assertRaisesRegex(ValueError, "offset 1"):
+            ziproto.validate(b"\x91\xc1")
+        with self.assertRaises(ValueError):
+            ziproto.validate(b"\xdd\xff\xff\xff\xff")
+
+    def test_max_depth(self):
+        data = ziproto.encode([[[[1]]]])
+        self.assertEqual(ziproto.validate(data, max_depth=4), len(data))
+        with self.assertRaisesRegex(ValueError, "Nesting too deep"):
+            ziproto.validate(data, max_depth=3)
+        self.assertEqual(ziproto.validate(b"\x01", max_depth=0), 1)
+        with self.assertRaises(ValueError):
+            ziproto.validate(b"\x90", max_depth=0)
+        self.assertEqual(ziproto.validate(b"\x91" * 511 + b"\x01"), 512)
+        with self.assertRaises(ValueError):
+            ziproto.validate(b"\x91" * 600)
+
+    def test_max_len(self):
+        data = ziproto.encode([[[[1]]]])
+        self.assertEqual(ziproto.validate(data, max_len=len(data)), len(data))
+        with self.assertRaisesRegex(ValueError, "max_len"):
+            ziproto.validate(data, max_len=3)
+
+    def test_bad_limits(self):
+        for kwargs in ({"max_depth": -1}, {"max_len": -1}, {"max_depth": 100000}):
+            with self.assertRaises(ValueError):
+                ziproto.validate(b"\x01", **kwargs)
+
+
+if __name__ == "__main__":
+    unittest.main()
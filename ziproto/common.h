@@ -1,112 +1,224 @@
 #pragma once
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
+#include <ziproto.h>
+#include <time.h>
 
 #define likely(x)      __builtin_expect(!!(x), 1)
 #define unlikely(x)    __builtin_expect(!!(x), 0)
 #define NODISCARD __attribute__((warn_unused_result))
 
-// Value types as defined in:
-// https://github.com/Netkas/ZiProto-Python/blob/master/ziproto/ValueType.py
-typedef enum
+// UTF-8 view of a str. Compact ASCII strings are their own UTF-8 so read them
+// directly instead of going through PyUnicode_AsUTF8AndSize.
+static inline const char *StrAsUTF8(PyObject *obj, Py_ssize_t *length)
 {
-	NIL_TYPE,
-	BOOL_TYPE,
-	INT_TYPE,
-	FLOAT_TYPE,
-	BIN_TYPE,
-	STR_TYPE,
-	ARRAY_TYPE,
-	MAP_TYPE,
-	// in the Python version of ZiProto this
-	// does not exist, I had to create it becase
-	// there is no way to differentiate a signed
-	// or unsigned type in C based on value.
-	UINT_TYPE
-} ValueType_t;
+	if (likely(PyUnicode_IS_COMPACT_ASCII(obj)))
+	{
+		*length = PyUnicode_GET_LENGTH(obj);
+		return (const char *)PyUnicode_DATA(obj);
+	}
+	return PyUnicode_AsUTF8AndSize(obj, length);
+}
 
-typedef enum
+/**
+ * @struct ZiDecodeFrame_t
+ * @brief A partially decoded array or map on the decoder's explicit stack
+ */
+typedef struct
 {
-	POSITIVE_FIXINT = 0x00,
-	FIXMAP          = 0x80,
-	FIXARRAY        = 0x90,
-	FIXSTR          = 0xA0,
-	NIL             = 0xC0,
-	FALSE           = 0xC2,
-	TRUE            = 0xC3,
-	BIN8            = 0xC4,
-	BIN16           = 0xC5,
-	BIN32           = 0xC6,
-	FLOAT32         = 0xCA,
-	FLOAT64         = 0xCB,
-	UINT8           = 0xCC,
-	UINT16          = 0xCD,
-	UINT32          = 0xCE,
-	UINT64          = 0xCF,
-	INT8            = 0xD0,
-	INT16           = 0xD1,
-	INT32           = 0xD2,
-	INT64           = 0xD3,
-	STR8            = 0xD9,
-	STR16           = 0xDA,
-	STR32           = 0xDB,
-	ARRAY16         = 0xDC,
-	ARRAY32         = 0xDD,
-	MAP16           = 0xDE,
-	MAP32           = 0xDF,
-	NEGATIVE_FIXINT = 0xE0
-} ZiProtoFormat_t;
-
-inline void *memrev(void *dest, const void *src, size_t n)
+	/*@{*/
+	PyObject *container;    /**< The list or dict being filled */
+	PyObject *key;          /**< Decoded map key still waiting for its value */
+	size_t    index;        /**< Number of elements (or map entries) decoded so far */
+	size_t    length;       /**< Number of elements (or map entries) in the container */
+	/*@}*/
+} ZiDecodeFrame_t;
+
+/**
+ * @struct ZiKeyCache_t
+ * @brief Direct mapped cache of interned map key strings, indexed by a hash of their UTF-8 bytes
+ */
+typedef struct
 {
-	// Iterators, s is beginning, e is end.
-	unsigned char *s = (unsigned char *)dest, *e = ((unsigned char *)dest) + n - 1;
+	/*@{*/
+	PyObject **entries;     /**< Cached str objects, null for empty slots */
+	size_t     size;        /**< Number of slots, a power of two. 0 disables the cache */
+	/*@}*/
+} ZiKeyCache_t;
 
-	// Copy to out buffer for our work
-	memcpy(dest, src, n);
+// Keys longer than this are rarely repeated and never cached
+#define KEY_CACHE_MAXLEN 64
+// Number of slots in the default key cache
+#define KEY_CACHE_SIZE 1024
+// Default nesting limit of ziproto.validate()
+#define VALIDATE_MAX_DEPTH 512
+// Smallest encoded size encode(obj, compress=True) tries to compress
+#define COMPRESS_THRESHOLD 1024
+// Bytes extract() asks a stream's read() for at a time
+#define EXTRACT_CHUNK 65536
 
-	// Iterate and reverse copy the bytes
-	for (; s < e; ++s, --e)
-	{
-		unsigned char t = *s;
-		*s              = *e;
-		*e              = t;
-	}
+extern ZiKeyCache_t DefaultKeyCache;
 
-	// Return provided buffer
-	return dest;
-}
+/**
+ * @struct ZiEncodedKey_t
+ * @brief An interned map key str together with its complete encoding
+ */
+typedef struct
+{
+	/*@{*/
+	PyObject *key;                            /**< The cached str, null for empty slots */
+	uint8_t   length;                         /**< Number of bytes in encoded */
+	uint8_t   encoded[KEY_CACHE_MAXLEN + 2];  /**< STR header followed by the UTF-8 bytes */
+	/*@}*/
+} ZiEncodedKey_t;
+
+/**
+ * @struct ZiEncodedKeyCache_t
+ * @brief Direct mapped cache of encoded map keys, indexed by the address of the interned str
+ */
+typedef struct
+{
+	/*@{*/
+	ZiEncodedKey_t *entries; /**< Cached keys */
+	size_t          size;    /**< Number of slots, a power of two. 0 disables the cache */
+	/*@}*/
+} ZiEncodedKeyCache_t;
+
+extern ZiEncodedKeyCache_t EncodedKeyCache;
 
 /**
- * @struct ZiHandle_t
- * @brief Handle to ZiProto state and encoded data
+ * @struct ZiDecodeStack_t
+ * @brief Heap allocated stack of open containers, used instead of C recursion
  */
-typedef struct 
+typedef struct
 {
 	/*@{*/
-	size_t szEncodedData;   /**< Size of the raw ZiProto data buffer */
-	size_t _allocsz;        /**< Allocated size of the EncodedData object */
-	size_t _cursor;         /**< Current position in the EncodedData buffer */
-	uint8_t *EncodedData;   /**< Raw ZiProto encoded data */
+	ZiDecodeFrame_t *frames; /**< Open containers, innermost last */
+	size_t depth;            /**< Number of open containers */
+	size_t _allocdepth;      /**< Allocated number of frames */
+	ZiKeyCache_t *keycache;  /**< Cache used for map keys, may be null */
+	bool typedarrays;        /**< Decode arrays holding only ints or only floats to array.array */
+	PyObject *strings;       /**< Strings decoded so far in a message with string references, null otherwise */
 	/*@}*/
-} ZiHandle_t;
-
-extern ZiHandle_t NODISCARD *EncodeTypeSingle(ZiHandle_t *handle, ValueType_t vType, const void *TypeBuffer, size_t szTypeBuffer);
-
-// Macros to make things seem function-like
-#define FreeZiHandle(x) {free(x->EncodedData); free(x);}
-#define GetZiSize(x) (x->szEncodedData)
-#define GetZiData(x) (x->EncodedData)
-
-// Define the bigendian function to either be
-// memcpy or memrev depending on the arctiecture
-// we're compiling on. This is used elsewhere
-// since ziproto is big endian by default.
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-# define bigendian memrev
-#else
-# define bigendian memcpy
-#endif
-
-extern PyObject *ziproto_decode(PyObject *self, PyObject *args);
-extern PyObject *ziproto_encode(PyObject *self, PyObject *args);
+} ZiDecodeStack_t;
+
+// Python API calls timed by ziproto.stats()
+typedef enum
+{
+	ZI_API_ENCODE,
+	ZI_API_ENCODE_INTO,
+	ZI_API_DECODE,
+	ZI_API_DECODE_ALL,
+	ZI_API_PACK,
+	ZI_API_UNPACK,
+	ZI_API_COUNT
+} ZiApi_t;
+
+/**
+ * @struct ZiApiStats_t
+ * @brief Counters of one python API call
+ */
+typedef struct
+{
+	/*@{*/
+	uint64_t calls;    /**< Successful calls */
+	uint64_t bytesin;  /**< Encoded bytes decoded */
+	uint64_t bytesout; /**< Encoded bytes produced */
+	uint64_t timens;   /**< Time spent in the calls */
+	/*@}*/
+} ZiApiStats_t;
+
+/**
+ * @struct ZiThreadStats_t
+ * @brief Counters of one thread, only ever written by that thread
+ */
+typedef struct ZiThreadStats
+{
+	/*@{*/
+	ZiStats_t             encoder;          /**< Handle level counters */
+	ZiApiStats_t          api[ZI_API_COUNT]; /**< Counters per API call */
+	struct ZiThreadStats *next;             /**< Next live thread in the list summed by stats() */
+	/*@}*/
+} ZiThreadStats_t;
+
+extern bool StatsEnabled;
+extern _Thread_local ZiThreadStats_t *CurrentThreadStats;
+extern ZiThreadStats_t *RegisterThreadStats(void);
+
+// The calling thread's counters, or null while statistics are off.
+static inline ZiThreadStats_t *ThreadStats(void)
+{
+	if (likely(!StatsEnabled))
+		return NULL;
+	return CurrentThreadStats ? CurrentThreadStats : RegisterThreadStats();
+}
+
+// Counters to point a ZiHandle_t at, or null while statistics are off.
+static inline ZiStats_t *EncoderStats(void)
+{
+	ZiThreadStats_t *stats = ThreadStats();
+	return stats ? &stats->encoder : NULL;
+}
+
+// Start time of a counted call, 0 if stats is null.
+static inline uint64_t StatsClock(const ZiThreadStats_t *stats)
+{
+	if (!stats)
+		return 0;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void CountApiCall(ZiThreadStats_t *stats, ZiApi_t api, uint64_t start, size_t bytesin, size_t bytesout)
+{
+	if (!stats)
+		return;
+	ZiApiStats_t *counters = &stats->api[api];
+	counters->calls++;
+	counters->bytesin  += bytesin;
+	counters->bytesout += bytesout;
+	counters->timens   += StatsClock(stats) - start;
+}
+
+extern ZiHandle_t *EncodePyType(ZiHandle_t *handle, PyObject *obj);
+extern int SizePyType(PyObject *obj, size_t *size);
+extern PyObject *EncodeToBytes(PyObject *obj);
+
+extern ZiDecodeStatus_t DecodeResume(ZiHandle_t *handle, ZiDecodeStack_t *stack, PyObject **out);
+extern ZiDecodeStatus_t DecodeMessageResume(ZiHandle_t *handle, ZiDecodeStack_t *stack, PyObject **out);
+extern PyObject *DecodeMessage(ZiHandle_t *handle, ZiDecodeStack_t *stack);
+extern void ClearDecodeStack(ZiDecodeStack_t *stack);
+extern void SetDecodeError(ZiDecodeStatus_t status, const ZiHandle_t *handle);
+extern PyObject *DecodeNext(ZiHandle_t *handle);
+extern PyObject *DecodeNextWithCache(ZiHandle_t *handle, ZiKeyCache_t *keycache);
+extern PyObject *NewTypedArray(char typecode, size_t count, void **items);
+
+extern int ResizeKeyCache(ZiKeyCache_t *cache, size_t size);
+extern int ResizeEncodedKeyCache(ZiEncodedKeyCache_t *cache, size_t size);
+
+extern int MapFile(PyObject *path, int advice, uint8_t **data, size_t *size);
+
+extern PyObject *ziproto_decode(PyObject *self, PyObject *args, PyObject *kwds);
+extern PyObject *ziproto_decode_all(PyObject *self, PyObject *args, PyObject *kwds);
+extern PyObject *ziproto_validate(PyObject *self, PyObject *args, PyObject *kwds);
+extern PyObject *ziproto_extract(PyObject *self, PyObject *args, PyObject *kwds);
+extern PyObject *ziproto_set_key_cache_size(PyObject *self, PyObject *arg);
+extern PyObject *ziproto_encode(PyObject *self, PyObject *args, PyObject *kwds);
+extern PyObject *ziproto_encode_into(PyObject *self, PyObject *args, PyObject *kwds);
+extern PyObject *ziproto_encoded_size(PyObject *self, PyObject *obj);
+extern PyObject *ziproto_iter_file(PyObject *self, PyObject *path);
+extern PyObject *ziproto_load(PyObject *self, PyObject *path);
+extern PyObject *ziproto_stats(PyObject *self, PyObject *Py_UNUSED(ignored));
+extern PyObject *ziproto_reset_stats(PyObject *self, PyObject *Py_UNUSED(ignored));
+extern PyObject *ziproto_enable_stats(PyObject *self, PyObject *args, PyObject *kwds);
+
+extern PyTypeObject ZiPackerType;
+extern PyTypeObject ZiUnpackerType;
+extern PyTypeObject ZiLazyViewType;
+extern PyTypeObject ZiLazyIterType;
+extern PyTypeObject ZiFileIterType;
+extern PyTypeObject ZiRecordWriterType;
+extern PyTypeObject ZiRecordReaderType;
+extern PyTypeObject ZiRecordIterType;
+extern PyTypeObject ZiSchemaType;
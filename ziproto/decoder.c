@@ -1,200 +1,1024 @@
 #include "common.h"
-#include <stdarg.h>
+#include <stdbool.h>
 
+// Map key cache used by ziproto.decode and Unpacker
+ZiKeyCache_t DefaultKeyCache = { NULL, 0 };
 
-void PrintObject(PyObject *obj, const char *format, ...)
+/**
+ * @brief Drops every cached key and resizes the cache.
+ *
+ * @param[in] cache The cache to resize
+ * @param[in] size  Number of slots, rounded up to a power of two. 0 disables the cache.
+ * @returns 0 on success or -1 with a python exception set.
+ */
+int ResizeKeyCache(ZiKeyCache_t *cache, size_t size)
 {
-	PyObject *namestr_obj = PyObject_ASCII(obj);
-	Py_INCREF(namestr_obj);
-	// Now try and get the string'd version of that object
-	puts(PyUnicode_AsUTF8(namestr_obj));
-	va_list ap;
-	va_start(ap, format);
-	vprintf(format, ap);
-	va_end(ap);
-	Py_DECREF(namestr_obj);
+	size_t slots = 0;
+	if (size)
+	{
+		for (slots = 1; slots < size; slots <<= 1)
+			;
+	}
+
+	PyObject **entries = NULL;
+	if (slots)
+	{
+		entries = calloc(slots, sizeof(PyObject *));
+		if (!entries)
+		{
+			PyErr_NoMemory();
+			return -1;
+		}
+	}
+
+	for (size_t i = 0; i < cache->size; ++i)
+		Py_XDECREF(cache->entries[i]);
+	free(cache->entries);
+
+	cache->entries = entries;
+	cache->size    = slots;
+	return 0;
 }
 
-static const int _sizes[] = {
-	sizeof(int8_t),
-	sizeof(int16_t),
-	sizeof(int32_t),
-	sizeof(int64_t)
-};
-static const int _usizes[] = {
-	sizeof(uint8_t),
-	sizeof(uint16_t),
-	sizeof(uint32_t),
-	sizeof(uint64_t)
-};
+/**
+ * @brief Creates a str from UTF-8 bytes.
+ *
+ * Pure ASCII strings, which are most keys and identifiers, are copied
+ * straight into a new compact ASCII str instead of going through the
+ * UTF-8 decoder.
+ *
+ * @param[in] data The string's UTF-8 bytes
+ * @param[in] len  Length of the string in bytes
+ * @returns A new reference to the str or null with a python exception set.
+ */
+static PyObject *DecodeString(const char *data, size_t len)
+{
+	// Leave empty and single character strings to python, it has shared instances of them
+	if (len > 1 && ZiIsAscii((const uint8_t *)data, len))
+	{
+		PyObject *str = PyUnicode_New(len, 127);
+		if (likely(str))
+			memcpy(PyUnicode_1BYTE_DATA(str), data, len);
+		return str;
+	}
+	return PyUnicode_DecodeUTF8(data, len, NULL);
+}
 
-PyObject *DecodeNext(ZiHandle_t *bytedata)
+/**
+ * @brief Returns an interned str for a map key, reusing a cached one when possible.
+ *
+ * @param[in] cache The key cache, must have a non-zero size
+ * @param[in] data  The key's UTF-8 bytes
+ * @param[in] len   Length of the key in bytes
+ * @returns A new reference to the key or null with a python exception set.
+ */
+static PyObject *CachedKey(ZiKeyCache_t *cache, const char *data, size_t len)
 {
-	uint8_t *data = bytedata->EncodedData + bytedata->_cursor + 1;
-	uint8_t byte = *(bytedata->EncodedData + bytedata->_cursor);
-	// Increment past our type byte
-	bytedata->_cursor += 1;
-	
-	printf("Decoding byte: 0x%x\n", byte);
-	
-	if (byte < FIXMAP)
+	if (len > KEY_CACHE_MAXLEN)
+		return DecodeString(data, len);
+
+	// FNV-1a, keys are short so this is plenty
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < len; ++i)
+		hash = (hash ^ (uint8_t)data[i]) * 0x100000001b3ULL;
+
+	PyObject **slot = &cache->entries[hash & (cache->size - 1)];
+	if (*slot)
 	{
-		return PyLong_FromLong(byte);
+		Py_ssize_t  szcached = 0;
+		const char *cached   = StrAsUTF8(*slot, &szcached);
+		if (cached && (size_t)szcached == len && !memcmp(cached, data, len))
+		{
+			Py_INCREF(*slot);
+			return *slot;
+		}
 	}
-	else if (byte >= FIXMAP && byte < FIXARRAY) // Handle FIXMAP
+
+	PyObject *key = DecodeString(data, len);
+	if (!key)
+		return NULL;
+	PyUnicode_InternInPlace(&key);
+
+	Py_INCREF(key);
+	Py_XSETREF(*slot, key);
+	return key;
+}
+
+/**
+ * @brief Decodes the element at the cursor.
+ *
+ * Scalars are decoded completely. For arrays and maps an empty container, presized
+ * from the header, is returned and length is set to the number of elements (or map
+ * entries) the caller still has to decode into it. The cursor is only advanced once
+ * the whole element is known to be inside the buffer.
+ *
+ * @param[in]  handle   The ZiHandle object with the current decoding state
+ * @param[in]  keycache Cache to take strings from if the element is a map key, otherwise null
+ * @param[in]  strings  Strings decoded so far when the message has string references, otherwise null
+ * @param[out] out      The decoded object or container
+ * @param[out] length   Number of elements still to be read into a container, 0 for scalars
+ * @returns ZI_DECODE_OK on success or the reason decoding stopped.
+ */
+static ZiDecodeStatus_t DecodeItem(ZiHandle_t *handle, ZiKeyCache_t *keycache, PyObject *strings, PyObject **out, size_t *length)
+{
+	size_t           start = handle->_cursor;
+	ZiValue_t        value;
+	ZiDecodeStatus_t status = ZiReadNext(handle, &value);
+	PyObject        *obj    = NULL;
+
+	*length = 0;
+
+	if (unlikely(status != ZI_DECODE_OK))
+		return status;
+
+	switch (value.vType)
 	{
-		// TODO: decode this?
-		printf("Byte is a FIXMAP! %d\n", byte - FIXMAP);
+		case ZI_NIL_TYPE:
+			Py_INCREF(Py_None);
+			obj = Py_None;
+			break;
+		case ZI_BOOL_TYPE:
+			obj = PyBool_FromLong(value.value.b);
+			break;
+		case ZI_UINT_TYPE:
+			obj = PyLong_FromUnsignedLongLong(value.value.u);
+			break;
+		case ZI_INT_TYPE:
+			obj = PyLong_FromLongLong(value.value.i);
+			break;
+		case ZI_FLOAT_TYPE:
+			obj = PyFloat_FromDouble(value.value.f);
+			break;
+		case ZI_STR_TYPE:
+			if (keycache)
+				obj = CachedKey(keycache, (const char *)value.data, value.length);
+			else
+				obj = DecodeString((const char *)value.data, value.length);
+
+			// Number every string so later references can find it
+			if (strings && obj && PyList_Append(strings, obj) < 0)
+				Py_CLEAR(obj);
+			break;
+		case ZI_STRREF_TYPE:
+			if (strings && value.value.u < (uint64_t)PyList_GET_SIZE(strings))
+			{
+				obj = PyList_GET_ITEM(strings, value.value.u);
+				Py_INCREF(obj);
+			}
+			else if (!strings)
+				PyErr_Format(PyExc_ValueError, "Decode failed. String reference outside a string_refs message at offset %zu", start);
+			else
+				PyErr_Format(PyExc_ValueError, "Decode failed. Unknown string reference %llu at offset %zu",
+				             (unsigned long long)value.value.u, start);
+			break;
+		case ZI_BIN_TYPE:
+			obj = PyBytes_FromStringAndSize((const char *)value.data, value.length);
+			break;
+		case ZI_ARRAY_TYPE:
+			obj     = PyList_New(value.length);
+			*length = value.length;
+			break;
+		case ZI_MAP_TYPE:
+			obj     = _PyDict_NewPresized(value.length);
+			*length = value.length;
+			break;
+		default:
+			break;
 	}
-	else if (byte >= FIXARRAY && byte < FIXSTR) // Handle FIXARRAY
+
+	if (unlikely(!obj))
 	{
-		printf("Byte is a FIXARRAY! %d\n", byte - FIXMAP);
+		// Leave the cursor on the element so the caller can report where we stopped
+		handle->_cursor = start;
+		*length         = 0;
+		return ZI_DECODE_ERROR;
 	}
-	else if (byte >= FIXSTR && byte < NIL) // Handle FIXSTR
+
+	*out = obj;
+	return ZI_DECODE_OK;
+}
+
+// array.array, imported the first time typed arrays are decoded
+static PyObject *ArrayType = NULL;
+
+/**
+ * @brief Creates an array.array of count zeroed values to be filled in place.
+ *
+ * The array is made by repeating a one element array, which allocates its
+ * storage at the final size without any intermediate buffer.
+ *
+ * @param[in]  typecode The array.array typecode of the values
+ * @param[in]  count    Number of values
+ * @param[out] items    The array's storage, valid as long as the array isn't resized
+ * @returns The new array, or null with a python exception set.
+ */
+PyObject *NewTypedArray(char typecode, size_t count, void **items)
+{
+	if (unlikely(!ArrayType))
+	{
+		PyObject *module = PyImport_ImportModule("array");
+		if (!module)
+			return NULL;
+		ArrayType = PyObject_GetAttrString(module, "array");
+		Py_DECREF(module);
+		if (!ArrayType)
+			return NULL;
+	}
+
+	if (count > PY_SSIZE_T_MAX / sizeof(uint64_t))
+		return PyErr_NoMemory();
+
+	PyObject *zero = typecode == 'd' ? PyFloat_FromDouble(0.0) : PyLong_FromLong(0);
+	if (!zero)
+		return NULL;
+	PyObject *one = PyObject_CallFunction(ArrayType, "C[N]", typecode, zero);
+	if (!one)
+		return NULL;
+	PyObject *array = PySequence_Repeat(one, count);
+	Py_DECREF(one);
+	if (!array)
+		return NULL;
+
+	Py_buffer view;
+	if (PyObject_GetBuffer(array, &view, PyBUF_WRITABLE) < 0)
+	{
+		Py_DECREF(array);
+		return NULL;
+	}
+	*items = view.buf;
+	PyBuffer_Release(&view);
+	return array;
+}
+
+/**
+ * @brief Decodes an array holding only ints or only floats into an array.array.
+ *
+ * Called with the cursor on any element, before a list was created for it.
+ * The elements are first checked to pick the typecode, floats as 'd', ints as
+ * 'q' or, when one of them only fits unsigned, 'Q'. They are then read a second
+ * time straight into the array's storage, without a python object or any other
+ * buffer for them. Arrays holding anything else, or mixing negative and
+ * unsigned-only ints, and anything that isn't a non-empty array are left alone
+ * with the cursor unchanged.
+ *
+ * @param[in]  handle The ZiHandle object with the current decoding state
+ * @param[out] out    The array.array, or null when the element has to be decoded by DecodeItem
+ * @returns ZI_DECODE_OK, or ZI_DECODE_ERROR with a python exception set.
+ */
+static ZiDecodeStatus_t DecodeTypedArray(ZiHandle_t *handle, PyObject **out)
+{
+	size_t        start = handle->_cursor;
+	ZiValue_t     value;
+	ZiValueType_t kind = ZI_INVALID_TYPE;
+	bool          negative = false, unsignedonly = false;
+
+	*out = NULL;
+
+	if (ZiReadNext(handle, &value) != ZI_DECODE_OK || value.vType != ZI_ARRAY_TYPE || !value.length)
+		goto mixed;
+
+	size_t count = value.length;
+	size_t first = handle->_cursor;
+	for (size_t i = 0; i < count; ++i)
 	{
-		// FIXSTRs can only be 32 bytes big, 1 byte for null terminator
-		char buffer[33] = {0};
-		uint8_t len = byte - FIXSTR;
-		memcpy(buffer, data, len);
-		buffer[len + 1] = 0;
-		bytedata->_cursor += len;
-		return PyUnicode_FromStringAndSize(buffer, len);
+		if (ZiReadNext(handle, &value) != ZI_DECODE_OK)
+			goto mixed;
+
+		ZiValueType_t itemkind = value.vType == ZI_UINT_TYPE ? ZI_INT_TYPE : value.vType;
+		if ((itemkind != ZI_FLOAT_TYPE && itemkind != ZI_INT_TYPE) || (i && itemkind != kind))
+			goto mixed;
+
+		kind          = itemkind;
+		negative     |= value.vType == ZI_INT_TYPE;
+		unsignedonly |= value.vType == ZI_UINT_TYPE && value.value.u > INT64_MAX;
 	}
-	else if (byte == NIL)
+
+	if (negative && unsignedonly)
+		goto mixed;
+
+	uint8_t *data = NULL;
+	handle->_cursor = first;
+	if (!(*out = NewTypedArray(kind == ZI_FLOAT_TYPE ? 'd' : unsignedonly ? 'Q' : 'q', count, (void **)&data)))
 	{
-		Py_RETURN_NONE;
+		handle->_cursor = start;
+		return ZI_DECODE_ERROR;
 	}
-	else if (byte == TRUE || byte == FALSE)
+
+	// Everything was checked above, the union holds the bits of either kind
+	for (size_t i = 0; i < count; ++i)
 	{
-		if (byte == TRUE)
+		ZiReadNext(handle, &value);
+		memcpy(data + i * sizeof(uint64_t), &value.value.u, sizeof(uint64_t));
+	}
+	return ZI_DECODE_OK;
+
+mixed:
+	handle->_cursor = start;
+	return ZI_DECODE_OK;
+}
+
+/**
+ * @brief Decodes (or continues decoding) one complete object.
+ *
+ * Nested arrays and maps are tracked on an explicit heap allocated stack rather
+ * than through recursion, so arbitrarily deep input can't overflow the C stack.
+ * When the data runs out the open containers are left on the stack and the cursor
+ * points at the first incomplete element, so decoding can be resumed with the same
+ * stack once more data is available.
+ *
+ * @param[in]     handle The ZiHandle object with the current decoding state
+ * @param[in,out] stack  Containers still being filled
+ * @param[out]    out    The decoded object on ZI_DECODE_OK
+ * @returns ZI_DECODE_OK or the reason decoding stopped, see ZiDecodeStatus_t.
+ */
+ZiDecodeStatus_t DecodeResume(ZiHandle_t *handle, ZiDecodeStack_t *stack, PyObject **out)
+{
+	for (;;)
+	{
+		PyObject     *item     = NULL;
+		size_t        length   = 0;
+		ZiKeyCache_t *keycache = NULL;
+
+		// Only map keys go through the key cache
+		if (stack->keycache && stack->keycache->size && stack->depth)
 		{
-			Py_RETURN_TRUE;
+			ZiDecodeFrame_t *top = &stack->frames[stack->depth - 1];
+			if (!top->key && PyDict_CheckExact(top->container))
+				keycache = stack->keycache;
 		}
-		else
+
+		// Numeric arrays are tried before DecodeItem would create a list for them
+		if (stack->typedarrays && unlikely(DecodeTypedArray(handle, &item) != ZI_DECODE_OK))
+			return ZI_DECODE_ERROR;
+
+		if (!item)
 		{
-			Py_RETURN_FALSE;
+			ZiDecodeStatus_t status = DecodeItem(handle, keycache, stack->strings, &item, &length);
+			if (status != ZI_DECODE_OK)
+				return status;
 		}
-	}
-	else if (byte == BIN8 || byte == BIN16 || BIN8 == BIN32)
-	{
-		uint32_t len = 0;
-		
-		// Copy our length byte (from big endianness)
-		memrev(&len, data, _usizes[byte - BIN8]);
-		// Advance our cursor
-		bytedata->_cursor += _usizes[byte - BIN8];
-		// Pointer to the actual data.
-		uint8_t *d = data + _usizes[byte - BIN8];
-		// Advance our cursor again
-		bytedata->_cursor += len;
-		
-		char *text= malloc(len);
-		memset(text, 0, len);
-		memcpy(text, d, len);
-		
-		return PyBytes_FromObject(PyMemoryView_FromMemory(text, len, PyBUF_READ));
-	}
-	else if (byte == FLOAT32 || byte == FLOAT64)
-	{
-		// Python only accepts doubles for floating point values
-		double value = 0.0;
-		
-		if (byte == FLOAT32)
+
+		// Non-empty containers are opened and filled by the following elements.
+		if (length)
 		{
-			float fvalue = 0.0;
-			memrev(&value, data, sizeof(float));
-			value = fvalue;
-			bytedata->_cursor += sizeof(float);
+			if (unlikely(stack->depth == stack->_allocdepth))
+			{
+				size_t newdepth = stack->_allocdepth ? stack->_allocdepth * 2 : 16;
+				ZiDecodeFrame_t *frames = realloc(stack->frames, newdepth * sizeof(ZiDecodeFrame_t));
+				if (unlikely(!frames))
+				{
+					Py_DECREF(item);
+					PyErr_NoMemory();
+					return ZI_DECODE_ERROR;
+				}
+				stack->frames      = frames;
+				stack->_allocdepth = newdepth;
+			}
+
+			ZiDecodeFrame_t *frame = &stack->frames[stack->depth++];
+			frame->container = item;
+			frame->key       = NULL;
+			frame->index     = 0;
+			frame->length    = length;
+			continue;
 		}
-		else
+
+		// Store the completed item in its parent, closing every container it completes.
+		while (stack->depth)
+		{
+			ZiDecodeFrame_t *top = &stack->frames[stack->depth - 1];
+
+			if (PyList_CheckExact(top->container))
+				PyList_SET_ITEM(top->container, top->index++, item);
+			else if (!top->key)
+			{
+				top->key = item;
+				item     = NULL;
+				break;
+			}
+			else
+			{
+				int ret = PyDict_SetItem(top->container, top->key, item);
+				Py_DECREF(top->key);
+				Py_DECREF(item);
+				top->key = NULL;
+				if (unlikely(ret < 0))
+					return ZI_DECODE_ERROR;
+				top->index++;
+			}
+
+			if (top->index < top->length)
+			{
+				item = NULL;
+				break;
+			}
+
+			item = top->container;
+			stack->depth--;
+		}
+
+		if (item)
 		{
-			memrev(&value, data, sizeof(value));
-			bytedata->_cursor += sizeof(value);
+			*out = item;
+			return ZI_DECODE_OK;
 		}
-		
-		return PyFloat_FromDouble(value);
 	}
-	else if (byte >= UINT8 && byte <= UINT64)
+}
+
+/**
+ * @brief Releases every partially decoded container on the stack.
+ */
+void ClearDecodeStack(ZiDecodeStack_t *stack)
+{
+	for (size_t i = 0; i < stack->depth; ++i)
 	{
-		uint64_t value = 0;
-		memrev(&value, data, _usizes[byte - UINT8]);
-		bytedata->_cursor += _usizes[byte - UINT8];
-		return PyLong_FromUnsignedLongLong(value);
+		Py_XDECREF(stack->frames[i].container);
+		Py_XDECREF(stack->frames[i].key);
 	}
-	else if (byte >= INT8 && byte <= INT64)
+	free(stack->frames);
+	stack->frames      = NULL;
+	stack->depth       = 0;
+	stack->_allocdepth = 0;
+	Py_CLEAR(stack->strings);
+}
+
+/**
+ * @brief Raises the python exception matching a failed decode status.
+ *
+ * Nothing is raised for ZI_DECODE_OK, and ZI_DECODE_ERROR already has an exception set.
+ */
+void SetDecodeError(ZiDecodeStatus_t status, const ZiHandle_t *handle)
+{
+	if (status == ZI_DECODE_TRUNCATED)
+		PyErr_Format(PyExc_ValueError, "Decode failed. Truncated data at offset %zu", handle->_cursor);
+	else if (status == ZI_DECODE_MALFORMED && ZiFormatTable[handle->EncodedData[handle->_cursor]].kind == ZI_STRREF_TYPE)
+		PyErr_Format(PyExc_ValueError, "Decode failed. Invalid string reference at offset %zu", handle->_cursor);
+	else if (status == ZI_DECODE_MALFORMED)
+		PyErr_Format(PyExc_ValueError, "Decode failed. Unknown format byte 0x%02x at offset %zu",
+		             handle->EncodedData[handle->_cursor], handle->_cursor);
+	else if (status == ZI_DECODE_TOO_DEEP)
+		PyErr_Format(PyExc_ValueError, "Decode failed. Nesting too deep at offset %zu", handle->_cursor);
+}
+
+/**
+ * @brief Decodes one complete object at the cursor with the options set in an empty stack.
+ *
+ * @param[in] handle The ZiHandle object with the current decoding state
+ * @param[in] stack  An empty stack carrying the key cache and decode options, it is cleared afterwards
+ * @returns The decoded object or NULL with a python exception set.
+ */
+static PyObject *DecodeNextWithStack(ZiHandle_t *handle, ZiDecodeStack_t *stack)
+{
+	PyObject        *obj    = NULL;
+	ZiDecodeStatus_t status = DecodeResume(handle, stack, &obj);
+
+	ClearDecodeStack(stack);
+	SetDecodeError(status, handle);
+
+	return status == ZI_DECODE_OK ? obj : NULL;
+}
+
+/**
+ * @brief Decompresses the frame at the cursor into one allocation sized from its header.
+ *
+ * @param[in]  handle    The ZiHandle object with a ZI_FRAME_COMPRESSED frame at its cursor
+ * @param[in]  maxraw    Largest decompressed size to allocate, larger frames raise ValueError
+ * @param[out] raw       The decompressed data, to be released with PyMem_Free
+ * @param[out] rawsize   Size of the decompressed data
+ * @param[out] framesize Size of the whole frame
+ * @returns ZI_DECODE_OK, ZI_DECODE_TRUNCATED if the frame isn't complete yet,
+ *          or ZI_DECODE_ERROR with a python exception set.
+ */
+static ZiDecodeStatus_t DecompressFrame(const ZiHandle_t *handle, size_t maxraw, uint8_t **raw, size_t *rawsize, size_t *framesize)
+{
+	const uint8_t   *frame  = handle->EncodedData + handle->_cursor;
+	ZiDecodeStatus_t status = ZiReadFrameHeader(frame, handle->szEncodedData - handle->_cursor, rawsize, framesize);
+
+	if (status == ZI_DECODE_TRUNCATED)
+		return status;
+
+	if (status == ZI_DECODE_OK && *rawsize > maxraw)
 	{
-		int64_t value = 0;
-		memrev(&value, data, _sizes[byte - INT8]);
-		bytedata->_cursor += _sizes[byte - INT8];
-		return PyLong_FromLongLong(value);
+		PyErr_Format(PyExc_ValueError, "Decode failed. Message is longer than max_len of %zu bytes", maxraw);
+		return ZI_DECODE_ERROR;
 	}
-	else if (byte >= STR8 && byte <= STR32)
+
+	*raw = NULL;
+	if (status == ZI_DECODE_OK)
 	{
-		uint64_t len = 0;
-		memrev(&len, data, _usizes[byte - STR8]);
-		bytedata->_cursor += _usizes[byte - STR8] + len;
-		const char *bad_str = (const char*)(data + _usizes[byte - STR8]);
-		return PyUnicode_FromStringAndSize(bad_str, len);
+		if (!(*raw = PyMem_Malloc(*rawsize ? *rawsize : 1)))
+		{
+			PyErr_NoMemory();
+			return ZI_DECODE_ERROR;
+		}
+
+		Py_BEGIN_ALLOW_THREADS
+		status = ZiDecompressBlock(frame + ZI_FRAME_HEADER_SIZE, *framesize - ZI_FRAME_HEADER_SIZE, *raw, *rawsize);
+		Py_END_ALLOW_THREADS
 	}
-	else if (byte == ARRAY16 || byte == ARRAY32)
+
+	// Frames nest no deeper than one level, so decoding one can never recurse
+	if (status != ZI_DECODE_OK || (*rawsize && (*raw)[0] == ZI_FRAME_COMPRESSED))
 	{
-		
+		PyMem_Free(*raw);
+		*raw = NULL;
+		PyErr_Format(PyExc_ValueError, "Decode failed. Damaged compressed frame at offset %zu", handle->_cursor);
+		return ZI_DECODE_ERROR;
 	}
-	else if (byte == MAP16 || byte == MAP32)
+	return ZI_DECODE_OK;
+}
+
+/**
+ * @brief Starts collecting strings when the message at the cursor has string references.
+ *
+ * Strings of such a message are collected in order while it is decoded so
+ * every reference to one of them returns the same str object. The list is
+ * kept on the stack, so a message resumed later still has every string.
+ *
+ * @returns 0 on success or -1 with a python exception set.
+ */
+static int StartStringRefs(ZiHandle_t *handle, ZiDecodeStack_t *stack)
+{
+	if (stack->depth || stack->strings || handle->_cursor >= handle->szEncodedData ||
+	    handle->EncodedData[handle->_cursor] != ZI_FRAME_STRING_REFS)
+		return 0;
+
+	if (!(stack->strings = PyList_New(0)))
+		return -1;
+
+	handle->_cursor++;
+	return 0;
+}
+
+/**
+ * @brief Decompresses a frame written by encode(obj, compress=True) and decodes the object in it.
+ *
+ * The frame is only decoded once all of it is in the buffer, so a truncated
+ * frame leaves the cursor on it to be resumed from like any other element.
+ * The decompressed data has to hold exactly one message.
+ *
+ * @param[in]  handle The ZiHandle object with a frame at its cursor, the cursor is moved past it
+ * @param[in]  stack  Decoder state, only its options are used
+ * @param[out] out    The decoded object on ZI_DECODE_OK
+ * @returns ZI_DECODE_OK, ZI_DECODE_TRUNCATED or ZI_DECODE_ERROR with a python exception set.
+ */
+static ZiDecodeStatus_t DecodeFrame(ZiHandle_t *handle, ZiDecodeStack_t *stack, PyObject **out)
+{
+	uint8_t         *raw     = NULL;
+	size_t           rawsize = 0, framesize = 0;
+	ZiDecodeStatus_t status  = DecompressFrame(handle, SIZE_MAX, &raw, &rawsize, &framesize);
+	if (status != ZI_DECODE_OK)
+		return status;
+
+	ZiHandle_t rawhandle = {
+		.szEncodedData = rawsize,
+		.EncodedData   = raw
+	};
+	ZiDecodeStack_t inner = {
+		.keycache    = stack->keycache,
+		.typedarrays = stack->typedarrays
+	};
+
+	PyObject *obj = StartStringRefs(&rawhandle, &inner) < 0 ? NULL : DecodeNextWithStack(&rawhandle, &inner);
+	if (obj && rawhandle._cursor != rawsize)
+		Py_CLEAR(obj);
+
+	if (obj)
 	{
-		
+		handle->_cursor += framesize;
+		*out             = obj;
 	}
-	else if (byte >= NEGATIVE_FIXINT)
+	else if (!PyErr_Occurred() || PyErr_ExceptionMatches(PyExc_ValueError))
 	{
-		PyObject *obj = PyLong_FromLong(-32 + (byte - NEGATIVE_FIXINT));
-		return obj;
+		PyErr_Clear();
+		PyErr_Format(PyExc_ValueError, "Decode failed. Damaged compressed frame at offset %zu", handle->_cursor);
 	}
-	Py_RETURN_NOTIMPLEMENTED;
+
+	PyMem_Free(raw);
+	return obj ? ZI_DECODE_OK : ZI_DECODE_ERROR;
+}
+
+/**
+ * @brief Decodes (or continues decoding) one message.
+ *
+ * Like DecodeResume, but a compressed frame or a ZI_FRAME_STRING_REFS byte
+ * is accepted before the object when nothing of the message was decoded
+ * yet. The strings of a message with string references stay on the stack
+ * until it is decoded or fails.
+ *
+ * @param[in]     handle The ZiHandle object with the current decoding state
+ * @param[in,out] stack  Containers still being filled
+ * @param[out]    out    The decoded object on ZI_DECODE_OK
+ * @returns ZI_DECODE_OK or the reason decoding stopped, see ZiDecodeStatus_t.
+ */
+ZiDecodeStatus_t DecodeMessageResume(ZiHandle_t *handle, ZiDecodeStack_t *stack, PyObject **out)
+{
+	if (!stack->depth && !stack->strings && handle->_cursor < handle->szEncodedData &&
+	    handle->EncodedData[handle->_cursor] == ZI_FRAME_COMPRESSED)
+		return DecodeFrame(handle, stack, out);
+
+	if (StartStringRefs(handle, stack) < 0)
+		return ZI_DECODE_ERROR;
+
+	ZiDecodeStatus_t status = DecodeResume(handle, stack, out);
+	if (status == ZI_DECODE_OK)
+		Py_CLEAR(stack->strings);
+	return status;
+}
+
+/**
+ * @brief Decodes one complete message at the cursor, see DecodeMessageResume.
+ *
+ * @param[in] handle The ZiHandle object with the message at its cursor
+ * @param[in] stack  An empty stack carrying the key cache and decode options, it is cleared afterwards
+ * @returns The decoded object or null with a python exception set.
+ */
+PyObject *DecodeMessage(ZiHandle_t *handle, ZiDecodeStack_t *stack)
+{
+	PyObject        *obj    = NULL;
+	ZiDecodeStatus_t status = DecodeMessageResume(handle, stack, &obj);
+
+	ClearDecodeStack(stack);
+	SetDecodeError(status, handle);
+
+	return status == ZI_DECODE_OK ? obj : NULL;
 }
 
-PyObject *ziproto_decode(PyObject *self, PyObject *bytes_obj)
+/**
+ * @brief Decodes one complete object at the cursor using a specific key cache.
+ *
+ * @param[in] handle   The ZiHandle object with the current decoding state
+ * @param[in] keycache Cache for map keys, may be null
+ * @returns The decoded object or NULL with a python exception set.
+ */
+PyObject *DecodeNextWithCache(ZiHandle_t *handle, ZiKeyCache_t *keycache)
 {
-	PyObject *namestr_obj = NULL;
-	if (PyBytes_Check(bytes_obj) || PyByteArray_Check(bytes_obj))
+	return DecodeNextWithStack(handle, &(ZiDecodeStack_t){ .keycache = keycache });
+}
+
+/**
+ * @brief Decodes one complete object at the cursor.
+ *
+ * @returns The decoded object or NULL with a python exception set.
+ */
+PyObject *DecodeNext(ZiHandle_t *handle)
+{
+	return DecodeNextWithCache(handle, &DefaultKeyCache);
+}
+
+PyObject *ziproto_decode(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	PyObject *bytes_obj    = NULL;
+	int       typed_arrays = 0;
+
+	// Skip argument parsing for the common decode(data) call.
+	if (likely(!kwds && PyTuple_GET_SIZE(args) == 1))
+		bytes_obj = PyTuple_GET_ITEM(args, 0);
+	else
 	{
-		Py_INCREF(bytes_obj);
-		if (PyObject_CheckBuffer(bytes_obj))
-		{
-			PyObject *memview = PyMemoryView_FromObject(bytes_obj);
-			Py_buffer *data = PyMemoryView_GET_BUFFER(memview);
-			printf("provided %d or %d bytes of data in %s format\n", data->len, data->itemsize, data->format);
-			
-			// Allocate a ZiHandle_t object
-			ZiHandle_t *netkas = malloc(sizeof(ZiHandle_t));
-			if (!netkas)
-				goto failure;
-			
-			memset(netkas, 0, sizeof(ZiHandle_t));
-			
-			netkas->EncodedData = data->buf;
-			netkas->szEncodedData = data->len;
-			
-			PyObject *obj = DecodeNext(netkas);
-			
-			free(netkas);
-			Py_DECREF(memview);
-			return obj;
-		}
-		else
-			goto failure;
-		
-		Py_DECREF(bytes_obj);
+		static char *kwlist[] = {"data", "typed_arrays", NULL};
+		if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|$p:decode", kwlist, &bytes_obj, &typed_arrays))
+			return NULL;
 	}
-	else
-		goto failure;
-	
+
+	if (PyObject_CheckBuffer(bytes_obj))
+	{
+		Py_buffer view;
+		if (PyObject_GetBuffer(bytes_obj, &view, PyBUF_SIMPLE) < 0)
+			return NULL;
+
+		ZiHandle_t handle = {
+			.szEncodedData = view.len,
+			.EncodedData   = view.buf
+		};
+		ZiDecodeStack_t stack = {
+			.keycache    = &DefaultKeyCache,
+			.typedarrays = typed_arrays
+		};
+		ZiThreadStats_t *stats = ThreadStats();
+		uint64_t         start = StatsClock(stats);
+
+		PyObject *obj = DecodeMessage(&handle, &stack);
+		if (obj)
+			CountApiCall(stats, ZI_API_DECODE, start, handle._cursor, 0);
+
+		PyBuffer_Release(&view);
+		return obj;
+	}
+
 	// Decode the bytes object passed into ziproto.decode()
-	Py_RETURN_NOTIMPLEMENTED;
-failure:
-	namestr_obj = PyObject_ASCII(bytes_obj);
-	Py_INCREF(namestr_obj);
+	PyObject *namestr_obj = PyObject_ASCII(bytes_obj);
+	if (!namestr_obj)
+		return NULL;
 	// Now try and get the string'd version of that object
 	PyObject *retval = PyErr_Format(PyExc_OverflowError, "Decode failed. %s", PyUnicode_AsUTF8(namestr_obj));
 	Py_DECREF(namestr_obj);
 	return retval;
 }
+
+PyObject *ziproto_validate(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"buffer", "max_depth", "max_len", NULL};
+	Py_buffer    view;
+	Py_ssize_t   maxdepth = VALIDATE_MAX_DEPTH;
+	Py_ssize_t   maxlen   = PY_SSIZE_T_MAX;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*|$nn:validate", kwlist, &view, &maxdepth, &maxlen))
+		return NULL;
+
+	if (maxdepth < 0 || maxdepth > ZI_MAX_DEPTH || maxlen < 0)
+	{
+		PyBuffer_Release(&view);
+		return PyErr_Format(PyExc_ValueError, "max_depth must be between 0 and %d and max_len must not be negative",
+		                    ZI_MAX_DEPTH);
+	}
+
+	// Anything past max_len is out of reach, so an oversized message shows up as truncated.
+	ZiHandle_t handle = {
+		.szEncodedData = view.len < maxlen ? view.len : maxlen,
+		.EncodedData   = view.buf
+	};
+	ZiDecodeStatus_t status;
+
+	Py_BEGIN_ALLOW_THREADS
+	status = ZiValidateNext(&handle, maxdepth);
+	Py_END_ALLOW_THREADS
+
+	// ZiValidateNext only checked a compressed frame's header, the message
+	// in it is checked as well. Its decompressed size counts against max_len.
+	if (status == ZI_DECODE_OK && handle.EncodedData[0] == ZI_FRAME_COMPRESSED)
+	{
+		uint8_t *raw     = NULL;
+		size_t   rawsize = 0, framesize = 0;
+
+		handle._cursor = 0;
+		if ((status = DecompressFrame(&handle, maxlen, &raw, &rawsize, &framesize)) == ZI_DECODE_OK)
+		{
+			ZiHandle_t rawhandle = {
+				.szEncodedData = rawsize,
+				.EncodedData   = raw
+			};
+
+			Py_BEGIN_ALLOW_THREADS
+			status = ZiValidateNext(&rawhandle, maxdepth);
+			Py_END_ALLOW_THREADS
+
+			if (status == ZI_DECODE_TOO_DEEP)
+				PyErr_SetString(PyExc_ValueError, "Decode failed. Nesting too deep in the compressed frame at offset 0");
+			else if (status != ZI_DECODE_OK || rawhandle._cursor != rawsize)
+				PyErr_SetString(PyExc_ValueError, "Decode failed. Damaged compressed frame at offset 0");
+			status = PyErr_Occurred() ? ZI_DECODE_ERROR : ZI_DECODE_OK;
+			handle._cursor = framesize;
+			PyMem_Free(raw);
+		}
+	}
+
+	if (status == ZI_DECODE_TRUNCATED && handle.szEncodedData < (size_t)view.len)
+		PyErr_Format(PyExc_ValueError, "Decode failed. Message is longer than max_len of %zd bytes", maxlen);
+	else
+		SetDecodeError(status, &handle);
+
+	PyBuffer_Release(&view);
+	return status == ZI_DECODE_OK ? PyLong_FromSize_t(handle._cursor) : NULL;
+}
+
+PyObject *ziproto_set_key_cache_size(PyObject *self, PyObject *arg)
+{
+	Py_ssize_t size = PyLong_AsSsize_t(arg);
+	if (size == -1 && PyErr_Occurred())
+		return NULL;
+
+	if (size < 0)
+	{
+		PyErr_SetString(PyExc_ValueError, "key cache size must not be negative");
+		return NULL;
+	}
+
+	// The shared caches stay disabled on free-threaded builds, see PyInit_ziproto
+#ifndef Py_GIL_DISABLED
+	if (ResizeKeyCache(&DefaultKeyCache, size) < 0)
+		return NULL;
+	if (ResizeEncodedKeyCache(&EncodedKeyCache, size) < 0)
+		return NULL;
+#endif
+
+	Py_RETURN_NONE;
+}
+
+// Free-threaded builds can create python objects on several threads at once,
+// with the GIL the workers would only take turns so decode_all stays serial.
+#ifdef Py_GIL_DISABLED
+# define PARALLEL_DECODE
+#endif
+
+#ifdef PARALLEL_DECODE
+#include <pthread.h>
+
+/**
+ * @struct ZiDecodeTask_t
+ * @brief A contiguous run of messages decoded by one decode_all worker
+ */
+typedef struct
+{
+	/*@{*/
+	const uint8_t *data;      /**< The whole buffer */
+	const size_t  *offsets;   /**< Message start offsets, followed by the end of the last message */
+	size_t         begin;     /**< First message of this task */
+	size_t         end;       /**< One past the last message of this task */
+	PyObject      *result;    /**< List receiving the decoded messages */
+	PyObject      *exc[3];    /**< Exception raised by this task, if any */
+	/*@}*/
+} ZiDecodeTask_t;
+
+static void *DecodeWorker(void *arg)
+{
+	ZiDecodeTask_t  *task   = arg;
+	PyGILState_STATE gstate = PyGILState_Ensure();
+
+	// The default cache is shared state, every worker gets its own.
+	ZiKeyCache_t keycache = {0};
+	if (ResizeKeyCache(&keycache, KEY_CACHE_SIZE) < 0)
+		PyErr_Clear();
+
+	for (size_t i = task->begin; i < task->end; ++i)
+	{
+		ZiHandle_t handle = {
+			.szEncodedData = task->offsets[i + 1],
+			._cursor       = task->offsets[i],
+			.EncodedData   = (uint8_t *)task->data
+		};
+
+		PyObject *obj = DecodeMessage(&handle, &(ZiDecodeStack_t){ .keycache = &keycache });
+		if (!obj)
+		{
+			PyErr_Fetch(&task->exc[0], &task->exc[1], &task->exc[2]);
+			break;
+		}
+		PyList_SET_ITEM(task->result, i, obj);
+	}
+
+	ResizeKeyCache(&keycache, 0);
+	PyGILState_Release(gstate);
+	return NULL;
+}
+
+// Decode the messages split across `threads` workers, balanced by size.
+static int DecodeParallel(const uint8_t *data, const size_t *offsets, size_t count, PyObject *result, size_t threads)
+{
+	ZiDecodeTask_t *tasks   = calloc(threads, sizeof(ZiDecodeTask_t));
+	pthread_t      *workers = calloc(threads, sizeof(pthread_t));
+	bool           *started = calloc(threads, sizeof(bool));
+	if (!tasks || !workers || !started)
+	{
+		free(tasks);
+		free(workers);
+		free(started);
+		PyErr_NoMemory();
+		return -1;
+	}
+
+	size_t total = offsets[count] - offsets[0];
+	size_t next  = 0;
+	for (size_t t = 0; t < threads; ++t)
+	{
+		size_t limit = offsets[0] + total / threads * (t + 1);
+		tasks[t].data    = data;
+		tasks[t].offsets = offsets;
+		tasks[t].result  = result;
+		tasks[t].begin   = next;
+		while (next < count && (t == threads - 1 || offsets[next] < limit))
+			next++;
+		tasks[t].end = next;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	for (size_t t = 0; t < threads; ++t)
+	{
+		if (tasks[t].begin == tasks[t].end)
+			continue;
+		started[t] = pthread_create(&workers[t], NULL, DecodeWorker, &tasks[t]) == 0;
+		// Do the work here if we couldn't get a thread for it
+		if (!started[t])
+			DecodeWorker(&tasks[t]);
+	}
+	for (size_t t = 0; t < threads; ++t)
+	{
+		if (started[t])
+			pthread_join(workers[t], NULL);
+	}
+	Py_END_ALLOW_THREADS
+
+	// Raise the error of the earliest failing message, drop the rest.
+	int ret = 0;
+	for (size_t t = 0; t < threads; ++t)
+	{
+		if (tasks[t].exc[0] && !ret)
+		{
+			PyErr_Restore(tasks[t].exc[0], tasks[t].exc[1], tasks[t].exc[2]);
+			ret = -1;
+		}
+		else if (tasks[t].exc[0])
+		{
+			Py_DECREF(tasks[t].exc[0]);
+			Py_XDECREF(tasks[t].exc[1]);
+			Py_XDECREF(tasks[t].exc[2]);
+		}
+	}
+
+	free(tasks);
+	free(workers);
+	free(started);
+	return ret;
+}
+#endif
+
+PyObject *ziproto_decode_all(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"buffer", "threads", NULL};
+	Py_buffer    view;
+	Py_ssize_t   threads = 1;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*|n:decode_all", kwlist, &view, &threads))
+		return NULL;
+
+	if (threads < 1)
+	{
+		PyBuffer_Release(&view);
+		PyErr_SetString(PyExc_ValueError, "threads must be at least 1");
+		return NULL;
+	}
+
+	ZiHandle_t handle = {
+		.szEncodedData = view.len,
+		.EncodedData   = view.buf
+	};
+	ZiThreadStats_t *stats = ThreadStats();
+	uint64_t         start = StatsClock(stats);
+
+	// Find where every message starts without the GIL, the buffer is pinned by the view.
+	size_t          *offsets = NULL;
+	size_t           count   = 0, alloc = 0;
+	ZiDecodeStatus_t status  = ZI_DECODE_OK;
+	bool             nomem   = false;
+
+	Py_BEGIN_ALLOW_THREADS
+	while (handle._cursor < handle.szEncodedData)
+	{
+		// Keep room for the end offset of the last message
+		if (count + 1 >= alloc)
+		{
+			alloc = alloc ? alloc * 2 : 256;
+			size_t *newoffsets = realloc(offsets, alloc * sizeof(size_t));
+			if (!newoffsets)
+			{
+				nomem = true;
+				break;
+			}
+			offsets = newoffsets;
+		}
+
+		offsets[count] = handle._cursor;
+		if ((status = ZiSkipMessage(&handle)) != ZI_DECODE_OK)
+			break;
+		count++;
+	}
+	if (offsets)
+		offsets[count] = handle._cursor;
+	Py_END_ALLOW_THREADS
+
+	PyObject *result = NULL;
+	if (nomem)
+		PyErr_NoMemory();
+	else if (status != ZI_DECODE_OK)
+		SetDecodeError(status, &handle);
+	else if ((result = PyList_New(count)))
+	{
+#ifdef PARALLEL_DECODE
+		if (threads > 1 && count > 1)
+		{
+			if (DecodeParallel(view.buf, offsets, count, result, (size_t)threads < count ? (size_t)threads : count) < 0)
+				Py_CLEAR(result);
+		}
+		else
+#endif
+		for (size_t i = 0; i < count; ++i)
+		{
+			handle._cursor       = offsets[i];
+			handle.szEncodedData = offsets[i + 1];
+			PyObject *obj = DecodeMessage(&handle, &(ZiDecodeStack_t){ .keycache = &DefaultKeyCache });
+			if (!obj)
+			{
+				Py_CLEAR(result);
+				break;
+			}
+			PyList_SET_ITEM(result, i, obj);
+		}
+	}
+
+	if (result)
+		CountApiCall(stats, ZI_API_DECODE_ALL, start, view.len, 0);
+
+	free(offsets);
+	PyBuffer_Release(&view);
+	return result;
+}
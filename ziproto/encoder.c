@@ -9,223 +9,1271 @@
 // 5. https://stackoverflow.com/a/29732914
 // 6. https://docs.python.org/3/extending/extending.html
 
-#if 0
-void PrintObject(PyObject *obj)
+// Encode a python int as the smallest (U)INT type that fits it.
+static ZiHandle_t *EncodePyLong(ZiHandle_t *handle, PyObject *obj)
 {
-	if (!obj)
+	int       overflow = 0;
+	long long svalue   = PyLong_AsLongLongAndOverflow(obj, &overflow);
+
+	// signed long long will overflow but we have to support numbers
+	// in the range of unsigned long long. Really big negative numbers
+	// are not supported though so error out early.
+	if (overflow == -1)
+		return NULL;
+
+	// Convert our value
+	if (svalue >= 0 || overflow == 1)
 	{
-		printf("Object: <NULL>\n");
-		return;
+		unsigned long long uvalue = PyLong_AsUnsignedLongLong(obj);
+		// We can't handle really big integers.
+		if (uvalue == -1ULL && PyErr_Occurred())
+			return NULL;
+
+		return ZiEncodeTypeSingle(handle, ZI_UINT_TYPE, &uvalue, sizeof(uvalue));
 	}
+	else
+		return ZiEncodeTypeSingle(handle, ZI_INT_TYPE, &svalue, sizeof(svalue));
+}
 
-	PyObject *namestr_obj = PyObject_ASCII(obj);
-	Py_INCREF(namestr_obj);
-	printf("Object: %s\n", PyUnicode_AsUTF8(namestr_obj));
-	Py_DECREF(namestr_obj);
+static ZiHandle_t *EncodePyFloat(ZiHandle_t *handle, PyObject *obj)
+{
+	double value = PyFloat_AsDouble(obj);
+	// If there was an error getting the value for some reason.
+	if (value == -1.0f && PyErr_Occurred())
+		return NULL;
+
+	return ZiEncodeTypeSingle(handle, ZI_FLOAT_TYPE, &value, sizeof(value));
+}
+
+/**
+ * @struct ZiStringTable_t
+ * @brief Strings already written to a message encoded with string references
+ */
+typedef struct
+{
+	/*@{*/
+	ZiHandle_t *handle;  /**< Handle the message is encoded into, encodes nested in it don't use the table */
+	PyObject   *indexes; /**< Dict of every exact str written to its latest number */
+	uint64_t    count;   /**< Number of strings written, the number of the next one */
+	/*@}*/
+} ZiStringTable_t;
+
+// Set while encode(obj, string_refs=True) runs on this thread
+static _Thread_local ZiStringTable_t *CurrentStringTable = NULL;
+
+/**
+ * @brief Looks up whether a str can be written as a reference to an earlier copy.
+ *
+ * @param[in]  table  The strings written so far
+ * @param[in]  obj    The str to encode
+ * @param[in]  text   Its UTF-8 bytes
+ * @param[in]  length Length of text in bytes
+ * @param[out] index  Number of the earlier copy when 1 is returned
+ * @returns 1 if a reference is no longer than the string, 0 if the string has to be
+ *          written in full or -1 with a python exception set.
+ */
+static int FindStringRef(ZiStringTable_t *table, PyObject *obj, const char *text, Py_ssize_t length, uint64_t *index)
+{
+	// Only exact str can be looked up without running python code
+	if (!PyUnicode_CheckExact(obj))
+		return 0;
+
+	PyObject *number = PyDict_GetItemWithError(table->indexes, obj);
+	if (!number)
+		return PyErr_Occurred() ? -1 : 0;
+
+	*index = PyLong_AsUnsignedLongLong(number);
+	return ZiSizeTypeSingle(ZI_STRREF_TYPE, index, sizeof(*index)) <= ZiSizeTypeSingle(ZI_STR_TYPE, text, length);
+}
+
+/**
+ * @brief Numbers a str that was written in full.
+ *
+ * Like the decoder, every string written in full is numbered in order, so
+ * a string written again because a reference wouldn't be shorter gets a new
+ * number as well.
+ *
+ * @returns 0 on success or -1 with a python exception set.
+ */
+static int AddStringRef(ZiStringTable_t *table, PyObject *obj)
+{
+	if (PyUnicode_CheckExact(obj))
+	{
+		PyObject *number = PyLong_FromUnsignedLongLong(table->count);
+		if (!number || PyDict_SetItem(table->indexes, obj, number) < 0)
+		{
+			Py_XDECREF(number);
+			return -1;
+		}
+		Py_DECREF(number);
+	}
+	table->count++;
+	return 0;
+}
+
+/**
+ * @brief Encodes a str as a reference when it was already written to the message.
+ *
+ * @param[in] handle The ZiHandle object to append the encoded string to
+ * @param[in] table  The strings written so far
+ * @param[in] obj    The str to encode
+ * @param[in] text   Its UTF-8 bytes
+ * @param[in] length Length of text in bytes
+ * @returns The handle on success or null on failure (a python exception may be set).
+ */
+static ZiHandle_t *EncodePyStrRef(ZiHandle_t *handle, ZiStringTable_t *table, PyObject *obj, const char *text, Py_ssize_t length)
+{
+	uint64_t index = 0;
+	int      found = FindStringRef(table, obj, text, length, &index);
+	if (found < 0)
+		return NULL;
+	if (found)
+		return ZiEncodeTypeSingle(handle, ZI_STRREF_TYPE, &index, sizeof(index));
+
+	if (!ZiEncodeTypeSingle(handle, ZI_STR_TYPE, text, length) || AddStringRef(table, obj) < 0)
+		return NULL;
+	return handle;
+}
+
+static ZiHandle_t *EncodePyStr(ZiHandle_t *handle, PyObject *obj)
+{
+	Py_ssize_t  length = 0;
+	const char *text   = StrAsUTF8(obj, &length);
+	if (!text)
+		return NULL;
+
+	ZiStringTable_t *table = CurrentStringTable;
+	if (unlikely(table && table->handle == handle))
+		return EncodePyStrRef(handle, table, obj, text, length);
+	return ZiEncodeTypeSingle(handle, ZI_STR_TYPE, text, length);
+}
+
+// Encode bytes or bytearray objects
+static ZiHandle_t *EncodePyBytes(ZiHandle_t *handle, PyObject *obj)
+{
+	if (PyBytes_Check(obj))
+		return ZiEncodeTypeSingle(handle, ZI_BIN_TYPE, PyBytes_AS_STRING(obj), PyBytes_GET_SIZE(obj));
+	else
+		return ZiEncodeTypeSingle(handle, ZI_BIN_TYPE, PyByteArray_AS_STRING(obj), PyByteArray_GET_SIZE(obj));
+}
+
+// Encoded map keys used by every encode, see EncodePyKey
+ZiEncodedKeyCache_t EncodedKeyCache = { NULL, 0 };
+
+/**
+ * @brief Drops every cached key and resizes the cache.
+ *
+ * @param[in] cache The cache to resize
+ * @param[in] size  Number of slots, rounded up to a power of two. 0 disables the cache.
+ * @returns 0 on success or -1 with a python exception set.
+ */
+int ResizeEncodedKeyCache(ZiEncodedKeyCache_t *cache, size_t size)
+{
+	size_t slots = 0;
+	if (size)
+	{
+		for (slots = 1; slots < size; slots <<= 1)
+			;
+	}
+
+	ZiEncodedKey_t *entries = NULL;
+	if (slots)
+	{
+		entries = calloc(slots, sizeof(ZiEncodedKey_t));
+		if (!entries)
+		{
+			PyErr_NoMemory();
+			return -1;
+		}
+	}
+
+	for (size_t i = 0; i < cache->size; ++i)
+		Py_XDECREF(cache->entries[i].key);
+	free(cache->entries);
+
+	cache->entries = entries;
+	cache->size    = slots;
+	return 0;
+}
+
+// The cache slot for key, or null if key can't be cached. Only interned
+// strings are cached, their address identifies their contents for as long
+// as the slot holds a reference to them.
+static inline ZiEncodedKey_t *EncodedKeySlot(PyObject *key)
+{
+	if (!EncodedKeyCache.size || !PyUnicode_CheckExact(key) || !PyUnicode_CHECK_INTERNED(key))
+		return NULL;
+	// Objects are at least 16 byte aligned, the low bits carry nothing
+	return &EncodedKeyCache.entries[((uintptr_t)key >> 4) & (EncodedKeyCache.size - 1)];
+}
+
+/**
+ * @brief Encodes a map key, copying the encoding of interned str keys from the cache.
+ *
+ * @param[in] handle The ZiHandle object to append the encoded key to
+ * @param[in] key    The map key
+ * @returns The handle on success or null on failure (a python exception may be set).
+ */
+static ZiHandle_t *EncodePyKey(ZiHandle_t *handle, PyObject *key)
+{
+	// Keys written with string references have to be numbered like any other string
+	ZiEncodedKey_t *slot = EncodedKeySlot(key);
+	if (!slot || unlikely(CurrentStringTable && CurrentStringTable->handle == handle))
+		return EncodePyType(handle, key);
+
+	if (likely(slot->key == key))
+	{
+		// Count the copied header like ZiEncodeTypeSingle would have
+		if (unlikely(handle->stats))
+			handle->stats->formats[slot->encoded[0]]++;
+		return ZiEncodeRaw(handle, slot->encoded, slot->length);
+	}
+
+	size_t mark = handle->_cursor;
+	if (!EncodePyStr(handle, key))
+		return NULL;
+
+	size_t length = handle->_cursor - mark;
+	if (length <= sizeof(slot->encoded))
+	{
+		memcpy(slot->encoded, ZiGetData(handle) + mark, length);
+		slot->length = length;
+		Py_INCREF(key);
+		Py_XSETREF(slot->key, key);
+	}
+	return handle;
+}
+
+static ZiHandle_t *EncodePyDict(ZiHandle_t *handle, PyObject *obj)
+{
+	Py_ssize_t length = PyDict_Size(obj);
+	if (length == -1)
+		return NULL;
+
+	ZiHandle_t *data = ZiEncodeTypeSingle(handle, ZI_MAP_TYPE, &length, sizeof(length));
+	if (!data)
+		return NULL;
+
+	PyObject *key_obj, *value_obj;
+	Py_ssize_t pos = 0;
+	while (PyDict_Next(obj, &pos, &key_obj, &value_obj))
+	{
+		if (!EncodePyKey(data, key_obj) || !EncodePyType(data, value_obj))
+			return NULL;
+	}
+	return data;
 }
+
+// Item type of a struct module format code for a native byte order buffer, ZI_INVALID_TYPE if unsupported
+static ZiValueType_t NumberFormatType(const char *format, Py_ssize_t itemsize)
+{
+	// A null format means unsigned bytes
+	if (!format)
+		return itemsize == 1 ? ZI_UINT_TYPE : ZI_INVALID_TYPE;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	if (*format == '@' || *format == '=' || *format == '<')
+#else
+	if (*format == '@' || *format == '=' || *format == '>' || *format == '!')
 #endif
+		format++;
+
+	if (!format[0] || format[1])
+		return ZI_INVALID_TYPE;
+
+	bool isint = itemsize == 1 || itemsize == 2 || itemsize == 4 || itemsize == 8;
+	switch (format[0])
+	{
+		case 'b': case 'h': case 'i': case 'l': case 'q': case 'n':
+			return isint ? ZI_INT_TYPE : ZI_INVALID_TYPE;
+		case 'B': case 'H': case 'I': case 'L': case 'Q': case 'N':
+			return isint ? ZI_UINT_TYPE : ZI_INVALID_TYPE;
+		case 'f': case 'd':
+			return itemsize == 4 || itemsize == 8 ? ZI_FLOAT_TYPE : ZI_INVALID_TYPE;
+		case '?':
+			return itemsize == 1 ? ZI_BOOL_TYPE : ZI_INVALID_TYPE;
+		default:
+			return ZI_INVALID_TYPE;
+	}
+}
 
-// A function that releases the python GIL to allow
-// multiple threads to handle decoding.
-ZiHandle_t *EncodeTypeSingleMT(ZiHandle_t *handle, ValueType_t vType, const void *TypeBuffer, size_t szTypeBuffer)
+/**
+ * @brief Gets the buffer of a one dimensional array of numbers, like array.array or a memoryview.
+ *
+ * These are encoded in bulk from their raw items instead of boxing every item
+ * through the iterator. Anything else, including non-contiguous buffers, is
+ * left to the generic iterable path.
+ *
+ * @param[in]  obj   The object to check
+ * @param[out] view  The buffer, which the caller must release if true was returned
+ * @param[out] vType The item type to pass to ZiEncodeNumberArray
+ * @returns true if obj is a numeric array.
+ */
+static bool GetNumberBuffer(PyObject *obj, Py_buffer *view, ZiValueType_t *vType)
 {
-	ZiHandle_t *ret = NULL;
-	Py_BEGIN_ALLOW_THREADS
-	ret = EncodeTypeSingle(handle, vType, TypeBuffer, szTypeBuffer);
-	Py_END_ALLOW_THREADS
+	if (!PyObject_CheckBuffer(obj))
+		return false;
+
+	if (PyObject_GetBuffer(obj, view, PyBUF_FORMAT | PyBUF_C_CONTIGUOUS) < 0)
+	{
+		PyErr_Clear();
+		return false;
+	}
+
+	*vType = NumberFormatType(view->format, view->itemsize);
+	if (view->ndim == 1 && *vType != ZI_INVALID_TYPE)
+		return true;
+
+	PyBuffer_Release(view);
+	return false;
+}
+
+// Encode a numeric buffer as an array, see GetNumberBuffer.
+static ZiHandle_t *EncodePyNumbers(ZiHandle_t *handle, Py_buffer *view, ZiValueType_t vType)
+{
+	ZiHandle_t *data = ZiEncodeNumberArray(handle, vType, view->itemsize, view->buf, view->len / view->itemsize);
+	PyBuffer_Release(view);
+	return data;
+}
+
+// Encode an exact list or tuple straight from its item array.
+static ZiHandle_t *EncodePySequence(ZiHandle_t *handle, PyObject *obj)
+{
+	Py_ssize_t length = PySequence_Fast_GET_SIZE(obj);
+
+	ZiHandle_t *data = ZiEncodeTypeSingle(handle, ZI_ARRAY_TYPE, &length, sizeof(length));
+	if (!data)
+		return NULL;
+
+	for (Py_ssize_t i = 0; i < length; ++i)
+	{
+		// Encoding an item can run python code which may resize a list,
+		// so the item array has to be fetched again every time.
+		if (unlikely(PySequence_Fast_GET_SIZE(obj) != length))
+		{
+			PyErr_SetString(PyExc_RuntimeError, "list changed size during encoding");
+			return NULL;
+		}
+
+		PyObject *item = PySequence_Fast_ITEMS(obj)[i];
+		Py_INCREF(item);
+		ZiHandle_t *ret = EncodePyType(data, item);
+		Py_DECREF(item);
+		if (!ret)
+			return NULL;
+	}
+	return data;
+}
+
+// Encode any iterable with a length as an array.
+static ZiHandle_t *EncodePyIterable(ZiHandle_t *handle, PyObject *obj)
+{
+	// It's an array-like object (or so we hope)
+	Py_ssize_t length = PyObject_Length(obj);
+	if (length == -1)
+		return NULL;
+
+	// We start an array
+	ZiHandle_t *data = ZiEncodeTypeSingle(handle, ZI_ARRAY_TYPE, &length, sizeof(length));
+	// Array too big!
+	if (!data)
+		return NULL;
+
+	PyObject *iter = PyObject_GetIter(obj);
+	if (!iter)
+		return NULL;
+	if (PyCallIter_Check(iter))
+	{
+		Py_DECREF(iter);
+		return NULL;
+	}
+
+	PyObject *item = NULL;
+	while ((item = PyIter_Next(iter)))
+	{
+		// Call recursively
+		ZiHandle_t *nextdata = EncodePyType(data, item);
+		Py_DECREF(item);
+		if (!nextdata)
+		{
+			Py_DECREF(iter);
+			return NULL;
+		}
+	}
+	Py_DECREF(iter);
+	if (PyErr_Occurred())
+		return NULL;
+
+	return data;
+}
+
+// Encode a container with encode, raising RecursionError instead of running
+// out of C stack on deeply nested or self-referencing objects.
+static ZiHandle_t *EncodePyNested(ZiHandle_t *handle, PyObject *obj, ZiHandle_t *(*encode)(ZiHandle_t *, PyObject *))
+{
+	if (Py_EnterRecursiveCall(" while encoding a ZiProto object"))
+		return NULL;
+	ZiHandle_t *ret = encode(handle, obj);
+	Py_LeaveRecursiveCall();
 	return ret;
 }
 
+/**
+ * @brief Encodes a python object (and everything it contains) to ZiProto bytes.
+ *
+ * Objects of the exact builtin types are dispatched on their type first, anything
+ * else (including subclasses of the builtins) goes through the generic checks.
+ *
+ * The handle must already be allocated. It is never freed here, on failure the
+ * handle is left valid but holds a partially encoded object; callers that want
+ * to keep using it should rewind szEncodedData and _cursor to where they started.
+ *
+ * @param[in] handle The ZiHandle object to append the encoded object to
+ * @param[in] obj    The python object to encode
+ * @returns The handle on success or null on failure (a python exception may be set).
+ */
 ZiHandle_t *EncodePyType(ZiHandle_t *handle, PyObject *obj)
 {
+	PyTypeObject *type = Py_TYPE(obj);
+	Py_buffer     view;
+	ZiValueType_t vType;
+
+	// Most common types first
+	if (type == &PyUnicode_Type)
+		return EncodePyStr(handle, obj);
+	else if (type == &PyLong_Type)
+		return EncodePyLong(handle, obj);
+	else if (type == &PyDict_Type)
+		return EncodePyNested(handle, obj, EncodePyDict);
+	else if (type == &PyList_Type || type == &PyTuple_Type)
+		return EncodePyNested(handle, obj, EncodePySequence);
+	else if (type == &PyFloat_Type)
+		return EncodePyFloat(handle, obj);
+	else if (type == &PyBytes_Type || type == &PyByteArray_Type)
+		return EncodePyBytes(handle, obj);
 	// Encode "None" from Python
 	// https://stackoverflow.com/a/29732914
-	if (obj == Py_None)
-		return EncodeTypeSingle(handle, NIL_TYPE, NULL, 0);
-	else if (PyBool_Check(obj))
+	else if (obj == Py_None)
+		return ZiEncodeTypeSingle(handle, ZI_NIL_TYPE, NULL, 0);
+	else if (obj == Py_True || obj == Py_False)
 	{
-		bool istrue = PyObject_IsTrue(obj);
-		if (istrue)
-			return EncodeTypeSingle(handle, BOOL_TYPE, &istrue, sizeof(bool));
-		else
-			return EncodeTypeSingle(handle, BOOL_TYPE, &istrue, sizeof(bool));
+		bool istrue = obj == Py_True;
+		return ZiEncodeTypeSingle(handle, ZI_BOOL_TYPE, &istrue, sizeof(bool));
 	}
+
+	// Subclasses of the builtin types
+	if (PyLong_Check(obj))
+		return EncodePyLong(handle, obj);
+	else if (PyFloat_Check(obj))
+		return EncodePyFloat(handle, obj);
+	else if (PyBytes_Check(obj) || PyByteArray_Check(obj))
+		return EncodePyBytes(handle, obj);
+	else if (PyUnicode_Check(obj))
+		return EncodePyStr(handle, obj);
+	else if (PyDict_Check(obj))
+		return EncodePyNested(handle, obj, EncodePyDict);
+	else if (GetNumberBuffer(obj, &view, &vType))
+		return EncodePyNumbers(handle, &view, vType);
+	else if (PyObject_HasAttrString(obj, "__iter__"))
+		return EncodePyNested(handle, obj, EncodePyIterable);
+	return NULL;
+}
+
+// Size an exact list or tuple straight from its item array.
+static int SizePySequence(PyObject *obj, size_t *size)
+{
+	Py_ssize_t length = PySequence_Fast_GET_SIZE(obj);
+	size_t     sz     = ZiSizeTypeSingle(ZI_ARRAY_TYPE, &length, sizeof(length));
+	if (!sz)
+		return -1;
+
+	for (Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE(obj); ++i)
+	{
+		PyObject *item = PySequence_Fast_ITEMS(obj)[i];
+		Py_INCREF(item);
+		int ret = SizePyType(item, size);
+		Py_DECREF(item);
+		if (ret < 0)
+			return -1;
+	}
+
+	*size += sz;
+	return 0;
+}
+
+// Size a dict, using the encoded key cache where EncodePyKey would.
+static int SizePyDict(PyObject *obj, size_t *size)
+{
+	Py_ssize_t length = PyDict_Size(obj);
+	if (length == -1)
+		return -1;
+
+	size_t sz = ZiSizeTypeSingle(ZI_MAP_TYPE, &length, sizeof(length));
+	if (!sz)
+		return -1;
+
+	PyObject *key_obj, *value_obj;
+	Py_ssize_t pos = 0;
+	while (PyDict_Next(obj, &pos, &key_obj, &value_obj))
+	{
+		ZiEncodedKey_t *slot = EncodedKeySlot(key_obj);
+		if (slot && slot->key == key_obj)
+			*size += slot->length;
+		else if (SizePyType(key_obj, size) < 0)
+			return -1;
+
+		if (SizePyType(value_obj, size) < 0)
+			return -1;
+	}
+
+	*size += sz;
+	return 0;
+}
+
+// Size any iterable with a length as an array.
+static int SizePyIterable(PyObject *obj, size_t *size)
+{
+	Py_ssize_t length = PyObject_Length(obj);
+	if (length == -1)
+		return -1;
+
+	size_t sz = ZiSizeTypeSingle(ZI_ARRAY_TYPE, &length, sizeof(length));
+	if (!sz)
+		return -1;
+
+	PyObject *iter = PyObject_GetIter(obj);
+	if (!iter)
+		return -1;
+
+	PyObject *item = NULL;
+	while ((item = PyIter_Next(iter)))
+	{
+		int ret = SizePyType(item, size);
+		Py_DECREF(item);
+		if (ret < 0)
+		{
+			Py_DECREF(iter);
+			return -1;
+		}
+	}
+	Py_DECREF(iter);
+	if (PyErr_Occurred())
+		return -1;
+
+	*size += sz;
+	return 0;
+}
+
+// Size a container with sizer, the SizePyType counterpart of EncodePyNested.
+static int SizePyNested(PyObject *obj, size_t *size, int (*sizer)(PyObject *, size_t *))
+{
+	if (Py_EnterRecursiveCall(" while encoding a ZiProto object"))
+		return -1;
+	int ret = sizer(obj, size);
+	Py_LeaveRecursiveCall();
+	return ret;
+}
+
+/**
+ * @brief Computes the exact number of bytes EncodePyType will write for a python object.
+ *
+ * This walks the object graph the same way EncodePyType does and has to stay in
+ * sync with it, so that ziproto.encode can allocate its output exactly once.
+ *
+ * @param[in]  obj  The python object to size
+ * @param[out] size The encoded size is added to this value
+ * @returns 0 on success or -1 on failure (a python exception may be set).
+ */
+int SizePyType(PyObject *obj, size_t *size)
+{
+	PyTypeObject *type = Py_TYPE(obj);
+	size_t        sz   = 0;
+	Py_buffer     view;
+	ZiValueType_t vType;
+
+	if (type == &PyList_Type || type == &PyTuple_Type)
+		return SizePyNested(obj, size, SizePySequence);
+	else if (obj == Py_None)
+		sz = ZiSizeTypeSingle(ZI_NIL_TYPE, NULL, 0);
+	else if (PyBool_Check(obj))
+		sz = ZiSizeTypeSingle(ZI_BOOL_TYPE, NULL, 0);
 	else if (PyLong_Check(obj))
 	{
 		int       overflow = 0;
 		long long svalue   = PyLong_AsLongLongAndOverflow(obj, &overflow);
 
-		// signed long long will overflow but we have to support numbers
-		// in the range of unsigned long long. Really big negative numbers
-		// are not supported though so error out early.
 		if (overflow == -1)
-			return NULL;
+			return -1;
 
-		// Convert our value
 		if (svalue >= 0 || overflow == 1)
 		{
 			unsigned long long uvalue = PyLong_AsUnsignedLongLong(obj);
-			// We can't handle really big integers.
 			if (uvalue == -1ULL && PyErr_Occurred())
-				return NULL;
-
-			return EncodeTypeSingle(handle, UINT_TYPE, &uvalue, sizeof(uvalue));
+				return -1;
+			sz = ZiSizeTypeSingle(ZI_UINT_TYPE, &uvalue, sizeof(uvalue));
 		}
 		else
-			return EncodeTypeSingle(handle, INT_TYPE, &svalue, sizeof(svalue));
+			sz = ZiSizeTypeSingle(ZI_INT_TYPE, &svalue, sizeof(svalue));
 	}
 	else if (PyFloat_Check(obj))
 	{
 		double value = PyFloat_AsDouble(obj);
-		// If there was an error getting the value for some reason.
 		if (value == -1.0f && PyErr_Occurred())
-			return NULL;
-
-		return EncodeTypeSingle(handle, FLOAT_TYPE, &value, sizeof(value));
+			return -1;
+		sz = ZiSizeTypeSingle(ZI_FLOAT_TYPE, &value, sizeof(value));
 	}
 	else if (PyBytes_Check(obj) || PyByteArray_Check(obj))
 	{
-		Py_INCREF(obj);
-		const char *buffer = 0;
+		Py_ssize_t length = PyBytes_Check(obj) ? PyBytes_GET_SIZE(obj) : PyByteArray_GET_SIZE(obj);
+		sz = ZiSizeTypeSingle(ZI_BIN_TYPE, length ? "" : NULL, length);
+	}
+	else if (PyUnicode_Check(obj))
+	{
 		Py_ssize_t  length = 0;
-		// TODO: Use PyObject_GetBuffer instead?
-		if (PyBytes_Check(obj))
-		{
-			buffer = PyBytes_AsString(obj);
-			length = PyBytes_Size(obj);
-		}
-		else
+		const char *text   = StrAsUTF8(obj, &length);
+		if (!text)
+			return -1;
+		sz = ZiSizeTypeSingle(ZI_STR_TYPE, text, length);
+	}
+	else if (PyDict_Check(obj))
+		return SizePyNested(obj, size, SizePyDict);
+	else if (GetNumberBuffer(obj, &view, &vType))
+	{
+		sz = ZiSizeNumberArray(vType, view.itemsize, view.buf, view.len / view.itemsize);
+		PyBuffer_Release(&view);
+	}
+	else if (PyObject_HasAttrString(obj, "__iter__"))
+		return SizePyNested(obj, size, SizePyIterable);
+
+	if (!sz)
+		return -1;
+
+	*size += sz;
+	return 0;
+}
+
+// Raise the generic encode error unless something more specific was already raised.
+static PyObject *EncodeFailed(PyObject *obj)
+{
+	if (PyErr_Occurred())
+		return NULL;
+
+	PyObject *namestr_obj = PyObject_ASCII(obj);
+	if (!namestr_obj)
+		return NULL;
+	// Now try and get the string'd version of that object
+	PyObject *retval = PyErr_Format(PyExc_OverflowError, "Encode failed. %s", PyUnicode_AsUTF8(namestr_obj));
+	Py_DECREF(namestr_obj);
+	return retval;
+}
+
+// Encode obj into a caller owned buffer that SizePyType said is exactly size bytes.
+static int EncodeFixed(PyObject *obj, uint8_t *buffer, size_t size)
+{
+	ZiHandle_t handle = {
+		._allocsz    = size,
+		.EncodedData = buffer,
+		._fixed      = true,
+		.stats       = EncoderStats()
+	};
+
+	if (unlikely(!EncodePyType(&handle, obj) || handle.szEncodedData != size))
+	{
+		// The only way to get here without an error is for a container to
+		// change size between the two passes.
+		if (!PyErr_Occurred())
+			PyErr_SetString(PyExc_RuntimeError, "Object changed size during encoding");
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @struct ZiNode_t
+ * @brief One value captured from the python object graph for encoding without the GIL
+ */
+typedef struct
+{
+	/*@{*/
+	ZiValueType_t vType;        /**< Type passed to ZiEncodeTypeSingle */
+	const void   *TypeBuffer;   /**< Borrowed STR/BIN data, null to use value */
+	size_t        szTypeBuffer; /**< Size of the data */
+	union
+	{
+		uint64_t   u;
+		int64_t    i;
+		double     f;
+		bool       b;
+		Py_ssize_t length;
+	} value;                    /**< Scalar value or array/map length */
+	ZiValueType_t itemType;     /**< Item type of a number array */
+	size_t        itemsize;     /**< Item size of a number array, 0 for every other node */
+	/*@}*/
+} ZiNode_t;
+
+/**
+ * @struct ZiNodeList_t
+ * @brief Flat, pre-order list of captured values plus the objects keeping their data alive
+ */
+typedef struct
+{
+	/*@{*/
+	ZiNode_t        *nodes;      /**< Captured values in encoding order */
+	size_t           count;      /**< Number of nodes */
+	size_t           _alloc;     /**< Allocated number of nodes */
+	PyObject       **refs;       /**< Strong references to objects nodes borrow data from */
+	size_t           nrefs;      /**< Number of references */
+	size_t           _allocrefs; /**< Allocated number of references */
+	size_t           size;       /**< Total encoded size of all nodes */
+	ZiStringTable_t *strings;    /**< Strings captured so far when encoding with string references, otherwise null */
+	/*@}*/
+} ZiNodeList_t;
+
+static void FreeNodeList(ZiNodeList_t *list)
+{
+	for (size_t i = 0; i < list->nrefs; ++i)
+		Py_DECREF(list->refs[i]);
+	free(list->nodes);
+	free(list->refs);
+	memset(list, 0, sizeof(ZiNodeList_t));
+}
+
+// Append a node, borrowing TypeBuffer from owner (if any) until the list is freed.
+static ZiNode_t *AddNode(ZiNodeList_t *list, ZiValueType_t vType, PyObject *owner)
+{
+	if (unlikely(list->count == list->_alloc))
+	{
+		size_t    newalloc = list->_alloc ? list->_alloc * 2 : 64;
+		ZiNode_t *nodes    = realloc(list->nodes, newalloc * sizeof(ZiNode_t));
+		if (!nodes)
 		{
-			buffer = PyByteArray_AsString(obj);
-			length = PyByteArray_Size(obj);
+			PyErr_NoMemory();
+			return NULL;
 		}
+		list->nodes  = nodes;
+		list->_alloc = newalloc;
+	}
 
-		if (PyErr_Occurred())
+	if (owner)
+	{
+		if (unlikely(list->nrefs == list->_allocrefs))
 		{
-			Py_DECREF(obj);
-			return NULL;
+			size_t     newalloc = list->_allocrefs ? list->_allocrefs * 2 : 64;
+			PyObject **refs     = realloc(list->refs, newalloc * sizeof(PyObject *));
+			if (!refs)
+			{
+				PyErr_NoMemory();
+				return NULL;
+			}
+			list->refs       = refs;
+			list->_allocrefs = newalloc;
 		}
-		ZiHandle_t *ret = EncodeTypeSingle(handle, BIN_TYPE, buffer, length);
-		Py_DECREF(obj);
-		if (!ret)
+
+		Py_INCREF(owner);
+		list->refs[list->nrefs++] = owner;
+	}
+
+	ZiNode_t *node = &list->nodes[list->count++];
+	memset(node, 0, sizeof(ZiNode_t));
+	node->vType = vType;
+	return node;
+}
+
+// Account for the encoded size of the node that was just added.
+static int SizeNode(ZiNodeList_t *list, ZiNode_t *node)
+{
+	size_t sz;
+	if (node->itemsize)
+		sz = ZiSizeNumberArray(node->itemType, node->itemsize, node->TypeBuffer, node->value.length);
+	else
+		sz = ZiSizeTypeSingle(node->vType, node->TypeBuffer ? node->TypeBuffer : &node->value, node->szTypeBuffer);
+	if (!sz)
+		return -1;
+	list->size += sz;
+	return 0;
+}
+
+static int CapturePyType(ZiNodeList_t *list, PyObject *obj);
+
+// Capture a dict, see CapturePyType.
+static int CapturePyDict(ZiNodeList_t *list, PyObject *obj)
+{
+	// Capturing an entry can run python code that changes the dict, so
+	// the header is filled in with the number of entries actually
+	// captured and each entry is held on to while it is captured.
+	size_t index = list->count;
+	if (!AddNode(list, ZI_MAP_TYPE, NULL))
+		return -1;
+
+	PyObject  *key_obj, *value_obj;
+	Py_ssize_t pos = 0, length = 0;
+	while (PyDict_Next(obj, &pos, &key_obj, &value_obj))
+	{
+		Py_INCREF(key_obj);
+		Py_INCREF(value_obj);
+		int ret = CapturePyType(list, key_obj) < 0 || CapturePyType(list, value_obj) < 0 ? -1 : 0;
+		Py_DECREF(key_obj);
+		Py_DECREF(value_obj);
+		if (ret < 0)
+			return -1;
+		length++;
+	}
+
+	ZiNode_t *node = &list->nodes[index];
+	node->value.length = length;
+	node->szTypeBuffer = sizeof(Py_ssize_t);
+	return SizeNode(list, node);
+}
+
+// Capture a list, tuple or iterable with a length as an array, see CapturePyType.
+static int CapturePyIterable(ZiNodeList_t *list, PyObject *obj)
+{
+	PyTypeObject *type = Py_TYPE(obj);
+
+	// Like EncodePyIterable only iterables with a length are accepted,
+	// they are materialized while list and tuple are used as they are.
+	if (type != &PyList_Type && type != &PyTuple_Type && PyObject_Length(obj) == -1)
+		return -1;
+
+	PyObject *seq = PySequence_Fast(obj, "");
+	if (!seq)
+		return -1;
+
+	// The sequence may be modified while capturing, keep the header in
+	// sync with the number of items actually captured.
+	size_t index = list->count;
+	if (!AddNode(list, ZI_ARRAY_TYPE, NULL))
+	{
+		Py_DECREF(seq);
+		return -1;
+	}
+
+	Py_ssize_t i = 0;
+	for (; i < PySequence_Fast_GET_SIZE(seq); ++i)
+	{
+		PyObject *item = PySequence_Fast_ITEMS(seq)[i];
+		Py_INCREF(item);
+		int ret = CapturePyType(list, item);
+		Py_DECREF(item);
+		if (ret < 0)
 		{
-			if (handle)
-				FreeZiHandle(handle);
-			return NULL;
+			Py_DECREF(seq);
+			return -1;
 		}
-		return ret;
 	}
-	else if (PyUnicode_Check(obj))
+	Py_DECREF(seq);
+
+	ZiNode_t *node = &list->nodes[index];
+	node->value.length = i;
+	node->szTypeBuffer = sizeof(Py_ssize_t);
+	return SizeNode(list, node);
+}
+
+// Capture a container with capture, the CapturePyType counterpart of EncodePyNested.
+static int CapturePyNested(ZiNodeList_t *list, PyObject *obj, int (*capture)(ZiNodeList_t *, PyObject *))
+{
+	if (Py_EnterRecursiveCall(" while encoding a ZiProto object"))
+		return -1;
+	int ret = capture(list, obj);
+	Py_LeaveRecursiveCall();
+	return ret;
+}
+
+/**
+ * @brief Flattens a python object into a list of nodes that can be encoded without the GIL.
+ *
+ * This makes the same choices as EncodePyType. Strings and bytes are not copied,
+ * the nodes borrow their data and the list keeps the owning objects alive.
+ *
+ * @param[in] list The list to append to
+ * @param[in] obj  The python object to capture
+ * @returns 0 on success or -1 on failure (a python exception may be set).
+ */
+static int CapturePyType(ZiNodeList_t *list, PyObject *obj)
+{
+	PyTypeObject *type = Py_TYPE(obj);
+	ZiNode_t     *node = NULL;
+	Py_buffer     view;
+	ZiValueType_t vType;
+
+	if (PyUnicode_Check(obj))
 	{
 		Py_ssize_t  length = 0;
-		const char *text   = PyUnicode_AsUTF8AndSize(obj, &length);
-		if (text)
-			return EncodeTypeSingle(handle, STR_TYPE, text, length);
+		const char *text   = StrAsUTF8(obj, &length);
+		uint64_t    index  = 0;
+		int         found  = 0;
+		if (!text || (list->strings && (found = FindStringRef(list->strings, obj, text, length, &index)) < 0))
+			return -1;
+
+		if (found)
+		{
+			if (!(node = AddNode(list, ZI_STRREF_TYPE, NULL)))
+				return -1;
+			node->value.u      = index;
+			node->szTypeBuffer = sizeof(uint64_t);
+		}
 		else
-			return NULL;
+		{
+			if (!(node = AddNode(list, ZI_STR_TYPE, obj)) || (list->strings && AddStringRef(list->strings, obj) < 0))
+				return -1;
+			node->TypeBuffer   = text;
+			node->szTypeBuffer = length;
+		}
 	}
-	else if (PyDict_Check(obj))
+	else if (obj == Py_None)
 	{
-		Py_ssize_t length = PyDict_Size(obj);
-		if (length == -1)
-			return NULL;
+		if (!(node = AddNode(list, ZI_NIL_TYPE, NULL)))
+			return -1;
+	}
+	else if (obj == Py_True || obj == Py_False)
+	{
+		if (!(node = AddNode(list, ZI_BOOL_TYPE, NULL)))
+			return -1;
+		node->value.b      = obj == Py_True;
+		node->szTypeBuffer = sizeof(bool);
+	}
+	else if (PyLong_Check(obj))
+	{
+		int       overflow = 0;
+		long long svalue   = PyLong_AsLongLongAndOverflow(obj, &overflow);
+
+		if (overflow == -1)
+			return -1;
 
-		ZiHandle_t *data = EncodeTypeSingle(handle, MAP_TYPE, &length, sizeof(length));
-		if (!data)
+		if (svalue >= 0 || overflow == 1)
 		{
-			if (handle)
-				FreeZiHandle(handle);
-			return NULL;
+			unsigned long long uvalue = PyLong_AsUnsignedLongLong(obj);
+			if ((uvalue == -1ULL && PyErr_Occurred()) || !(node = AddNode(list, ZI_UINT_TYPE, NULL)))
+				return -1;
+			node->value.u = uvalue;
 		}
-
-		PyObject *key_obj, *value_obj;
-		Py_ssize_t pos = 0;
-		while (PyDict_Next(obj, &pos, &key_obj, &value_obj))
+		else
 		{
-			ZiHandle_t *newhand = EncodePyType(data, key_obj);
-			if (!newhand)
-			{
-				if (handle)
-					FreeZiHandle(handle);
-				return NULL;
-			}
-			
-			ZiHandle_t *newhand2 = EncodePyType(newhand, value_obj);
-			if (!newhand2)
-			{
-				if (newhand)
-					FreeZiHandle(newhand);
-				return NULL;
-			}
-			data = newhand2;
+			if (!(node = AddNode(list, ZI_INT_TYPE, NULL)))
+				return -1;
+			node->value.i = svalue;
 		}
-		return data;
+		node->szTypeBuffer = sizeof(uint64_t);
 	}
-	else if (PyObject_HasAttrString(obj, "__iter__"))
+	else if (PyFloat_Check(obj))
 	{
-		// It's an array-like object (or so we hope)
-		Py_ssize_t length = PyObject_Length(obj);
-		if (length == -1)
-			return NULL;
-
-		// We start an array
-		ZiHandle_t *data = EncodeTypeSingle(handle, ARRAY_TYPE, &length, sizeof(length));
-		// Array too big!
-		if (!data)
+		double value = PyFloat_AsDouble(obj);
+		if ((value == -1.0f && PyErr_Occurred()) || !(node = AddNode(list, ZI_FLOAT_TYPE, NULL)))
+			return -1;
+		node->value.f      = value;
+		node->szTypeBuffer = sizeof(double);
+	}
+	else if (PyBytes_Check(obj))
+	{
+		if (!(node = AddNode(list, ZI_BIN_TYPE, obj)))
+			return -1;
+		node->TypeBuffer   = PyBytes_AS_STRING(obj);
+		node->szTypeBuffer = PyBytes_GET_SIZE(obj);
+	}
+	else if (PyByteArray_Check(obj))
+	{
+		// bytearrays can be resized by other threads, encode a snapshot instead.
+		PyObject *copy = PyBytes_FromStringAndSize(PyByteArray_AS_STRING(obj), PyByteArray_GET_SIZE(obj));
+		if (!copy)
+			return -1;
+		int ret = CapturePyType(list, copy);
+		Py_DECREF(copy);
+		return ret;
+	}
+	else if (PyDict_Check(obj))
+		return CapturePyNested(list, obj, CapturePyDict);
+	else if (GetNumberBuffer(obj, &view, &vType))
+	{
+		// The exporter may change its items once the GIL is released, encode a snapshot instead.
+		PyObject *copy = PyBytes_FromStringAndSize(view.buf, view.len);
+		if (!copy || !(node = AddNode(list, ZI_ARRAY_TYPE, copy)))
 		{
-			if (handle)
-				FreeZiHandle(handle);
-			return NULL;
+			Py_XDECREF(copy);
+			PyBuffer_Release(&view);
+			return -1;
 		}
+		node->TypeBuffer   = PyBytes_AS_STRING(copy);
+		node->value.length = view.len / view.itemsize;
+		node->itemType     = vType;
+		node->itemsize     = view.itemsize;
+		Py_DECREF(copy);
+		PyBuffer_Release(&view);
+	}
+	else if (type == &PyList_Type || type == &PyTuple_Type || PyObject_HasAttrString(obj, "__iter__"))
+		return CapturePyNested(list, obj, CapturePyIterable);
+	else
+		return -1;
+
+	return SizeNode(list, node);
+}
 
-		PyObject *iter = PyObject_GetIter(obj);
-		if (!iter || PyCallIter_Check(iter))
+/**
+ * @brief Encodes a python object, doing the byte level work with the GIL released.
+ *
+ * The object graph is walked once with the GIL held to capture every value into
+ * a flat node list. The nodes are then serialized into the result without the
+ * GIL so other python threads can run while large objects are encoded.
+ *
+ * With string references the strings are numbered while capturing, so a
+ * repeated one is captured as a reference and the sizes stay exact.
+ *
+ * @param obj         Object to encode
+ * @param string_refs Whether to encode a message with string references, see EncodeWithStringRefs
+ * @returns The encoded bytes or NULL with a python exception set.
+ */
+static PyObject *EncodeWithoutGIL(PyObject *obj, bool string_refs)
+{
+	ZiNodeList_t    list  = {0};
+	ZiStringTable_t table = {0};
+
+	if (string_refs)
+	{
+		if (unlikely(!(table.indexes = PyDict_New())))
 			return NULL;
-			//return PyErr_Format(PyExc_RuntimeError, "Was given an object without an __iter__ method (this shoudn't happen????)");
+		list.strings = &table;
+		list.size    = 1;
+	}
+
+	int captured = CapturePyType(&list, obj);
+	Py_XDECREF(table.indexes);
+	if (unlikely(captured < 0))
+	{
+		FreeNodeList(&list);
+		return EncodeFailed(obj);
+	}
 
-		PyObject *item = NULL;
-		while ((item = PyIter_Next(iter)))
+	PyObject *ret = PyBytes_FromStringAndSize(NULL, list.size);
+	if (unlikely(!ret))
+	{
+		FreeNodeList(&list);
+		return NULL;
+	}
+
+	ZiHandle_t handle = {
+		._allocsz    = list.size,
+		.EncodedData = (uint8_t *)PyBytes_AS_STRING(ret),
+		._fixed      = true,
+		.stats       = EncoderStats()
+	};
+	uint8_t marker = ZI_FRAME_STRING_REFS;
+	bool    failed = false;
+
+	Py_BEGIN_ALLOW_THREADS
+	if (string_refs)
+		failed = !ZiEncodeRaw(&handle, &marker, sizeof(marker));
+	for (size_t i = 0; !failed && i < list.count; ++i)
+	{
+		ZiNode_t   *node = &list.nodes[i];
+		ZiHandle_t *ret;
+		if (node->itemsize)
+			ret = ZiEncodeNumberArray(&handle, node->itemType, node->itemsize, node->TypeBuffer, node->value.length);
+		else
+			ret = ZiEncodeTypeSingle(&handle, node->vType, node->TypeBuffer ? node->TypeBuffer : &node->value, node->szTypeBuffer);
+		if (unlikely(!ret))
 		{
-			// Call recursively
-			ZiHandle_t *nextdata = EncodePyType(data, item);
-			if (!nextdata || PyErr_Occurred())
-			{
-				if (data)
-					FreeZiHandle(data);
-				Py_DECREF(item);
-				Py_DECREF(iter);
-				return NULL;
-			}
-			else
-				data = nextdata;
-			Py_DECREF(item);
+			failed = true;
+			break;
 		}
-		Py_DECREF(iter);
-		
-		return data;
 	}
-	return NULL;
+	Py_END_ALLOW_THREADS
+
+	failed = failed || handle.szEncodedData != list.size;
+	FreeNodeList(&list);
+
+	if (unlikely(failed))
+	{
+		Py_DECREF(ret);
+		PyErr_SetString(PyExc_RuntimeError, "Object changed size during encoding");
+		return NULL;
+	}
+
+	return ret;
 }
 
-PyObject *ziproto_encode(PyObject *self, PyObject *obj)
+/**
+ * @brief Encodes obj into a message with string references.
+ *
+ * The message starts with ZI_FRAME_STRING_REFS and every string repeated in
+ * it is written as the number of its first occurrence. How many strings are
+ * repeated isn't known up front, so the message is encoded into a growing
+ * buffer instead of being sized first.
+ *
+ * @param obj Object to encode
+ * @returns The encoded bytes or NULL with a python exception set.
+ */
+static PyObject *EncodeWithStringRefs(PyObject *obj)
 {
-	ZiHandle_t *data = EncodePyType(NULL, obj);
-	if (unlikely(!data))
+	ZiHandle_t      handle = { .stats = EncoderStats() };
+	ZiStringTable_t table  = { .handle = &handle, .indexes = PyDict_New() };
+	if (unlikely(!table.indexes))
+		return NULL;
+
+	// Nested encodes of other handles, from python code run by iterables, leave the table alone
+	ZiStringTable_t *outer = CurrentStringTable;
+	CurrentStringTable     = &table;
+
+	uint8_t   marker = ZI_FRAME_STRING_REFS;
+	PyObject *ret    = NULL;
+	if (ZiEncodeRaw(&handle, &marker, sizeof(marker)) && EncodePyType(&handle, obj))
+		ret = PyBytes_FromStringAndSize((const char *)handle.EncodedData, handle.szEncodedData);
+	else
+		EncodeFailed(obj);
+
+	CurrentStringTable = outer;
+	free(handle.EncodedData);
+	Py_DECREF(table.indexes);
+	return ret;
+}
+
+/**
+ * @brief Replaces encoded data with a compressed frame when that makes it smaller.
+ *
+ * Data below COMPRESS_THRESHOLD bytes is returned as is, the frame header
+ * and the time spent compressing don't pay off for small messages.
+ *
+ * @param encoded The encoded bytes, the reference is stolen
+ * @returns The frame, encoded itself or NULL with a python exception set.
+ */
+static PyObject *CompressEncoded(PyObject *encoded)
+{
+	size_t size = PyBytes_GET_SIZE(encoded);
+	if (size < COMPRESS_THRESHOLD)
+		return encoded;
+
+	// ZiCompressFrame gives up once the frame would be no smaller than the data
+	PyObject *frame = PyBytes_FromStringAndSize(NULL, size);
+	if (unlikely(!frame))
+	{
+		Py_DECREF(encoded);
+		return NULL;
+	}
+
+	size_t szframe;
+	Py_BEGIN_ALLOW_THREADS
+	szframe = ZiCompressFrame((const uint8_t *)PyBytes_AS_STRING(encoded), size, (uint8_t *)PyBytes_AS_STRING(frame), size);
+	Py_END_ALLOW_THREADS
+
+	if (!szframe)
+	{
+		Py_DECREF(frame);
+		return encoded;
+	}
+
+	Py_DECREF(encoded);
+	if (_PyBytes_Resize(&frame, szframe) < 0)
+		return NULL;
+	return frame;
+}
+
+PyObject *ziproto_encode(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	PyObject *obj         = NULL;
+	int       release_gil = 0;
+	int       compress    = 0;
+	int       string_refs = 0;
+
+	// Skip argument parsing for the common encode(obj) call.
+	if (likely(!kwds && PyTuple_GET_SIZE(args) == 1))
+		obj = PyTuple_GET_ITEM(args, 0);
+	else
+	{
+		static char *kwlist[] = {"obj", "release_gil", "compress", "string_refs", NULL};
+		if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|$ppp:encode", kwlist, &obj, &release_gil, &compress, &string_refs))
+			return NULL;
+	}
+
+	ZiThreadStats_t *stats = ThreadStats();
+	uint64_t         start = StatsClock(stats);
+
+	PyObject *ret;
+	if (release_gil)
+		ret = EncodeWithoutGIL(obj, string_refs);
+	else
+		ret = string_refs ? EncodeWithStringRefs(obj) : EncodeToBytes(obj);
+	if (compress && ret)
+		ret = CompressEncoded(ret);
+	if (ret)
+		CountApiCall(stats, ZI_API_ENCODE, start, 0, PyBytes_GET_SIZE(ret));
+	return ret;
+}
+
+/**
+ * @brief Encodes obj into a new bytes object.
+ *
+ * Everything is sized first so the output is allocated exactly once
+ * and encoded straight into the bytes object that is returned.
+ *
+ * @param obj Object to encode
+ * @returns The encoded bytes or NULL with a python exception set.
+ */
+PyObject *EncodeToBytes(PyObject *obj)
+{
+	size_t size = 0;
+	if (unlikely(SizePyType(obj, &size) < 0))
+		return EncodeFailed(obj);
+
+	PyObject *ret = PyBytes_FromStringAndSize(NULL, size);
+	if (unlikely(!ret))
+		return NULL;
+
+	if (unlikely(EncodeFixed(obj, (uint8_t *)PyBytes_AS_STRING(ret), size) < 0))
 	{
-		PyObject *namestr_obj = PyObject_ASCII(obj);
-		Py_INCREF(namestr_obj);
-		// Now try and get the string'd version of that object
-		PyObject *retval = PyErr_Format(PyExc_OverflowError, "Encode failed. %s", PyUnicode_AsUTF8(namestr_obj));
-		Py_DECREF(namestr_obj);
-		return retval;
+		Py_DECREF(ret);
+		return NULL;
 	}
 
-	PyObject *memobj = PyMemoryView_FromMemory(GetZiData(data), GetZiSize(data), PyBUF_READ);
-	PyObject *ret = PyBytes_FromObject(memobj);
-	// Only free the ZiHandle_t structure, not the underlying data buffer.
-	// the Python interpreter will free our underlying buffer.
-	free(data);
-// 	FreeZiHandle(data);
-	
 	return ret;
 }
+
+PyObject *ziproto_encode_into(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"obj", "buffer", "offset", NULL};
+	PyObject   *obj    = NULL;
+	Py_buffer   view;
+	Py_ssize_t  offset = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "Ow*|n:encode_into", kwlist, &obj, &view, &offset))
+		return NULL;
+
+	if (offset < 0 || offset > view.len)
+	{
+		PyErr_Format(PyExc_ValueError, "offset %zd is out of range for a buffer of %zd bytes", offset, view.len);
+		PyBuffer_Release(&view);
+		return NULL;
+	}
+
+	ZiThreadStats_t *stats = ThreadStats();
+	uint64_t         start = StatsClock(stats);
+
+	size_t size = 0;
+	if (unlikely(SizePyType(obj, &size) < 0))
+	{
+		PyBuffer_Release(&view);
+		return EncodeFailed(obj);
+	}
+
+	if (size > (size_t)(view.len - offset))
+	{
+		PyErr_Format(PyExc_ValueError, "Buffer too small. %zu bytes required at offset %zd but only %zd available",
+		             size, offset, view.len - offset);
+		PyBuffer_Release(&view);
+		return NULL;
+	}
+
+	int ret = EncodeFixed(obj, (uint8_t *)view.buf + offset, size);
+	PyBuffer_Release(&view);
+	if (unlikely(ret < 0))
+		return NULL;
+
+	CountApiCall(stats, ZI_API_ENCODE_INTO, start, 0, size);
+	return PyLong_FromSize_t(size);
+}
+
+PyObject *ziproto_encoded_size(PyObject *self, PyObject *obj)
+{
+	size_t size = 0;
+	if (unlikely(SizePyType(obj, &size) < 0))
+		return EncodeFailed(obj);
+
+	return PyLong_FromSize_t(size);
+}
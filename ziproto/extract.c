@@ -0,0 +1,567 @@
+#include "common.h"
+
+/**
+ * @struct ZiColumn_t
+ * @brief One field's values collected by extract()
+ *
+ * Numbers are kept as raw machine values until something else shows up, at
+ * which point the column falls back to a list of python objects.
+ */
+typedef struct
+{
+	/*@{*/
+	PyObject     *key;          /**< Field name, owned by the fields tuple */
+	const char   *name;         /**< UTF-8 field name, owned by key */
+	Py_ssize_t    szname;       /**< Length of name in bytes */
+	PyObject     *list;         /**< Values as python objects, null while the column is numeric */
+	uint64_t     *numbers;      /**< Raw numeric values, doubles or 64 bit ints depending on kind */
+	size_t        count;        /**< Values in numbers */
+	size_t        alloc;        /**< Allocated size of numbers */
+	ZiValueType_t kind;         /**< ZI_FLOAT_TYPE or ZI_INT_TYPE once the first number was added */
+	bool          negative;     /**< A ZI_INT_TYPE value was added */
+	bool          unsignedonly; /**< A ZI_UINT_TYPE value above INT64_MAX was added */
+	bool          found;        /**< The field was seen in the current record */
+	/*@}*/
+} ZiColumn_t;
+
+// Moves the numbers collected so far into a list so any value can be added.
+static int ColumnToList(ZiColumn_t *column)
+{
+	PyObject *list = PyList_New(column->count);
+	if (!list)
+		return -1;
+
+	for (size_t i = 0; i < column->count; ++i)
+	{
+		uint64_t  raw = column->numbers[i];
+		PyObject *item;
+		double    f;
+
+		if (column->kind == ZI_FLOAT_TYPE)
+		{
+			memcpy(&f, &raw, sizeof(f));
+			item = PyFloat_FromDouble(f);
+		}
+		else if (column->unsignedonly)
+			item = PyLong_FromUnsignedLongLong(raw);
+		else
+			item = PyLong_FromLongLong((int64_t)raw);
+
+		if (!item)
+		{
+			Py_DECREF(list);
+			return -1;
+		}
+		PyList_SET_ITEM(list, i, item);
+	}
+
+	PyMem_Free(column->numbers);
+	column->numbers = NULL;
+	column->count   = column->alloc = 0;
+	column->list    = list;
+	return 0;
+}
+
+// Adds a python object to the column, steals the reference to obj.
+static int ColumnAppendObject(ZiColumn_t *column, PyObject *obj)
+{
+	if (!obj || (!column->list && ColumnToList(column) < 0))
+	{
+		Py_XDECREF(obj);
+		return -1;
+	}
+
+	int ret = PyList_Append(column->list, obj);
+	Py_DECREF(obj);
+	return ret;
+}
+
+// Adds an int or float read by ZiReadNext to the column.
+static int ColumnAppendNumber(ZiColumn_t *column, const ZiValue_t *value)
+{
+	ZiValueType_t kind         = value->vType == ZI_FLOAT_TYPE ? ZI_FLOAT_TYPE : ZI_INT_TYPE;
+	bool          negative     = column->negative || value->vType == ZI_INT_TYPE;
+	bool          unsignedonly = column->unsignedonly || (value->vType == ZI_UINT_TYPE && value->value.u > INT64_MAX);
+
+	if (!column->list && (column->count == 0 || column->kind == kind) && !(negative && unsignedonly))
+	{
+		if (column->count == column->alloc)
+		{
+			size_t    alloc   = column->alloc ? column->alloc * 2 : 64;
+			uint64_t *numbers = PyMem_Realloc(column->numbers, alloc * sizeof(uint64_t));
+			if (!numbers)
+			{
+				PyErr_NoMemory();
+				return -1;
+			}
+			column->numbers = numbers;
+			column->alloc   = alloc;
+		}
+
+		// The union holds the value's bits whichever member was read
+		column->numbers[column->count++] = value->value.u;
+		column->kind                     = kind;
+		column->negative                 = negative;
+		column->unsignedonly             = unsignedonly;
+		return 0;
+	}
+
+	PyObject *obj;
+	if (value->vType == ZI_FLOAT_TYPE)
+		obj = PyFloat_FromDouble(value->value.f);
+	else if (value->vType == ZI_INT_TYPE)
+		obj = PyLong_FromLongLong(value->value.i);
+	else
+		obj = PyLong_FromUnsignedLongLong(value->value.u);
+	return ColumnAppendObject(column, obj);
+}
+
+// Adds a value of a decoded record, numbers are kept raw like encoded ones. Steals the reference to obj.
+static int ColumnAppendDecoded(ZiColumn_t *column, PyObject *obj)
+{
+	ZiValue_t value;
+
+	if (PyFloat_CheckExact(obj))
+	{
+		value.vType   = ZI_FLOAT_TYPE;
+		value.value.f = PyFloat_AS_DOUBLE(obj);
+	}
+	else if (PyLong_CheckExact(obj))
+	{
+		int       overflow = 0;
+		long long svalue   = PyLong_AsLongLongAndOverflow(obj, &overflow);
+
+		if (!overflow)
+		{
+			value.vType   = svalue < 0 ? ZI_INT_TYPE : ZI_UINT_TYPE;
+			value.value.i = svalue;
+		}
+		else if (overflow > 0)
+		{
+			value.vType   = ZI_UINT_TYPE;
+			value.value.u = PyLong_AsUnsignedLongLong(obj);
+			if (value.value.u == -1ULL && PyErr_Occurred())
+			{
+				Py_DECREF(obj);
+				return -1;
+			}
+		}
+		else
+			return ColumnAppendObject(column, obj);
+	}
+	else
+		return ColumnAppendObject(column, obj);
+
+	Py_DECREF(obj);
+	return ColumnAppendNumber(column, &value);
+}
+
+// Turns a finished column into an array.array or list, null with an exception set on failure.
+static PyObject *ColumnFinish(ZiColumn_t *column)
+{
+	if (column->list)
+	{
+		Py_INCREF(column->list);
+		return column->list;
+	}
+
+	if (column->count == 0)
+		return PyList_New(0);
+
+	void     *items;
+	PyObject *ret = NewTypedArray(column->kind == ZI_FLOAT_TYPE ? 'd' : column->unsignedonly ? 'Q' : 'q', column->count, &items);
+	if (ret)
+		memcpy(items, column->numbers, column->count * sizeof(uint64_t));
+	return ret;
+}
+
+/**
+ * @brief Adds the fields of a compressed record or one with string references to the columns.
+ *
+ * The encoded fields can't be looked at without decompressing the record or
+ * resolving the strings before them, so it is decoded whole and the fields
+ * are looked up in the dict.
+ *
+ * @param[in] handle   The ZiHandle object with the record at its cursor, the cursor is moved past it
+ * @param[in] columns  One column per field
+ * @param[in] ncolumns Number of columns
+ * @returns 0 on success or -1 with a python exception set.
+ */
+static int ExtractDecoded(ZiHandle_t *handle, ZiColumn_t *columns, size_t ncolumns)
+{
+	size_t    start  = handle->_cursor;
+	PyObject *record = DecodeMessage(handle, &(ZiDecodeStack_t){ .keycache = &DefaultKeyCache });
+	if (!record)
+		return -1;
+
+	int ret = -1;
+	if (!PyDict_Check(record))
+	{
+		PyErr_Format(PyExc_ValueError, "Decode failed. Record at offset %zu is not a map", start);
+		goto done;
+	}
+
+	for (size_t i = 0; i < ncolumns; ++i)
+	{
+		PyObject *item = PyDict_GetItemWithError(record, columns[i].key);
+		if (!item && PyErr_Occurred())
+			goto done;
+
+		item = item ? item : Py_None;
+		Py_INCREF(item);
+		if (ColumnAppendDecoded(&columns[i], item) < 0)
+			goto done;
+	}
+	ret = 0;
+
+done:
+	Py_DECREF(record);
+	return ret;
+}
+
+/**
+ * @brief Adds the fields of every record in a buffer to the columns.
+ *
+ * Keys are compared against the field names as encoded bytes and the values
+ * of other keys are skipped over without being decoded. Only the values of
+ * wanted fields that aren't numbers become python objects. Compressed
+ * records and records with string references are handed to ExtractDecoded.
+ *
+ * @param[in] handle  The ZiHandle object over the buffer, records are read from its cursor to the end
+ * @param[in] columns One column per field
+ * @param[in] ncolumns Number of columns
+ * @returns 0 on success or -1 with a python exception set.
+ */
+static int ExtractRecords(ZiHandle_t *handle, ZiColumn_t *columns, size_t ncolumns)
+{
+	ZiDecodeStatus_t status;
+	ZiValue_t        value;
+
+	while (handle->_cursor < handle->szEncodedData)
+	{
+		uint8_t byte = handle->EncodedData[handle->_cursor];
+		if (byte == ZI_FRAME_COMPRESSED || byte == ZI_FRAME_STRING_REFS)
+		{
+			if (ExtractDecoded(handle, columns, ncolumns) < 0)
+				return -1;
+			continue;
+		}
+
+		size_t start = handle->_cursor;
+		if ((status = ZiReadNext(handle, &value)) != ZI_DECODE_OK)
+			goto fail;
+
+		if (value.vType != ZI_MAP_TYPE)
+		{
+			PyErr_Format(PyExc_ValueError, "Decode failed. Record at offset %zu is not a map", start);
+			return -1;
+		}
+
+		size_t left = ncolumns;
+		for (size_t i = 0; i < ncolumns; ++i)
+			columns[i].found = false;
+
+		for (uint64_t entry = 0; entry < value.length; ++entry)
+		{
+			// Once every field was found the rest of the record is only skipped
+			size_t      keystart = handle->_cursor;
+			ZiColumn_t *column   = NULL;
+			ZiValue_t   key;
+
+			if (!left)
+				status = ZiSkipNext(handle);
+			else if ((status = ZiReadNext(handle, &key)) == ZI_DECODE_OK && key.vType == ZI_STR_TYPE)
+			{
+				for (size_t i = 0; i < ncolumns; ++i)
+				{
+					if (!columns[i].found && key.length == (uint64_t)columns[i].szname &&
+					    memcmp(key.data, columns[i].name, key.length) == 0)
+					{
+						column = &columns[i];
+						break;
+					}
+				}
+			}
+			else if (status == ZI_DECODE_OK && (key.vType == ZI_ARRAY_TYPE || key.vType == ZI_MAP_TYPE))
+			{
+				handle->_cursor = keystart;
+				status          = ZiSkipNext(handle);
+			}
+
+			if (status != ZI_DECODE_OK)
+				goto fail;
+
+			if (!column)
+			{
+				if ((status = ZiSkipNext(handle)) != ZI_DECODE_OK)
+					goto fail;
+				continue;
+			}
+
+			column->found = true;
+			left--;
+
+			size_t    valuestart = handle->_cursor;
+			ZiValue_t item;
+			if ((status = ZiReadNext(handle, &item)) != ZI_DECODE_OK)
+				goto fail;
+
+			if (item.vType == ZI_UINT_TYPE || item.vType == ZI_INT_TYPE || item.vType == ZI_FLOAT_TYPE)
+			{
+				if (ColumnAppendNumber(column, &item) < 0)
+					return -1;
+			}
+			else
+			{
+				handle->_cursor = valuestart;
+				if (ColumnAppendObject(column, DecodeNext(handle)) < 0)
+					return -1;
+			}
+		}
+
+		for (size_t i = 0; left && i < ncolumns; ++i)
+		{
+			if (!columns[i].found)
+			{
+				Py_INCREF(Py_None);
+				if (ColumnAppendObject(&columns[i], Py_None) < 0)
+					return -1;
+			}
+		}
+	}
+	return 0;
+
+fail:
+	SetDecodeError(status, handle);
+	return -1;
+}
+
+// Runs ExtractRecords over one bytes-like object.
+static int ExtractBuffer(PyObject *buffer, ZiColumn_t *columns, size_t ncolumns)
+{
+	Py_buffer view;
+	if (PyObject_GetBuffer(buffer, &view, PyBUF_SIMPLE) < 0)
+		return -1;
+
+	ZiHandle_t handle = {
+		.szEncodedData = view.len,
+		.EncodedData   = view.buf
+	};
+
+	int ret = ExtractRecords(&handle, columns, ncolumns);
+	PyBuffer_Release(&view);
+	return ret;
+}
+
+/**
+ * @brief Runs ExtractRecords over a stream read with its read() method.
+ *
+ * The stream is read in chunks and only the complete records of what was
+ * read so far are extracted, a record split between two reads is kept and
+ * finished once the rest of it arrives. When no record completes the next
+ * read asks for as much as is buffered, so a huge record is scanned a
+ * bounded number of times.
+ *
+ * @param[in] stream   Object with a read(size) method returning bytes-like objects
+ * @param[in] columns  One column per field
+ * @param[in] ncolumns Number of columns
+ * @returns 0 on success or -1 with a python exception set.
+ */
+static int ExtractStream(PyObject *stream, ZiColumn_t *columns, size_t ncolumns)
+{
+	PyObject *read = PyObject_GetAttrString(stream, "read");
+	if (!read)
+		return -1;
+
+	ZiHandle_t pending = {0};
+	size_t     offset  = 0; // Stream offset of the first pending byte
+	int        ret     = -1;
+
+	for (;;)
+	{
+		size_t    want  = pending.szEncodedData > EXTRACT_CHUNK ? pending.szEncodedData : EXTRACT_CHUNK;
+		PyObject *chunk = PyObject_CallFunction(read, "n", (Py_ssize_t)want);
+		if (!chunk)
+			goto done;
+		if (chunk == Py_None)
+		{
+			Py_DECREF(chunk);
+			PyErr_SetString(PyExc_BlockingIOError, "extract stream has no data available");
+			goto done;
+		}
+
+		Py_buffer view;
+		int       got = PyObject_GetBuffer(chunk, &view, PyBUF_SIMPLE);
+		Py_DECREF(chunk);
+		if (got < 0)
+			goto done;
+
+		// End of stream
+		if (!view.len)
+		{
+			PyBuffer_Release(&view);
+			break;
+		}
+
+		if (pending._allocsz - pending.szEncodedData < (size_t)view.len)
+		{
+			size_t   newsz = pending.szEncodedData + view.len;
+			uint8_t *data  = realloc(pending.EncodedData, newsz);
+			if (!data)
+			{
+				PyBuffer_Release(&view);
+				PyErr_NoMemory();
+				goto done;
+			}
+			pending.EncodedData = data;
+			pending._allocsz    = newsz;
+		}
+		memcpy(pending.EncodedData + pending.szEncodedData, view.buf, view.len);
+		pending.szEncodedData += view.len;
+		PyBuffer_Release(&view);
+
+		// Find where the last complete record ends
+		ZiDecodeStatus_t status;
+		size_t           complete = 0;
+		pending._cursor = 0;
+		while ((status = ZiSkipMessage(&pending)) == ZI_DECODE_OK)
+			complete = pending._cursor;
+
+		if (status != ZI_DECODE_TRUNCATED)
+		{
+			pending._cursor += offset;
+			SetDecodeError(status, &pending);
+			goto done;
+		}
+
+		if (complete)
+		{
+			size_t total          = pending.szEncodedData;
+			pending._cursor       = 0;
+			pending.szEncodedData = complete;
+			if (ExtractRecords(&pending, columns, ncolumns) < 0)
+				goto done;
+
+			memmove(pending.EncodedData, pending.EncodedData + complete, total - complete);
+			pending.szEncodedData = total - complete;
+			offset               += complete;
+		}
+	}
+
+	// Bytes left at the end of the stream are the start of a record that never finished
+	if (pending.szEncodedData)
+	{
+		pending._cursor = offset;
+		SetDecodeError(ZI_DECODE_TRUNCATED, &pending);
+		goto done;
+	}
+	ret = 0;
+
+done:
+	free(pending.EncodedData);
+	Py_DECREF(read);
+	return ret;
+}
+
+PyObject *ziproto_extract(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[]     = {"records", "fields", "typed_arrays", NULL};
+	PyObject    *records      = NULL, *fieldlist = NULL;
+	int          typed_arrays = 1;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|$p:extract", kwlist, &records, &fieldlist, &typed_arrays))
+		return NULL;
+
+	PyObject *fields = PySequence_Fast(fieldlist, "extract fields must be an iterable of str");
+	if (!fields)
+		return NULL;
+
+	size_t      ncolumns = PySequence_Fast_GET_SIZE(fields);
+	ZiColumn_t *columns  = PyMem_Calloc(ncolumns ? ncolumns : 1, sizeof(ZiColumn_t));
+	PyObject   *result   = NULL;
+	if (!columns)
+	{
+		Py_DECREF(fields);
+		return PyErr_NoMemory();
+	}
+
+	for (size_t i = 0; i < ncolumns; ++i)
+	{
+		PyObject *name = PySequence_Fast_GET_ITEM(fields, i);
+		if (!PyUnicode_Check(name))
+		{
+			PyErr_Format(PyExc_TypeError, "extract fields must be str, not %.200s", Py_TYPE(name)->tp_name);
+			goto done;
+		}
+		columns[i].key = name;
+		if (!(columns[i].name = StrAsUTF8(name, &columns[i].szname)))
+			goto done;
+
+		for (size_t j = 0; j < i; ++j)
+		{
+			if (columns[j].szname == columns[i].szname && memcmp(columns[j].name, columns[i].name, columns[i].szname) == 0)
+			{
+				PyErr_Format(PyExc_ValueError, "Duplicate extract field %R", name);
+				goto done;
+			}
+		}
+
+		if (!typed_arrays && !(columns[i].list = PyList_New(0)))
+			goto done;
+	}
+
+	// A single buffer holds records back to back, a file-like object is read
+	// in chunks and anything else is an iterable of buffers.
+	if (PyObject_CheckBuffer(records))
+	{
+		if (ExtractBuffer(records, columns, ncolumns) < 0)
+			goto done;
+	}
+	else if (PyObject_HasAttrString(records, "read"))
+	{
+		if (ExtractStream(records, columns, ncolumns) < 0)
+			goto done;
+	}
+	else
+	{
+		PyObject *iter = PyObject_GetIter(records);
+		if (!iter)
+			goto done;
+
+		PyObject *buffer;
+		while ((buffer = PyIter_Next(iter)))
+		{
+			int ret = ExtractBuffer(buffer, columns, ncolumns);
+			Py_DECREF(buffer);
+			if (ret < 0)
+				break;
+		}
+		Py_DECREF(iter);
+		if (PyErr_Occurred())
+			goto done;
+	}
+
+	if (!(result = PyList_New(ncolumns)))
+		goto done;
+
+	for (size_t i = 0; i < ncolumns; ++i)
+	{
+		PyObject *column = ColumnFinish(&columns[i]);
+		if (!column)
+		{
+			Py_CLEAR(result);
+			goto done;
+		}
+		PyList_SET_ITEM(result, i, column);
+	}
+
+done:
+	for (size_t i = 0; i < ncolumns; ++i)
+	{
+		Py_XDECREF(columns[i].list);
+		PyMem_Free(columns[i].numbers);
+	}
+	PyMem_Free(columns);
+	Py_DECREF(fields);
+	return result;
+}
@@ -0,0 +1,172 @@
+#include "common.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * @brief Maps a whole file read only.
+ *
+ * For sequential reads the kernel reads ahead aggressively and drops pages
+ * soon after they were read, which keeps files larger than RAM from pushing
+ * everything else out of the page cache.
+ *
+ * @param[in]  path   Path to the file, anything os.fsencode accepts
+ * @param[in]  advice madvise() access pattern, MADV_SEQUENTIAL or MADV_NORMAL
+ * @param[out] data   Start of the mapping, null for an empty file
+ * @param[out] size   Size of the mapping
+ * @returns 0 on success or -1 with a python exception set.
+ */
+int MapFile(PyObject *path, int advice, uint8_t **data, size_t *size)
+{
+	PyObject *encoded = NULL;
+	if (!PyUnicode_FSConverter(path, &encoded))
+		return -1;
+
+	const char *name = PyBytes_AS_STRING(encoded);
+	void       *map  = NULL;
+	off_t       len  = 0;
+	int         err  = 0;
+
+	Py_BEGIN_ALLOW_THREADS
+	int fd = open(name, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) < 0)
+		err = errno;
+	else if (!S_ISREG(st.st_mode))
+		err = S_ISDIR(st.st_mode) ? EISDIR : EINVAL;
+	else if ((len = st.st_size) > 0)
+	{
+		map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED)
+		{
+			err = errno;
+			map = NULL;
+		}
+		else
+			madvise(map, len, advice);
+	}
+	if (fd >= 0)
+		close(fd);
+	Py_END_ALLOW_THREADS
+
+	if (err)
+	{
+		errno = err;
+		PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path);
+		Py_DECREF(encoded);
+		return -1;
+	}
+
+	Py_DECREF(encoded);
+	*data = map;
+	*size = len;
+	return 0;
+}
+
+/**
+ * @struct ZiFileIter_t
+ * @brief Iterator decoding the records of a memory mapped file one by one
+ */
+typedef struct
+{
+	PyObject_HEAD
+	ZiHandle_t handle; /**< Cursor over the mapping, EncodedData is null once closed */
+} ZiFileIter_t;
+
+static void FileIter_close_map(ZiFileIter_t *self)
+{
+	if (self->handle.EncodedData)
+		munmap(self->handle.EncodedData, self->handle.szEncodedData);
+	self->handle = (ZiHandle_t){0};
+}
+
+static void FileIter_dealloc(ZiFileIter_t *self)
+{
+	FileIter_close_map(self);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *FileIter_next(ZiFileIter_t *self)
+{
+	ZiHandle_t *handle = &self->handle;
+
+	// Decoded objects never point into the mapping, so it can go
+	// as soon as the last record is out.
+	if (handle->_cursor >= handle->szEncodedData)
+	{
+		FileIter_close_map(self);
+		return NULL;
+	}
+
+	PyObject *obj = DecodeMessage(handle, &(ZiDecodeStack_t){ .keycache = &DefaultKeyCache });
+	if (!obj)
+		FileIter_close_map(self);
+	return obj;
+}
+
+static PyObject *FileIter_close(ZiFileIter_t *self, PyObject *Py_UNUSED(ignored))
+{
+	FileIter_close_map(self);
+	Py_RETURN_NONE;
+}
+
+static PyObject *FileIter_enter(ZiFileIter_t *self, PyObject *Py_UNUSED(ignored))
+{
+	Py_INCREF(self);
+	return (PyObject *)self;
+}
+
+static PyObject *FileIter_exit(ZiFileIter_t *self, PyObject *args)
+{
+	FileIter_close_map(self);
+	Py_RETURN_NONE;
+}
+
+static PyMethodDef FileIter_methods[] = {
+	{ "close",     (PyCFunction) FileIter_close, METH_NOARGS,
+		"close()\n--\n\nUnmap the file, ending the iteration." },
+	{ "__enter__", (PyCFunction) FileIter_enter, METH_NOARGS, NULL },
+	{ "__exit__",  (PyCFunction) FileIter_exit,  METH_VARARGS, NULL },
+	{0}
+};
+
+PyTypeObject ZiFileIterType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name      = "ziproto.FileIterator",
+	.tp_basicsize = sizeof(ZiFileIter_t),
+	.tp_flags     = Py_TPFLAGS_DEFAULT,
+	.tp_dealloc   = (destructor) FileIter_dealloc,
+	.tp_iter      = PyObject_SelfIter,
+	.tp_iternext  = (iternextfunc) FileIter_next,
+	.tp_methods   = FileIter_methods,
+};
+
+PyObject *ziproto_iter_file(PyObject *self, PyObject *path)
+{
+	ZiFileIter_t *iter = PyObject_New(ZiFileIter_t, &ZiFileIterType);
+	if (!iter)
+		return NULL;
+
+	iter->handle = (ZiHandle_t){0};
+	if (MapFile(path, MADV_SEQUENTIAL, &iter->handle.EncodedData, &iter->handle.szEncodedData) < 0)
+	{
+		Py_DECREF(iter);
+		return NULL;
+	}
+	return (PyObject *)iter;
+}
+
+PyObject *ziproto_load(PyObject *self, PyObject *path)
+{
+	ZiHandle_t handle = {0};
+	if (MapFile(path, MADV_SEQUENTIAL, &handle.EncodedData, &handle.szEncodedData) < 0)
+		return NULL;
+
+	PyObject *obj = DecodeMessage(&handle, &(ZiDecodeStack_t){ .keycache = &DefaultKeyCache });
+
+	if (handle.EncodedData)
+		munmap(handle.EncodedData, handle.szEncodedData);
+	return obj;
+}
@@ -0,0 +1,514 @@
+#include "common.h"
+
+/**
+ * @struct ZiLazyView_t
+ * @brief Python object giving access to an encoded array or map without decoding it
+ *
+ * Only the elements that are looked at are decoded, everything else is skipped
+ * over using the lengths in the encoded headers. Nested arrays and maps are
+ * returned as further views sharing the root view's buffer.
+ */
+typedef struct ZiLazyView
+{
+	PyObject_HEAD
+	struct ZiLazyView *root;   /**< View owning the buffer, null if this is the root */
+	Py_buffer          view;   /**< The encoded data, only held by the root */
+	ZiHandle_t         handle; /**< Whole buffer, _cursor is unused */
+	size_t             offset; /**< Offset of this container's type byte */
+	size_t             first;  /**< Offset of the first element */
+	size_t             length; /**< Number of elements (or map entries) */
+	bool               ismap;  /**< Whether this is a map or an array */
+} ZiLazyView_t;
+
+typedef enum
+{
+	LAZY_KEYS,
+	LAZY_VALUES,
+	LAZY_ITEMS
+} ZiLazyIterKind_t;
+
+/**
+ * @struct ZiLazyIter_t
+ * @brief Iterator walking the elements of a ZiLazyView_t in order
+ */
+typedef struct
+{
+	PyObject_HEAD
+	ZiLazyView_t    *view;      /**< The view being iterated */
+	size_t           cursor;    /**< Offset of the next element */
+	size_t           remaining; /**< Elements (or map entries) left */
+	ZiLazyIterKind_t kind;      /**< What to yield for map entries */
+} ZiLazyIter_t;
+
+// Raise the error for a failed skip or decode at `offset`.
+static void LazyError(ZiLazyView_t *self, ZiDecodeStatus_t status, size_t offset)
+{
+	ZiHandle_t handle = self->handle;
+	handle._cursor = offset;
+	SetDecodeError(status, &handle);
+}
+
+// Skip the element at *cursor, raising on malformed data.
+static int LazySkip(ZiLazyView_t *self, size_t *cursor)
+{
+	ZiHandle_t handle = self->handle;
+	handle._cursor = *cursor;
+
+	ZiDecodeStatus_t status = ZiSkipNext(&handle);
+	if (unlikely(status != ZI_DECODE_OK))
+	{
+		SetDecodeError(status, &handle);
+		return -1;
+	}
+	*cursor = handle._cursor;
+	return 0;
+}
+
+/**
+ * @brief Parses the array or map header at offset into a view.
+ *
+ * @returns 1 if the element is an array or map, 0 if it isn't and -1 on error.
+ */
+static int LazyParseHeader(ZiLazyView_t *view, size_t offset)
+{
+	const ZiHandle_t *handle = &view->handle;
+
+	if (unlikely(offset >= handle->szEncodedData))
+	{
+		LazyError(view, ZI_DECODE_TRUNCATED, offset);
+		return -1;
+	}
+
+	uint8_t               byte   = handle->EncodedData[offset];
+	const ZiFormatInfo_t *format = &ZiFormatTable[byte];
+
+	if (format->kind != ZI_ARRAY_TYPE && format->kind != ZI_MAP_TYPE)
+		return 0;
+
+	uint64_t length = byte & format->mask;
+	if (format->szlen)
+	{
+		if (unlikely(format->szlen > handle->szEncodedData - offset - 1))
+		{
+			LazyError(view, ZI_DECODE_TRUNCATED, offset);
+			return -1;
+		}
+		length = ZiReadUnsigned(handle->EncodedData + offset + 1, format->szlen);
+	}
+
+	view->offset = offset;
+	view->first  = offset + 1 + format->szlen;
+	view->length = length;
+	view->ismap  = format->kind == ZI_MAP_TYPE;
+	return 1;
+}
+
+// Returns a sub-view for containers or the decoded object for scalars at offset.
+static PyObject *LazyMaterialize(ZiLazyView_t *self, size_t offset)
+{
+	ZiLazyView_t *root   = self->root ? self->root : self;
+	ZiHandle_t    handle = root->handle;
+	ZiValue_t     value;
+
+	// Only arrays and maps need a view, everything else is decoded in place
+	handle._cursor = offset;
+	if (ZiReadNext(&handle, &value) != ZI_DECODE_OK || (value.vType != ZI_ARRAY_TYPE && value.vType != ZI_MAP_TYPE))
+	{
+		handle._cursor = offset;
+		return DecodeNext(&handle);
+	}
+
+	ZiLazyView_t *sub = PyObject_GC_New(ZiLazyView_t, &ZiLazyViewType);
+	if (!sub)
+		return NULL;
+
+	memset(&sub->view, 0, sizeof(Py_buffer));
+	Py_INCREF(root);
+	sub->root   = root;
+	sub->handle = root->handle;
+	sub->offset = offset;
+	sub->first  = handle._cursor;
+	sub->length = value.length;
+	sub->ismap  = value.vType == ZI_MAP_TYPE;
+	PyObject_GC_Track(sub);
+	return (PyObject *)sub;
+}
+
+// Check whether the encoded map key at offset equals key, without decoding string keys.
+static int LazyKeyEquals(ZiLazyView_t *self, size_t offset, PyObject *key, const char *utf8, Py_ssize_t szutf8)
+{
+	const uint8_t        *data   = self->handle.EncodedData;
+	uint8_t               byte   = data[offset];
+	const ZiFormatInfo_t *format = &ZiFormatTable[byte];
+
+	if (utf8)
+	{
+		if (format->kind != ZI_STR_TYPE)
+			return 0;
+
+		size_t   avail  = self->handle.szEncodedData - offset - 1;
+		uint64_t length = byte & format->mask;
+		if (format->szlen)
+		{
+			if (format->szlen > avail)
+				return 0;
+			length = ZiReadUnsigned(data + offset + 1, format->szlen);
+		}
+		if (length != (uint64_t)szutf8 || format->szlen + length > avail)
+			return 0;
+		return memcmp(data + offset + 1 + format->szlen, utf8, length) == 0;
+	}
+
+	// Containers can't be map keys that compare equal to a hashable key.
+	if (format->kind == ZI_ARRAY_TYPE || format->kind == ZI_MAP_TYPE || format->kind == ZI_INVALID_TYPE)
+		return 0;
+
+	ZiHandle_t handle = self->handle;
+	handle._cursor = offset;
+	PyObject *decoded = DecodeNext(&handle);
+	if (!decoded)
+		return -1;
+	int ret = PyObject_RichCompareBool(decoded, key, Py_EQ);
+	Py_DECREF(decoded);
+	return ret;
+}
+
+// Find the value for key in a map view, returns null without an exception if missing.
+static PyObject *LazyLookup(ZiLazyView_t *self, PyObject *key)
+{
+	const char *utf8   = NULL;
+	Py_ssize_t  szutf8 = 0;
+
+	if (PyUnicode_Check(key))
+	{
+		utf8 = StrAsUTF8(key, &szutf8);
+		if (!utf8)
+			return NULL;
+	}
+
+	size_t cursor = self->first;
+	for (size_t i = 0; i < self->length; ++i)
+	{
+		if (unlikely(cursor >= self->handle.szEncodedData))
+		{
+			LazyError(self, ZI_DECODE_TRUNCATED, cursor);
+			return NULL;
+		}
+
+		int match = LazyKeyEquals(self, cursor, key, utf8, szutf8);
+		if (match < 0 || LazySkip(self, &cursor) < 0)
+			return NULL;
+
+		if (match)
+			return LazyMaterialize(self, cursor);
+
+		if (LazySkip(self, &cursor) < 0)
+			return NULL;
+	}
+	return NULL;
+}
+
+// Replaces the root view's compressed frame with a bytes object holding its contents.
+static int LazyDecompress(ZiLazyView_t *self)
+{
+	size_t           rawsize = 0, framesize = 0;
+	ZiDecodeStatus_t status  = ZiReadFrameHeader(self->handle.EncodedData, self->handle.szEncodedData, &rawsize, &framesize);
+	if (status != ZI_DECODE_OK)
+	{
+		LazyError(self, status, 0);
+		return -1;
+	}
+
+	PyObject *raw = PyBytes_FromStringAndSize(NULL, rawsize);
+	if (!raw)
+		return -1;
+
+	uint8_t *data = (uint8_t *)PyBytes_AS_STRING(raw);
+	Py_BEGIN_ALLOW_THREADS
+	status = ZiDecompressBlock(self->handle.EncodedData + ZI_FRAME_HEADER_SIZE, framesize - ZI_FRAME_HEADER_SIZE, data, rawsize);
+	Py_END_ALLOW_THREADS
+
+	if (status != ZI_DECODE_OK)
+	{
+		Py_DECREF(raw);
+		PyErr_SetString(PyExc_ValueError, "Decode failed. Damaged compressed frame at offset 0");
+		return -1;
+	}
+
+	PyBuffer_Release(&self->view);
+	int ret = PyObject_GetBuffer(raw, &self->view, PyBUF_SIMPLE);
+	Py_DECREF(raw);
+	if (ret < 0)
+		return -1;
+
+	self->handle.EncodedData   = self->view.buf;
+	self->handle.szEncodedData = self->view.len;
+	return 0;
+}
+
+static PyObject *LazyView_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"buffer", NULL};
+	PyObject    *buffer   = NULL;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O:LazyView", kwlist, &buffer))
+		return NULL;
+
+	ZiLazyView_t *self = (ZiLazyView_t *)type->tp_alloc(type, 0);
+	if (!self)
+		return NULL;
+
+	if (PyObject_GetBuffer(buffer, &self->view, PyBUF_SIMPLE) < 0)
+	{
+		Py_DECREF(self);
+		return NULL;
+	}
+	self->handle.EncodedData   = self->view.buf;
+	self->handle.szEncodedData = self->view.len;
+
+	// A compressed message is decompressed once and the view kept on the result
+	if (self->view.len && self->handle.EncodedData[0] == ZI_FRAME_COMPRESSED && LazyDecompress(self) < 0)
+	{
+		Py_DECREF(self);
+		return NULL;
+	}
+
+	// A string reference is only known after every string before it was
+	// read, which doesn't work with jumping straight to an element
+	if (self->handle.szEncodedData && self->handle.EncodedData[0] == ZI_FRAME_STRING_REFS)
+	{
+		PyErr_SetString(PyExc_ValueError, "LazyView can't read messages encoded with string_refs=True, use decode()");
+		Py_DECREF(self);
+		return NULL;
+	}
+
+	int ret = LazyParseHeader(self, 0);
+	if (ret <= 0)
+	{
+		if (ret == 0)
+			PyErr_SetString(PyExc_ValueError, "LazyView needs an encoded array or map");
+		Py_DECREF(self);
+		return NULL;
+	}
+	return (PyObject *)self;
+}
+
+static int LazyView_traverse(ZiLazyView_t *self, visitproc visit, void *arg)
+{
+	Py_VISIT(self->root);
+	Py_VISIT(self->view.obj);
+	return 0;
+}
+
+static void LazyView_dealloc(ZiLazyView_t *self)
+{
+	PyObject_GC_UnTrack(self);
+	if (self->view.obj)
+		PyBuffer_Release(&self->view);
+	Py_XDECREF(self->root);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static Py_ssize_t LazyView_length(ZiLazyView_t *self)
+{
+	return self->length;
+}
+
+static PyObject *LazyView_subscript(ZiLazyView_t *self, PyObject *key)
+{
+	if (self->ismap)
+	{
+		PyObject *ret = LazyLookup(self, key);
+		if (!ret && !PyErr_Occurred())
+			PyErr_SetObject(PyExc_KeyError, key);
+		return ret;
+	}
+
+	if (!PyIndex_Check(key))
+		return PyErr_Format(PyExc_TypeError, "LazyView indices must be integers, not %.200s", Py_TYPE(key)->tp_name);
+
+	Py_ssize_t index = PyNumber_AsSsize_t(key, PyExc_IndexError);
+	if (index == -1 && PyErr_Occurred())
+		return NULL;
+	if (index < 0)
+		index += self->length;
+	if (index < 0 || (size_t)index >= self->length)
+	{
+		PyErr_SetString(PyExc_IndexError, "LazyView index out of range");
+		return NULL;
+	}
+
+	size_t cursor = self->first;
+	while (index--)
+	{
+		if (LazySkip(self, &cursor) < 0)
+			return NULL;
+	}
+	return LazyMaterialize(self, cursor);
+}
+
+static PyObject *LazyView_get(ZiLazyView_t *self, PyObject *args)
+{
+	PyObject *key = NULL, *def = Py_None;
+
+	if (!PyArg_UnpackTuple(args, "get", 1, 2, &key, &def))
+		return NULL;
+
+	if (!self->ismap)
+		return PyErr_Format(PyExc_TypeError, "get() needs a LazyView of a map");
+
+	PyObject *ret = LazyLookup(self, key);
+	if (!ret && !PyErr_Occurred())
+	{
+		Py_INCREF(def);
+		return def;
+	}
+	return ret;
+}
+
+static PyObject *LazyView_decode(ZiLazyView_t *self, PyObject *Py_UNUSED(ignored))
+{
+	ZiHandle_t handle = self->handle;
+	handle._cursor = self->offset;
+	return DecodeNext(&handle);
+}
+
+static PyObject *LazyIterNew(ZiLazyView_t *view, ZiLazyIterKind_t kind)
+{
+	ZiLazyIter_t *iter = PyObject_GC_New(ZiLazyIter_t, &ZiLazyIterType);
+	if (!iter)
+		return NULL;
+
+	Py_INCREF(view);
+	iter->view      = view;
+	iter->cursor    = view->first;
+	iter->remaining = view->length;
+	iter->kind      = kind;
+	PyObject_GC_Track(iter);
+	return (PyObject *)iter;
+}
+
+static PyObject *LazyView_iter(ZiLazyView_t *self)
+{
+	return LazyIterNew(self, LAZY_KEYS);
+}
+
+static PyObject *LazyView_keys(ZiLazyView_t *self, PyObject *Py_UNUSED(ignored))
+{
+	return LazyIterNew(self, LAZY_KEYS);
+}
+
+static PyObject *LazyView_values(ZiLazyView_t *self, PyObject *Py_UNUSED(ignored))
+{
+	return LazyIterNew(self, LAZY_VALUES);
+}
+
+static PyObject *LazyView_items(ZiLazyView_t *self, PyObject *Py_UNUSED(ignored))
+{
+	return LazyIterNew(self, LAZY_ITEMS);
+}
+
+static int LazyIter_traverse(ZiLazyIter_t *self, visitproc visit, void *arg)
+{
+	Py_VISIT(self->view);
+	return 0;
+}
+
+static void LazyIter_dealloc(ZiLazyIter_t *self)
+{
+	PyObject_GC_UnTrack(self);
+	Py_XDECREF(self->view);
+	PyObject_GC_Del(self);
+}
+
+static PyObject *LazyIter_next(ZiLazyIter_t *self)
+{
+	ZiLazyView_t *view = self->view;
+	PyObject     *key  = NULL;
+
+	if (!self->remaining)
+		return NULL;
+	self->remaining--;
+
+	// Array elements are always yielded as values
+	if (view->ismap)
+	{
+		if (self->kind != LAZY_VALUES && !(key = LazyMaterialize(view, self->cursor)))
+			goto failure;
+		if (LazySkip(view, &self->cursor) < 0)
+			goto failure;
+		if (self->kind == LAZY_KEYS)
+		{
+			if (LazySkip(view, &self->cursor) < 0)
+				goto failure;
+			return key;
+		}
+	}
+
+	PyObject *value = LazyMaterialize(view, self->cursor);
+	if (!value || LazySkip(view, &self->cursor) < 0)
+	{
+		Py_XDECREF(value);
+		goto failure;
+	}
+
+	if (key)
+	{
+		PyObject *item = PyTuple_Pack(2, key, value);
+		Py_DECREF(key);
+		Py_DECREF(value);
+		return item;
+	}
+	return value;
+
+failure:
+	Py_XDECREF(key);
+	self->remaining = 0;
+	return NULL;
+}
+
+static PyMethodDef LazyView_methods[] = {
+	{ "get",    (PyCFunction) LazyView_get,    METH_VARARGS,
+		"get(key, default=None)\n--\n\nLook up key in a map without decoding the other entries." },
+	{ "keys",   (PyCFunction) LazyView_keys,   METH_NOARGS,
+		"keys()\n--\n\nIterate over the keys of a map." },
+	{ "values", (PyCFunction) LazyView_values, METH_NOARGS,
+		"values()\n--\n\nIterate over the values of a map or the elements of an array." },
+	{ "items",  (PyCFunction) LazyView_items,  METH_NOARGS,
+		"items()\n--\n\nIterate over the (key, value) pairs of a map." },
+	{ "decode", (PyCFunction) LazyView_decode, METH_NOARGS,
+		"decode()\n--\n\nFully decode this array or map." },
+	{0}
+};
+
+static PyMappingMethods LazyView_as_mapping = {
+	.mp_length        = (lenfunc) LazyView_length,
+	.mp_subscript     = (binaryfunc) LazyView_subscript,
+};
+
+PyTypeObject ZiLazyViewType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name       = "ziproto.LazyView",
+	.tp_doc        = "LazyView(buffer)\n--\n\n"
+	                 "Read-only view of an encoded array or map. Elements are only decoded "
+	                 "when accessed, nested arrays and maps are returned as views.",
+	.tp_basicsize  = sizeof(ZiLazyView_t),
+	.tp_flags      = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+	.tp_new        = LazyView_new,
+	.tp_dealloc    = (destructor) LazyView_dealloc,
+	.tp_traverse   = (traverseproc) LazyView_traverse,
+	.tp_iter       = (getiterfunc) LazyView_iter,
+	.tp_methods    = LazyView_methods,
+	.tp_as_mapping = &LazyView_as_mapping,
+};
+
+PyTypeObject ZiLazyIterType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name      = "ziproto.LazyViewIterator",
+	.tp_basicsize = sizeof(ZiLazyIter_t),
+	.tp_flags     = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+	.tp_dealloc   = (destructor) LazyIter_dealloc,
+	.tp_traverse  = (traverseproc) LazyIter_traverse,
+	.tp_iter      = PyObject_SelfIter,
+	.tp_iternext  = (iternextfunc) LazyIter_next,
+};
@@ -0,0 +1,306 @@
+#include "common.h"
+#include "structmember.h"
+
+// Default number of buffered bytes before we write to the stream
+#define PACKER_HIGH_WATER 65536
+
+/**
+ * @struct ZiPacker_t
+ * @brief Python object wrapping a long-lived ZiHandle_t
+ *
+ * The handle's buffer is kept between pack() calls so that once it has grown
+ * to the high-water mark it is only ever rewound, never reallocated.
+ */
+typedef struct
+{
+	PyObject_HEAD
+	ZiHandle_t *handle;     /**< Buffered encoded data */
+	PyObject   *write;      /**< Bound write method of the stream, or null */
+	Py_ssize_t  high_water; /**< Flush once this many bytes are buffered */
+	bool        writing;    /**< The stream is being handed a view of the buffer */
+} ZiPacker_t;
+
+/**
+ * @brief Refuses to touch the buffer while the stream holds a view of it.
+ *
+ * A stream whose write() calls back into the Packer would otherwise grow or
+ * rewind the buffer underneath the view it was given.
+ *
+ * @param[in] self The Packer
+ * @returns true (with RuntimeError set) while PackerWrite() is running.
+ */
+static bool PackerBusy(ZiPacker_t *self)
+{
+	if (self->writing)
+		PyErr_SetString(PyExc_RuntimeError, "Packer can't be used from its stream's write()");
+	return self->writing;
+}
+
+// Moves the bytes the stream didn't take to the front of the buffer.
+static void PackerKeepTail(ZiHandle_t *handle, size_t written)
+{
+	size_t left = ZiGetSize(handle) - written;
+	if (written && left)
+		memmove(ZiGetData(handle), ZiGetData(handle) + written, left);
+	handle->szEncodedData = handle->_cursor = left;
+}
+
+/**
+ * @brief Writes the buffered data to the stream and rewinds the buffer.
+ *
+ * Raw streams may write less than they were given, so write() is called
+ * until everything was taken. A stream that takes nothing, returns None
+ * (a non-blocking stream that would block) or doesn't report a count
+ * raises, and whatever wasn't written stays buffered for the next flush().
+ *
+ * @param[in] self The Packer
+ * @returns 0 once everything was written or -1 with a python exception set.
+ */
+static int PackerWrite(ZiPacker_t *self)
+{
+	ZiHandle_t *handle = self->handle;
+	size_t      offset = 0;
+
+	self->writing = true;
+	while (offset < ZiGetSize(handle))
+	{
+		size_t left = ZiGetSize(handle) - offset;
+
+		// The view is released after the write so a stream holding on to it
+		// can never see the buffer being reused underneath it.
+		PyObject *view = PyMemoryView_FromMemory((char *)ZiGetData(handle) + offset, left, PyBUF_READ);
+		if (!view)
+			goto fail;
+
+		PyObject *ret = PyObject_CallFunctionObjArgs(self->write, view, NULL);
+		PyObject *type, *value, *traceback;
+
+		// The stream's exception is set aside while the view is released
+		PyErr_Fetch(&type, &value, &traceback);
+		PyObject *rel = PyObject_CallMethod(view, "release", NULL);
+		Py_DECREF(view);
+		if (!rel)
+		{
+			Py_XDECREF(ret);
+			Py_XDECREF(type);
+			Py_XDECREF(value);
+			Py_XDECREF(traceback);
+			goto fail;
+		}
+		Py_DECREF(rel);
+		PyErr_Restore(type, value, traceback);
+		if (!ret)
+			goto fail;
+
+		if (ret == Py_None)
+		{
+			Py_DECREF(ret);
+			PyErr_Format(PyExc_BlockingIOError, "Packer stream would block, %zu bytes are still buffered", left);
+			goto fail;
+		}
+		if (!PyLong_Check(ret))
+		{
+			PyErr_Format(PyExc_TypeError, "Packer stream write() should return an int, not %.200s", Py_TYPE(ret)->tp_name);
+			Py_DECREF(ret);
+			goto fail;
+		}
+
+		Py_ssize_t written = PyLong_AsSsize_t(ret);
+		Py_DECREF(ret);
+		if (written == -1 && PyErr_Occurred())
+			goto fail;
+		if (written <= 0 || (size_t)written > left)
+		{
+			PyErr_Format(PyExc_OSError, "Packer stream write() returned %zd for %zu bytes", written, left);
+			goto fail;
+		}
+		offset += written;
+	}
+
+	self->writing = false;
+	handle->szEncodedData = handle->_cursor = 0;
+	return 0;
+
+fail:
+	self->writing = false;
+	PackerKeepTail(handle, offset);
+	return -1;
+}
+
+static PyObject *Packer_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+	ZiPacker_t *self = (ZiPacker_t *)type->tp_alloc(type, 0);
+	if (!self)
+		return NULL;
+
+	self->high_water = PACKER_HIGH_WATER;
+	self->handle     = ZiAllocHandle(64);
+	if (!self->handle)
+	{
+		Py_DECREF(self);
+		return PyErr_NoMemory();
+	}
+	return (PyObject *)self;
+}
+
+static int Packer_init(ZiPacker_t *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"stream", "high_water", NULL};
+	PyObject   *stream     = Py_None;
+	Py_ssize_t  high_water = PACKER_HIGH_WATER;
+
+	if (PackerBusy(self) || !PyArg_ParseTupleAndKeywords(args, kwds, "|On:Packer", kwlist, &stream, &high_water))
+		return -1;
+
+	if (high_water < 0)
+	{
+		PyErr_SetString(PyExc_ValueError, "high_water must not be negative");
+		return -1;
+	}
+
+	PyObject *write = NULL;
+	if (stream != Py_None)
+	{
+		write = PyObject_GetAttrString(stream, "write");
+		if (!write)
+			return -1;
+	}
+	Py_XSETREF(self->write, write);
+	self->high_water = high_water;
+
+	// Start with enough room for a full buffer so the steady state never reallocates.
+	if (self->handle->_allocsz < (size_t)high_water)
+	{
+		uint8_t *data = realloc(ZiGetData(self->handle), high_water);
+		if (!data)
+		{
+			PyErr_NoMemory();
+			return -1;
+		}
+		self->handle->EncodedData = data;
+		self->handle->_allocsz    = high_water;
+	}
+	self->handle->szEncodedData = self->handle->_cursor = 0;
+	return 0;
+}
+
+static int Packer_traverse(ZiPacker_t *self, visitproc visit, void *arg)
+{
+	Py_VISIT(self->write);
+	return 0;
+}
+
+static int Packer_clear(ZiPacker_t *self)
+{
+	Py_CLEAR(self->write);
+	return 0;
+}
+
+static void Packer_dealloc(ZiPacker_t *self)
+{
+	PyObject_GC_UnTrack(self);
+	Packer_clear(self);
+	if (self->handle)
+		ZiFreeHandle(self->handle);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *Packer_pack(ZiPacker_t *self, PyObject *obj)
+{
+	if (PackerBusy(self))
+		return NULL;
+
+	ZiHandle_t      *handle = self->handle;
+	size_t           mark   = ZiGetSize(handle);
+	ZiThreadStats_t *stats  = ThreadStats();
+	uint64_t         start  = StatsClock(stats);
+
+	handle->stats = stats ? &stats->encoder : NULL;
+	if (!EncodePyType(handle, obj))
+	{
+		// Drop the partially encoded object, keep everything before it.
+		handle->szEncodedData = handle->_cursor = mark;
+		if (!PyErr_Occurred())
+			PyErr_SetString(PyExc_OverflowError, "Encode failed.");
+		return NULL;
+	}
+	CountApiCall(stats, ZI_API_PACK, start, 0, ZiGetSize(handle) - mark);
+
+	if (self->write && ZiGetSize(handle) >= (size_t)self->high_water && PackerWrite(self) < 0)
+		return NULL;
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *Packer_flush(ZiPacker_t *self, PyObject *Py_UNUSED(ignored))
+{
+	if (PackerBusy(self))
+		return NULL;
+
+	// Without a stream the caller gets the buffered data back instead.
+	if (!self->write)
+	{
+		PyObject *ret = PyBytes_FromStringAndSize((const char *)ZiGetData(self->handle), ZiGetSize(self->handle));
+		if (ret)
+			self->handle->szEncodedData = self->handle->_cursor = 0;
+		return ret;
+	}
+
+	if (PackerWrite(self) < 0)
+		return NULL;
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *Packer_reset(ZiPacker_t *self, PyObject *Py_UNUSED(ignored))
+{
+	if (PackerBusy(self))
+		return NULL;
+
+	self->handle->szEncodedData = self->handle->_cursor = 0;
+	Py_RETURN_NONE;
+}
+
+static Py_ssize_t Packer_length(ZiPacker_t *self)
+{
+	return ZiGetSize(self->handle);
+}
+
+static PyMethodDef Packer_methods[] = {
+	{ "pack",  (PyCFunction) Packer_pack,  METH_O,
+		"pack(obj)\n--\n\nEncode obj into the buffer, flushing to the stream once the high-water mark is reached." },
+	{ "flush", (PyCFunction) Packer_flush, METH_NOARGS,
+		"flush()\n--\n\nWrite all buffered data to the stream, or return it as bytes if there is no stream.\n"
+		"Data the stream didn't take when it raised stays buffered." },
+	{ "reset", (PyCFunction) Packer_reset, METH_NOARGS,
+		"reset()\n--\n\nDiscard all buffered data." },
+	{0}
+};
+
+static PyMemberDef Packer_members[] = {
+	{ "high_water", T_PYSSIZET, offsetof(ZiPacker_t, high_water), READONLY,
+		"Number of buffered bytes that triggers a write to the stream." },
+	{0}
+};
+
+static PySequenceMethods Packer_as_sequence = {
+	.sq_length = (lenfunc) Packer_length,
+};
+
+PyTypeObject ZiPackerType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name        = "ziproto.Packer",
+	.tp_doc         = "Packer(stream=None, high_water=65536)\n--\n\n"
+	                  "Encodes objects into one reusable buffer, writing it to stream.write() "
+	                  "whenever at least high_water bytes are buffered.",
+	.tp_basicsize   = sizeof(ZiPacker_t),
+	.tp_flags       = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC,
+	.tp_new         = Packer_new,
+	.tp_init        = (initproc) Packer_init,
+	.tp_dealloc     = (destructor) Packer_dealloc,
+	.tp_traverse    = (traverseproc) Packer_traverse,
+	.tp_clear       = (inquiry) Packer_clear,
+	.tp_methods     = Packer_methods,
+	.tp_members     = Packer_members,
+	.tp_as_sequence = &Packer_as_sequence,
+};
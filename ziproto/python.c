@@ -4,8 +4,19 @@
 // doc: https://docs.python.org/3/c-api/structures.html#METH_O
 // SO: https://stackoverflow.com/a/56217044
 static PyMethodDef module_methods[] = {
-    { "decode",  (PyCFunction) ziproto_decode, METH_O },
-    { "encode",  (PyCFunction) ziproto_encode, METH_O },
+    { "decode",  (PyCFunction) ziproto_decode, METH_VARARGS | METH_KEYWORDS },
+    { "decode_all", (PyCFunction) ziproto_decode_all, METH_VARARGS | METH_KEYWORDS },
+    { "validate", (PyCFunction) ziproto_validate, METH_VARARGS | METH_KEYWORDS },
+    { "extract", (PyCFunction) ziproto_extract, METH_VARARGS | METH_KEYWORDS },
+    { "encode",  (PyCFunction) ziproto_encode, METH_VARARGS | METH_KEYWORDS },
+    { "encode_into", (PyCFunction) ziproto_encode_into, METH_VARARGS | METH_KEYWORDS },
+    { "encoded_size", (PyCFunction) ziproto_encoded_size, METH_O },
+    { "iter_file", (PyCFunction) ziproto_iter_file, METH_O },
+    { "load", (PyCFunction) ziproto_load, METH_O },
+    { "set_key_cache_size", (PyCFunction) ziproto_set_key_cache_size, METH_O },
+    { "stats", (PyCFunction) ziproto_stats, METH_NOARGS },
+    { "reset_stats", (PyCFunction) ziproto_reset_stats, METH_NOARGS },
+    { "enable_stats", (PyCFunction) ziproto_enable_stats, METH_VARARGS | METH_KEYWORDS },
     {0}
 };
 
@@ -18,11 +29,62 @@ static struct PyModuleDef ziproto_module = {
     module_methods
 };
 
+// Python types exported by the module
+static struct
+{
+	const char   *name;
+	PyTypeObject *type;
+} module_types[] = {
+	{ "Packer",   &ZiPackerType },
+	{ "Unpacker", &ZiUnpackerType },
+	{ "LazyView", &ZiLazyViewType },
+	{ "Schema",   &ZiSchemaType },
+	{ "RecordWriter", &ZiRecordWriterType },
+	{ "RecordReader", &ZiRecordReaderType },
+	{0}
+};
+
 PyMODINIT_FUNC
 PyInit_ziproto(void)
 {
-	// Our python object is pretty simplistic.
-	// Just one object with 2 functions, both entirely C
-	return PyModule_Create(&ziproto_module);
-	// Py_InitModule("ziproto", module_methods);
+	// Iterator types are ready but not exported
+	if (PyType_Ready(&ZiLazyIterType) < 0)
+		return NULL;
+	if (PyType_Ready(&ZiFileIterType) < 0)
+		return NULL;
+	if (PyType_Ready(&ZiRecordIterType) < 0)
+		return NULL;
+
+	for (size_t i = 0; module_types[i].name; ++i)
+	{
+		if (PyType_Ready(module_types[i].type) < 0)
+			return NULL;
+	}
+
+	// Both key caches are read and filled without any locking of their
+	// own, so without a GIL to serialize decodes and encodes they are left
+	// disabled. decode_all's workers use caches of their own.
+#ifndef Py_GIL_DISABLED
+	if (ResizeKeyCache(&DefaultKeyCache, KEY_CACHE_SIZE) < 0)
+		return NULL;
+	if (ResizeEncodedKeyCache(&EncodedKeyCache, KEY_CACHE_SIZE) < 0)
+		return NULL;
+#endif
+
+	PyObject *module = PyModule_Create(&ziproto_module);
+	if (!module)
+		return NULL;
+
+	for (size_t i = 0; module_types[i].name; ++i)
+	{
+		Py_INCREF(module_types[i].type);
+		if (PyModule_AddObject(module, module_types[i].name, (PyObject *)module_types[i].type) < 0)
+		{
+			Py_DECREF(module_types[i].type);
+			Py_DECREF(module);
+			return NULL;
+		}
+	}
+
+	return module;
 }
@@ -0,0 +1,866 @@
+#include "common.h"
+#include "structmember.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Record files
+//
+//   header  "ZIPREC\0\1" | u32 index interval | u64 offset of the last index block, 0 for none
+//   frames  u8 tag | u32 payload length | payload
+//   footer  u64 offset of the last index block | u64 number of records | "ZIPREND\1"
+//
+// Integers are big endian. A RECORD frame holds one encoded object. Every
+// index interval'th record is a checkpoint, and after RECORD_INDEX_CHECKPOINTS
+// of them (and on close) an INDEX frame is appended holding the encoded array
+// [offset of the previous index block, records written so far, [offsets of
+// the checkpoints since the previous block]]. Each index block also updates
+// the offset in the header, so a file without a footer (the writer never
+// closed it) is recovered by scanning only the frames after that block.
+#define RECORD_MAGIC             "ZIPREC\0\1"
+#define RECORD_FOOTER_MAGIC      "ZIPREND\1"
+#define RECORD_HEADER_SIZE       20
+#define RECORD_FOOTER_SIZE       24
+#define RECORD_FRAME_SIZE        5
+#define RECORD_INDEX_INTERVAL    64
+#define RECORD_INDEX_CHECKPOINTS 64
+#define RECORD_BUFFER_SIZE       65536
+
+enum
+{
+	RECORD_FRAME = 1,
+	INDEX_FRAME  = 2
+};
+
+/**
+ * @struct ZiRecordIndex_t
+ * @brief Sparse index of a record file, the file offset of every interval'th record
+ */
+typedef struct
+{
+	/*@{*/
+	uint32_t  interval;    /**< Records per checkpoint */
+	uint64_t  count;       /**< Number of records */
+	uint64_t  lastindex;   /**< Offset of the last index block, 0 if there is none */
+	uint64_t  indexed;     /**< Number of records covered by the last index block */
+	uint64_t  end;         /**< End of the last complete frame */
+	uint64_t *checkpoints; /**< Offset of the frame of record n * interval */
+	size_t    _alloc;      /**< Allocated number of checkpoints */
+	/*@}*/
+} ZiRecordIndex_t;
+
+// Number of checkpoints for count records
+#define CHECKPOINTS(index, count) (((count) + (index)->interval - 1) / (index)->interval)
+
+static int ReserveCheckpoints(ZiRecordIndex_t *index, size_t count)
+{
+	if (count <= index->_alloc)
+		return 0;
+
+	size_t    alloc = count > index->_alloc * 2 ? count : index->_alloc * 2;
+	uint64_t *data  = realloc(index->checkpoints, alloc * sizeof(uint64_t));
+	if (!data)
+	{
+		PyErr_NoMemory();
+		return -1;
+	}
+	index->checkpoints = data;
+	index->_alloc      = alloc;
+	return 0;
+}
+
+// Reads the frame header at offset, false unless the whole frame is before end.
+static bool ReadFrame(const uint8_t *data, uint64_t end, uint64_t offset, uint8_t *tag, uint64_t *length)
+{
+	if (offset > end || end - offset < RECORD_FRAME_SIZE)
+		return false;
+	*tag    = data[offset];
+	*length = ZiLoadBE32(data + offset + 1);
+	return *length <= end - offset - RECORD_FRAME_SIZE;
+}
+
+// Reads an index block up to its checkpoints, which are left at the handle's cursor.
+static bool ReadIndexBlock(const uint8_t *data, uint64_t end, uint64_t offset, ZiHandle_t *handle,
+                           uint64_t *prev, uint64_t *count, uint64_t *checkpoints)
+{
+	uint8_t   tag;
+	uint64_t  length;
+	ZiValue_t value;
+
+	if (!ReadFrame(data, end, offset, &tag, &length) || tag != INDEX_FRAME)
+		return false;
+
+	*handle = (ZiHandle_t){
+		.szEncodedData = length,
+		.EncodedData   = (uint8_t *)data + offset + RECORD_FRAME_SIZE
+	};
+
+	if (ZiReadNext(handle, &value) != ZI_DECODE_OK || value.vType != ZI_ARRAY_TYPE || value.length != 3)
+		return false;
+	if (ZiReadNext(handle, &value) != ZI_DECODE_OK || value.vType != ZI_UINT_TYPE || value.value.u >= offset)
+		return false;
+	*prev = value.value.u;
+	if (ZiReadNext(handle, &value) != ZI_DECODE_OK || value.vType != ZI_UINT_TYPE)
+		return false;
+	*count = value.value.u;
+	if (ZiReadNext(handle, &value) != ZI_DECODE_OK || value.vType != ZI_ARRAY_TYPE)
+		return false;
+	*checkpoints = value.length;
+	return true;
+}
+
+/**
+ * @brief Loads the checkpoints of every index block, walking back from the last one.
+ *
+ * @returns 0 on success, 1 if the chain is broken or -1 with a python exception set.
+ */
+static int ReadIndexChain(const uint8_t *data, uint64_t end, uint64_t offset, ZiRecordIndex_t *index)
+{
+	ZiHandle_t handle;
+	uint64_t   prev, count, n;
+
+	if (!ReadIndexBlock(data, end, offset, &handle, &prev, &count, &n))
+		return 1;
+
+	size_t slot = CHECKPOINTS(index, count);
+	if (ReserveCheckpoints(index, slot) < 0)
+		return -1;
+
+	index->count = index->indexed = count;
+	index->lastindex = offset;
+	index->end       = offset + RECORD_FRAME_SIZE + handle.szEncodedData;
+
+	for (;;)
+	{
+		// Blocks list their checkpoints in order, so fill the index from the back.
+		if (n > slot)
+			return 1;
+		slot -= n;
+		for (uint64_t i = 0; i < n; ++i)
+		{
+			ZiValue_t value;
+			if (ZiReadNext(&handle, &value) != ZI_DECODE_OK || value.vType != ZI_UINT_TYPE ||
+			    value.value.u < RECORD_HEADER_SIZE || value.value.u >= offset)
+				return 1;
+			index->checkpoints[slot + i] = value.value.u;
+		}
+
+		if (!prev)
+			return slot ? 1 : 0;
+
+		offset = prev;
+		if (!ReadIndexBlock(data, end, offset, &handle, &prev, &count, &n) || CHECKPOINTS(index, count) != slot)
+			return 1;
+	}
+}
+
+/**
+ * @brief Builds the index of a mapped record file.
+ *
+ * A file closed by its writer is indexed from its index blocks alone. Otherwise
+ * the frames after the newest index block are scanned up to the first one that
+ * is incomplete or damaged, which is where the writer stopped.
+ *
+ * @param[in]  data  The mapped file
+ * @param[in]  size  Size of the file
+ * @param[out] index The index, its checkpoints must be freed by the caller
+ * @returns 0 on success or -1 with a python exception set.
+ */
+static int ScanRecordFile(const uint8_t *data, uint64_t size, ZiRecordIndex_t *index)
+{
+	*index = (ZiRecordIndex_t){0};
+
+	if (size < RECORD_HEADER_SIZE || memcmp(data, RECORD_MAGIC, 8) || !ZiLoadBE32(data + 8))
+	{
+		PyErr_SetString(PyExc_ValueError, "Not a ziproto record file");
+		return -1;
+	}
+	index->interval = ZiLoadBE32(data + 8);
+	index->end      = RECORD_HEADER_SIZE;
+
+	if (size >= RECORD_HEADER_SIZE + RECORD_FOOTER_SIZE && !memcmp(data + size - 8, RECORD_FOOTER_MAGIC, 8))
+	{
+		uint64_t end       = size - RECORD_FOOTER_SIZE;
+		uint64_t lastindex = ZiLoadBE64(data + end);
+		uint64_t count     = ZiLoadBE64(data + end + 8);
+
+		int ret = lastindex ? ReadIndexChain(data, end, lastindex, index) : 1;
+		if (ret < 0)
+			return -1;
+		if (!ret && index->count == count && index->end == end)
+			return 0;
+		if (!lastindex && !count && end == RECORD_HEADER_SIZE)
+			return 0;
+	}
+
+	// No usable footer, start from the newest index block the header knows of.
+	uint64_t lastindex = ZiLoadBE64(data + 12);
+	int      ret       = lastindex ? ReadIndexChain(data, size, lastindex, index) : 1;
+	if (ret < 0)
+		return -1;
+	if (ret)
+	{
+		uint32_t interval = index->interval;
+		free(index->checkpoints);
+		*index = (ZiRecordIndex_t){ .interval = interval, .end = RECORD_HEADER_SIZE };
+	}
+
+	uint8_t  tag;
+	uint64_t length;
+	while (ReadFrame(data, size, index->end, &tag, &length))
+	{
+		if (tag == RECORD_FRAME)
+		{
+			// Catch frames whose header was written but not their whole payload.
+			ZiHandle_t handle = {
+				.szEncodedData = length,
+				.EncodedData   = (uint8_t *)data + index->end + RECORD_FRAME_SIZE
+			};
+			if (ZiSkipNext(&handle) != ZI_DECODE_OK || handle._cursor != length)
+				break;
+
+			if (index->count % index->interval == 0)
+			{
+				if (ReserveCheckpoints(index, CHECKPOINTS(index, index->count) + 1) < 0)
+					return -1;
+				index->checkpoints[CHECKPOINTS(index, index->count)] = index->end;
+			}
+			index->count++;
+		}
+		else if (tag == INDEX_FRAME)
+		{
+			// An index block written after the header was last updated
+			ZiHandle_t handle;
+			uint64_t   prev, count, n;
+			if (!ReadIndexBlock(data, size, index->end, &handle, &prev, &count, &n) || count != index->count)
+				break;
+			index->lastindex = index->end;
+			index->indexed   = count;
+		}
+		else
+			break;
+
+		index->end += RECORD_FRAME_SIZE + length;
+	}
+	return 0;
+}
+
+// Appends an empty frame header to the handle, filled in by EndFrame once the payload is written.
+static ZiHandle_t *BeginFrame(ZiHandle_t *handle)
+{
+	static const uint8_t frame[RECORD_FRAME_SIZE] = {0};
+	return ZiEncodeRaw(handle, frame, sizeof(frame));
+}
+
+static int EndFrame(ZiHandle_t *handle, size_t mark, uint8_t tag)
+{
+	size_t length = ZiGetSize(handle) - mark - RECORD_FRAME_SIZE;
+	if (length > UINT32_MAX)
+	{
+		PyErr_SetString(PyExc_OverflowError, "Record is larger than 4 GiB");
+		return -1;
+	}
+	ZiGetData(handle)[mark] = tag;
+	ZiStoreBE32(ZiGetData(handle) + mark + 1, length);
+	return 0;
+}
+
+// Writes all of data to fd, returns 0 or -1 with an OSError set.
+static int WriteAll(int fd, const uint8_t *data, size_t size)
+{
+	while (size)
+	{
+		ssize_t written = write(fd, data, size);
+		if (written < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			PyErr_SetFromErrno(PyExc_OSError);
+			return -1;
+		}
+		data += written;
+		size -= written;
+	}
+	return 0;
+}
+
+/**
+ * @struct ZiRecordWriter_t
+ * @brief Python object appending records and their index to a record file
+ */
+typedef struct
+{
+	PyObject_HEAD
+	int             fd;     /**< The file, -1 once closed */
+	ZiHandle_t     *handle; /**< Frames not written to the file yet */
+	ZiRecordIndex_t index;  /**< Index of every record written so far, end includes the buffered frames */
+} ZiRecordWriter_t;
+
+static int RecordWriter_flush_buffer(ZiRecordWriter_t *self)
+{
+	if (WriteAll(self->fd, ZiGetData(self->handle), ZiGetSize(self->handle)) < 0)
+		return -1;
+	self->handle->szEncodedData = self->handle->_cursor = 0;
+	return 0;
+}
+
+// Appends an index block with the checkpoints since the last one and points the header at it.
+static int RecordWriter_write_index(ZiRecordWriter_t *self)
+{
+	ZiRecordIndex_t *index  = &self->index;
+	ZiHandle_t      *handle = self->handle;
+	size_t           mark   = ZiGetSize(handle);
+	uint64_t         first  = CHECKPOINTS(index, index->indexed);
+	uint64_t         last   = CHECKPOINTS(index, index->count);
+	uint64_t         header[2] = { 3, last - first };
+
+	bool ok = BeginFrame(handle)
+		&& ZiEncodeTypeSingle(handle, ZI_ARRAY_TYPE, &header[0], sizeof(uint64_t))
+		&& ZiEncodeTypeSingle(handle, ZI_UINT_TYPE, &index->lastindex, sizeof(uint64_t))
+		&& ZiEncodeTypeSingle(handle, ZI_UINT_TYPE, &index->count, sizeof(uint64_t))
+		&& ZiEncodeTypeSingle(handle, ZI_ARRAY_TYPE, &header[1], sizeof(uint64_t));
+	for (uint64_t i = first; ok && i < last; ++i)
+		ok = ZiEncodeTypeSingle(handle, ZI_UINT_TYPE, &index->checkpoints[i], sizeof(uint64_t));
+
+	if (!ok || EndFrame(handle, mark, INDEX_FRAME) < 0)
+	{
+		handle->szEncodedData = handle->_cursor = mark;
+		if (!PyErr_Occurred())
+			PyErr_NoMemory();
+		return -1;
+	}
+
+	uint64_t offset = index->end;
+	index->end      += ZiGetSize(handle) - mark;
+	index->lastindex = offset;
+	index->indexed   = index->count;
+
+	// The header may only point at a block that is already in the file.
+	uint8_t hint[8];
+	ZiStoreBE64(hint, offset);
+	if (RecordWriter_flush_buffer(self) < 0)
+		return -1;
+	if (pwrite(self->fd, hint, sizeof(hint), 12) != sizeof(hint))
+	{
+		PyErr_SetFromErrno(PyExc_OSError);
+		return -1;
+	}
+	return 0;
+}
+
+static PyObject *RecordWriter_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+	ZiRecordWriter_t *self = (ZiRecordWriter_t *)type->tp_alloc(type, 0);
+	if (!self)
+		return NULL;
+
+	self->fd     = -1;
+	self->handle = ZiAllocHandle(RECORD_BUFFER_SIZE);
+	if (!self->handle)
+	{
+		Py_DECREF(self);
+		return PyErr_NoMemory();
+	}
+	return (PyObject *)self;
+}
+
+static int RecordWriter_init(ZiRecordWriter_t *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"path", "index_interval", "append", NULL};
+	PyObject   *path     = NULL;
+	Py_ssize_t  interval = RECORD_INDEX_INTERVAL;
+	int         append   = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|n$p:RecordWriter", kwlist, &path, &interval, &append))
+		return -1;
+
+	if (interval < 1 || interval > UINT32_MAX)
+	{
+		PyErr_SetString(PyExc_ValueError, "index_interval must be between 1 and 2**32 - 1");
+		return -1;
+	}
+
+	if (self->fd >= 0)
+	{
+		PyErr_SetString(PyExc_RuntimeError, "RecordWriter is already open");
+		return -1;
+	}
+
+	// Appending picks up wherever the existing file ends, including after a crash.
+	ZiRecordIndex_t index = { .interval = interval, .end = RECORD_HEADER_SIZE };
+	if (append)
+	{
+		uint8_t *data = NULL;
+		size_t   size = 0;
+		if (MapFile(path, MADV_SEQUENTIAL, &data, &size) < 0)
+		{
+			if (!PyErr_ExceptionMatches(PyExc_FileNotFoundError))
+				return -1;
+			PyErr_Clear();
+		}
+
+		if (size)
+		{
+			int ret = ScanRecordFile(data, size, &index);
+			munmap(data, size);
+			if (ret < 0)
+				return -1;
+		}
+		else
+			append = 0;
+	}
+
+	PyObject *encoded = NULL;
+	if (!PyUnicode_FSConverter(path, &encoded))
+		goto fail;
+
+	int fd = open(PyBytes_AS_STRING(encoded), O_RDWR | O_CREAT | O_CLOEXEC | (append ? 0 : O_TRUNC), 0666);
+	Py_DECREF(encoded);
+	if (fd < 0)
+	{
+		PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path);
+		goto fail;
+	}
+
+	// Drop the footer, or whatever a crashed writer left after its last complete frame.
+	if (append && (ftruncate(fd, index.end) < 0 || lseek(fd, index.end, SEEK_SET) < 0))
+	{
+		PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path);
+		close(fd);
+		goto fail;
+	}
+
+	self->fd    = fd;
+	self->index = index;
+	self->handle->szEncodedData = self->handle->_cursor = 0;
+
+	if (!append)
+	{
+		uint8_t header[RECORD_HEADER_SIZE] = RECORD_MAGIC;
+		ZiStoreBE32(header + 8, index.interval);
+		if (!ZiEncodeRaw(self->handle, header, sizeof(header)))
+		{
+			PyErr_NoMemory();
+			return -1;
+		}
+	}
+	return 0;
+
+fail:
+	free(index.checkpoints);
+	return -1;
+}
+
+static PyObject *RecordWriter_close(ZiRecordWriter_t *self, PyObject *Py_UNUSED(ignored))
+{
+	if (self->fd < 0)
+		Py_RETURN_NONE;
+
+	ZiRecordIndex_t *index = &self->index;
+	if (index->count > index->indexed && RecordWriter_write_index(self) < 0)
+		return NULL;
+
+	uint8_t footer[RECORD_FOOTER_SIZE];
+	ZiStoreBE64(footer, index->lastindex);
+	ZiStoreBE64(footer + 8, index->count);
+	memcpy(footer + 16, RECORD_FOOTER_MAGIC, 8);
+	if (!ZiEncodeRaw(self->handle, footer, sizeof(footer)))
+		return PyErr_NoMemory();
+	if (RecordWriter_flush_buffer(self) < 0)
+		return NULL;
+
+	int ret = close(self->fd);
+	self->fd = -1;
+	if (ret < 0)
+		return PyErr_SetFromErrno(PyExc_OSError);
+
+	Py_RETURN_NONE;
+}
+
+static void RecordWriter_dealloc(ZiRecordWriter_t *self)
+{
+	if (self->fd >= 0)
+	{
+		PyObject *type, *value, *traceback;
+		PyErr_Fetch(&type, &value, &traceback);
+
+		PyObject *ret = RecordWriter_close(self, NULL);
+		if (!ret)
+			PyErr_WriteUnraisable((PyObject *)self);
+		Py_XDECREF(ret);
+		if (self->fd >= 0)
+			close(self->fd);
+
+		PyErr_Restore(type, value, traceback);
+	}
+	free(self->index.checkpoints);
+	if (self->handle)
+		ZiFreeHandle(self->handle);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *RecordWriter_write(ZiRecordWriter_t *self, PyObject *obj)
+{
+	if (self->fd < 0)
+	{
+		PyErr_SetString(PyExc_ValueError, "I/O operation on closed RecordWriter");
+		return NULL;
+	}
+
+	ZiRecordIndex_t *index  = &self->index;
+	ZiHandle_t      *handle = self->handle;
+	size_t           mark   = ZiGetSize(handle);
+
+	handle->stats = EncoderStats();
+	if (!BeginFrame(handle) || !EncodePyType(handle, obj) || EndFrame(handle, mark, RECORD_FRAME) < 0 ||
+	    (index->count % index->interval == 0 && ReserveCheckpoints(index, CHECKPOINTS(index, index->count) + 1) < 0))
+	{
+		// Drop the partially encoded record, keep everything before it.
+		handle->szEncodedData = handle->_cursor = mark;
+		if (!PyErr_Occurred())
+			PyErr_SetString(PyExc_OverflowError, "Encode failed.");
+		return NULL;
+	}
+
+	if (index->count % index->interval == 0)
+		index->checkpoints[CHECKPOINTS(index, index->count)] = index->end;
+	index->count++;
+	index->end += ZiGetSize(handle) - mark;
+
+	if (index->count % ((uint64_t)index->interval * RECORD_INDEX_CHECKPOINTS) == 0)
+	{
+		if (RecordWriter_write_index(self) < 0)
+			return NULL;
+	}
+	else if (ZiGetSize(handle) >= RECORD_BUFFER_SIZE && RecordWriter_flush_buffer(self) < 0)
+		return NULL;
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *RecordWriter_flush(ZiRecordWriter_t *self, PyObject *Py_UNUSED(ignored))
+{
+	if (self->fd >= 0 && RecordWriter_flush_buffer(self) < 0)
+		return NULL;
+	Py_RETURN_NONE;
+}
+
+static PyObject *RecordWriter_enter(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+	Py_INCREF(self);
+	return self;
+}
+
+static PyObject *RecordWriter_exit(ZiRecordWriter_t *self, PyObject *args)
+{
+	return RecordWriter_close(self, NULL);
+}
+
+static Py_ssize_t RecordWriter_length(ZiRecordWriter_t *self)
+{
+	return self->index.count;
+}
+
+static PyMethodDef RecordWriter_methods[] = {
+	{ "write",     (PyCFunction) RecordWriter_write, METH_O,
+		"write(obj)\n--\n\nAppend obj to the file as the next record." },
+	{ "flush",     (PyCFunction) RecordWriter_flush, METH_NOARGS,
+		"flush()\n--\n\nWrite all buffered records to the file." },
+	{ "close",     (PyCFunction) RecordWriter_close, METH_NOARGS,
+		"close()\n--\n\nWrite the remaining records, the last index block and the footer, then close the file." },
+	{ "__enter__", (PyCFunction) RecordWriter_enter, METH_NOARGS, NULL },
+	{ "__exit__",  (PyCFunction) RecordWriter_exit,  METH_VARARGS, NULL },
+	{0}
+};
+
+static PyMemberDef RecordWriter_members[] = {
+	{ "index_interval", T_UINT, offsetof(ZiRecordWriter_t, index.interval), READONLY,
+		"Number of records between the indexed ones." },
+	{0}
+};
+
+static PySequenceMethods RecordWriter_as_sequence = {
+	.sq_length = (lenfunc) RecordWriter_length,
+};
+
+PyTypeObject ZiRecordWriterType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name        = "ziproto.RecordWriter",
+	.tp_doc         = "RecordWriter(path, index_interval=64, *, append=False)\n--\n\n"
+	                  "Writes objects as length framed records to an indexed record file. Every "
+	                  "index_interval'th record is indexed for RecordReader. With append the "
+	                  "records are added to an existing file, recovering it if its writer crashed.",
+	.tp_basicsize   = sizeof(ZiRecordWriter_t),
+	.tp_flags       = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+	.tp_new         = RecordWriter_new,
+	.tp_init        = (initproc) RecordWriter_init,
+	.tp_dealloc     = (destructor) RecordWriter_dealloc,
+	.tp_methods     = RecordWriter_methods,
+	.tp_members     = RecordWriter_members,
+	.tp_as_sequence = &RecordWriter_as_sequence,
+};
+
+/**
+ * @struct ZiRecordReader_t
+ * @brief Python object giving random access to the records of a mapped record file
+ */
+typedef struct
+{
+	PyObject_HEAD
+	uint8_t        *data;  /**< The mapped file, null once closed */
+	size_t          size;  /**< Size of the mapping */
+	ZiRecordIndex_t index; /**< Checkpoints of the file */
+} ZiRecordReader_t;
+
+static int RecordReader_unmap(ZiRecordReader_t *self)
+{
+	if (self->data)
+		munmap(self->data, self->size);
+	self->data = NULL;
+	self->size = 0;
+	return 0;
+}
+
+static int RecordReader_init(ZiRecordReader_t *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"path", NULL};
+	PyObject   *path      = NULL;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O:RecordReader", kwlist, &path))
+		return -1;
+
+	RecordReader_unmap(self);
+	free(self->index.checkpoints);
+	self->index = (ZiRecordIndex_t){0};
+
+	if (MapFile(path, MADV_NORMAL, &self->data, &self->size) < 0)
+		return -1;
+
+	if (ScanRecordFile(self->data, self->size, &self->index) < 0)
+	{
+		RecordReader_unmap(self);
+		return -1;
+	}
+	return 0;
+}
+
+static void RecordReader_dealloc(ZiRecordReader_t *self)
+{
+	RecordReader_unmap(self);
+	free(self->index.checkpoints);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+// Offset of the frame of record number ordinal, found from the checkpoint before it.
+static int RecordReader_find(ZiRecordReader_t *self, uint64_t ordinal, uint64_t *offset)
+{
+	ZiRecordIndex_t *index = &self->index;
+	uint64_t         skip  = ordinal % index->interval;
+	uint64_t         at    = index->checkpoints[ordinal / index->interval];
+	uint8_t          tag;
+	uint64_t         length;
+
+	while (ReadFrame(self->data, index->end, at, &tag, &length))
+	{
+		if (tag == RECORD_FRAME && !skip--)
+		{
+			*offset = at;
+			return 0;
+		}
+		at += RECORD_FRAME_SIZE + length;
+	}
+
+	PyErr_Format(PyExc_ValueError, "Record file is damaged at offset %llu", (unsigned long long)at);
+	return -1;
+}
+
+// Decodes the record frame at offset and advances offset past it.
+static PyObject *RecordReader_decode(ZiRecordReader_t *self, uint64_t *offset)
+{
+	uint8_t  tag    = 0;
+	uint64_t length = 0;
+	if (!ReadFrame(self->data, self->index.end, *offset, &tag, &length) || tag != RECORD_FRAME)
+	{
+		PyErr_Format(PyExc_ValueError, "Record file is damaged at offset %llu", (unsigned long long)*offset);
+		return NULL;
+	}
+
+	ZiHandle_t handle = {
+		.szEncodedData = length,
+		.EncodedData   = self->data + *offset + RECORD_FRAME_SIZE
+	};
+	*offset += RECORD_FRAME_SIZE + length;
+	return DecodeNext(&handle);
+}
+
+static bool RecordReader_check(ZiRecordReader_t *self)
+{
+	if (!self->data)
+		PyErr_SetString(PyExc_ValueError, "I/O operation on closed RecordReader");
+	return self->data;
+}
+
+static Py_ssize_t RecordReader_length(ZiRecordReader_t *self)
+{
+	return self->index.count;
+}
+
+static PyObject *RecordReader_item(ZiRecordReader_t *self, Py_ssize_t i)
+{
+	if (!RecordReader_check(self))
+		return NULL;
+
+	if (i < 0 || (uint64_t)i >= self->index.count)
+	{
+		PyErr_SetString(PyExc_IndexError, "record index out of range");
+		return NULL;
+	}
+
+	uint64_t offset;
+	if (RecordReader_find(self, i, &offset) < 0)
+		return NULL;
+	return RecordReader_decode(self, &offset);
+}
+
+/**
+ * @struct ZiRecordIter_t
+ * @brief Iterator decoding the records of a RecordReader in order
+ */
+typedef struct
+{
+	PyObject_HEAD
+	ZiRecordReader_t *reader;    /**< The reader, kept alive by the iterator */
+	uint64_t          offset;    /**< Offset of the next frame */
+	uint64_t          remaining; /**< Records still to be returned */
+} ZiRecordIter_t;
+
+static void RecordIter_dealloc(ZiRecordIter_t *self)
+{
+	Py_XDECREF(self->reader);
+	PyObject_Free(self);
+}
+
+static PyObject *RecordIter_next(ZiRecordIter_t *self)
+{
+	ZiRecordReader_t *reader = self->reader;
+	if (!self->remaining || !RecordReader_check(reader))
+		return NULL;
+
+	// Index blocks sit between the records, step over them.
+	uint8_t  tag    = 0;
+	uint64_t length = 0;
+	while (ReadFrame(reader->data, reader->index.end, self->offset, &tag, &length) && tag == INDEX_FRAME)
+		self->offset += RECORD_FRAME_SIZE + length;
+
+	PyObject *obj = RecordReader_decode(reader, &self->offset);
+	self->remaining = obj ? self->remaining - 1 : 0;
+	return obj;
+}
+
+PyTypeObject ZiRecordIterType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name      = "ziproto.RecordIterator",
+	.tp_basicsize = sizeof(ZiRecordIter_t),
+	.tp_flags     = Py_TPFLAGS_DEFAULT,
+	.tp_dealloc   = (destructor) RecordIter_dealloc,
+	.tp_iter      = PyObject_SelfIter,
+	.tp_iternext  = (iternextfunc) RecordIter_next,
+};
+
+// Iterator over the records from number start on, negative numbers count from the end.
+static PyObject *RecordReader_iter_from(ZiRecordReader_t *self, Py_ssize_t start)
+{
+	if (!RecordReader_check(self))
+		return NULL;
+
+	uint64_t count = self->index.count;
+	if (start < 0)
+		start = (uint64_t)-start > count ? 0 : (Py_ssize_t)(count + start);
+
+	uint64_t offset = self->index.end;
+	if ((uint64_t)start < count && RecordReader_find(self, start, &offset) < 0)
+		return NULL;
+
+	ZiRecordIter_t *iter = PyObject_New(ZiRecordIter_t, &ZiRecordIterType);
+	if (!iter)
+		return NULL;
+
+	Py_INCREF(self);
+	iter->reader    = self;
+	iter->offset    = offset;
+	iter->remaining = (uint64_t)start < count ? count - start : 0;
+	return (PyObject *)iter;
+}
+
+static PyObject *RecordReader_records(ZiRecordReader_t *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"start", NULL};
+	Py_ssize_t   start    = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|n:records", kwlist, &start))
+		return NULL;
+	return RecordReader_iter_from(self, start);
+}
+
+static PyObject *RecordReader_iter(ZiRecordReader_t *self)
+{
+	return RecordReader_iter_from(self, 0);
+}
+
+static PyObject *RecordReader_close(ZiRecordReader_t *self, PyObject *Py_UNUSED(ignored))
+{
+	RecordReader_unmap(self);
+	Py_RETURN_NONE;
+}
+
+static PyObject *RecordReader_enter(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+	Py_INCREF(self);
+	return self;
+}
+
+static PyObject *RecordReader_exit(ZiRecordReader_t *self, PyObject *args)
+{
+	RecordReader_unmap(self);
+	Py_RETURN_NONE;
+}
+
+static PyMethodDef RecordReader_methods[] = {
+	{ "records",   (PyCFunction) RecordReader_records, METH_VARARGS | METH_KEYWORDS,
+		"records(start=0)\n--\n\nIterate over the records in order, beginning with record number start." },
+	{ "close",     (PyCFunction) RecordReader_close,   METH_NOARGS,
+		"close()\n--\n\nUnmap the file." },
+	{ "__enter__", (PyCFunction) RecordReader_enter,   METH_NOARGS, NULL },
+	{ "__exit__",  (PyCFunction) RecordReader_exit,    METH_VARARGS, NULL },
+	{0}
+};
+
+static PyMemberDef RecordReader_members[] = {
+	{ "index_interval", T_UINT, offsetof(ZiRecordReader_t, index.interval), READONLY,
+		"Number of records between the indexed ones." },
+	{0}
+};
+
+static PySequenceMethods RecordReader_as_sequence = {
+	.sq_length = (lenfunc) RecordReader_length,
+	.sq_item   = (ssizeargfunc) RecordReader_item,
+};
+
+PyTypeObject ZiRecordReaderType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name        = "ziproto.RecordReader",
+	.tp_doc         = "RecordReader(path)\n--\n\n"
+	                  "Maps a file written by RecordWriter. reader[n] decodes record n after "
+	                  "skipping at most index_interval - 1 records from the nearest indexed one.",
+	.tp_basicsize   = sizeof(ZiRecordReader_t),
+	.tp_flags       = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+	.tp_new         = PyType_GenericNew,
+	.tp_init        = (initproc) RecordReader_init,
+	.tp_dealloc     = (destructor) RecordReader_dealloc,
+	.tp_iter        = (getiterfunc) RecordReader_iter,
+	.tp_methods     = RecordReader_methods,
+	.tp_members     = RecordReader_members,
+	.tp_as_sequence = &RecordReader_as_sequence,
+};
@@ -0,0 +1,253 @@
+#include "common.h"
+#include "structmember.h"
+
+/**
+ * @struct ZiSchema_t
+ * @brief Python object holding the field order of a struct-mode record
+ *
+ * Records are encoded as a plain array of their values in field order, so
+ * the keys are never written and decoding is just indexing by position.
+ */
+typedef struct
+{
+	PyObject_HEAD
+	PyObject *fields; /**< Tuple of interned field names */
+} ZiSchema_t;
+
+static int Schema_init(ZiSchema_t *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"fields", NULL};
+	PyObject   *iterable  = NULL;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O:Schema", kwlist, &iterable))
+		return -1;
+
+	PyObject *names = PySequence_Fast(iterable, "Schema fields must be an iterable of str");
+	if (!names)
+		return -1;
+
+	PyObject *seen   = PySet_New(NULL);
+	PyObject *fields = PyTuple_New(PySequence_Fast_GET_SIZE(names));
+	if (!seen || !fields)
+		goto fail;
+
+	for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(fields); ++i)
+	{
+		PyObject *name = PySequence_Fast_GET_ITEM(names, i);
+		if (!PyUnicode_CheckExact(name))
+		{
+			PyErr_Format(PyExc_TypeError, "Schema fields must be str, not %.200s", Py_TYPE(name)->tp_name);
+			goto fail;
+		}
+
+		// Interned names hash once and compare by identity against
+		// interned dict keys, which is what literal keys always are.
+		Py_INCREF(name);
+		PyUnicode_InternInPlace(&name);
+		PyTuple_SET_ITEM(fields, i, name);
+
+		int dup = PySet_Contains(seen, name);
+		if (dup < 0 || (!dup && PySet_Add(seen, name) < 0))
+			goto fail;
+		if (dup)
+		{
+			PyErr_Format(PyExc_ValueError, "Duplicate Schema field %R", name);
+			goto fail;
+		}
+	}
+
+	Py_DECREF(names);
+	Py_DECREF(seen);
+	Py_XSETREF(self->fields, fields);
+	return 0;
+
+fail:
+	Py_DECREF(names);
+	Py_XDECREF(seen);
+	Py_XDECREF(fields);
+	return -1;
+}
+
+static void Schema_dealloc(ZiSchema_t *self)
+{
+	Py_XDECREF(self->fields);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *Schema_pack(ZiSchema_t *self, PyObject *record)
+{
+	if (!self->fields)
+	{
+		PyErr_SetString(PyExc_RuntimeError, "Schema is not initialized");
+		return NULL;
+	}
+
+	Py_ssize_t count  = PyTuple_GET_SIZE(self->fields);
+	PyObject  *values = PyTuple_New(count);
+	if (!values)
+		return NULL;
+
+	// The tuple keeps every value alive while it is sized and encoded,
+	// whatever the record's own methods do in between.
+	bool isdict = PyDict_Check(record);
+	for (Py_ssize_t i = 0; i < count; ++i)
+	{
+		PyObject *name  = PyTuple_GET_ITEM(self->fields, i);
+		PyObject *value = NULL;
+
+		if (isdict)
+		{
+			value = PyDict_GetItemWithError(record, name);
+			if (!value && !PyErr_Occurred())
+				PyErr_SetObject(PyExc_KeyError, name);
+			Py_XINCREF(value);
+		}
+		else
+			value = PyObject_GetItem(record, name);
+
+		if (!value)
+		{
+			Py_DECREF(values);
+			return NULL;
+		}
+		PyTuple_SET_ITEM(values, i, value);
+	}
+
+	// Every field was found, so any difference in size is a key the
+	// schema would otherwise silently drop.
+	Py_ssize_t size = isdict ? PyDict_GET_SIZE(record) : PyObject_Size(record);
+	if (size != count)
+	{
+		if (size >= 0)
+			PyErr_Format(PyExc_ValueError, "Record has %zd keys but the Schema has %zd fields", size, count);
+		Py_DECREF(values);
+		return NULL;
+	}
+
+	PyObject *ret = EncodeToBytes(values);
+	Py_DECREF(values);
+	return ret;
+}
+
+// Turns a list of decoded values into a record keyed by field name.
+static PyObject *SchemaRecord(ZiSchema_t *self, PyObject *values)
+{
+	Py_ssize_t count = PyTuple_GET_SIZE(self->fields);
+	if (!PyList_CheckExact(values) || PyList_GET_SIZE(values) != count)
+		return PyErr_Format(PyExc_ValueError, "Decode failed. Expected an array of %zd Schema fields", count);
+
+	PyObject *record = _PyDict_NewPresized(count);
+	for (Py_ssize_t i = 0; record && i < count; ++i)
+	{
+		if (PyDict_SetItem(record, PyTuple_GET_ITEM(self->fields, i), PyList_GET_ITEM(values, i)) < 0)
+			Py_CLEAR(record);
+	}
+	return record;
+}
+
+static PyObject *Schema_unpack(ZiSchema_t *self, PyObject *data)
+{
+	if (!self->fields)
+	{
+		PyErr_SetString(PyExc_RuntimeError, "Schema is not initialized");
+		return NULL;
+	}
+
+	Py_buffer view;
+	if (PyObject_GetBuffer(data, &view, PyBUF_SIMPLE) < 0)
+		return NULL;
+
+	ZiHandle_t handle = {
+		.szEncodedData = view.len,
+		.EncodedData   = view.buf
+	};
+
+	Py_ssize_t count  = PyTuple_GET_SIZE(self->fields);
+	PyObject  *record = NULL;
+	ZiValue_t  value;
+
+	// A compressed message or one with string references is decoded whole
+	// and its array turned into the record
+	if (view.len && (handle.EncodedData[0] == ZI_FRAME_COMPRESSED || handle.EncodedData[0] == ZI_FRAME_STRING_REFS))
+	{
+		PyObject *values = DecodeMessage(&handle, &(ZiDecodeStack_t){ .keycache = &DefaultKeyCache });
+		if (values)
+			record = SchemaRecord(self, values);
+		Py_XDECREF(values);
+		goto done;
+	}
+
+	ZiDecodeStatus_t status = ZiReadNext(&handle, &value);
+	if (status != ZI_DECODE_OK)
+	{
+		SetDecodeError(status, &handle);
+		goto done;
+	}
+
+	if (value.vType != ZI_ARRAY_TYPE || value.length != (uint64_t)count)
+	{
+		PyErr_Format(PyExc_ValueError, "Decode failed. Expected an array of %zd Schema fields", count);
+		goto done;
+	}
+
+	// Decode the values straight into the record without building the array.
+	record = _PyDict_NewPresized(count);
+	if (!record)
+		goto done;
+
+	for (Py_ssize_t i = 0; i < count; ++i)
+	{
+		PyObject *item = DecodeNext(&handle);
+		if (!item || PyDict_SetItem(record, PyTuple_GET_ITEM(self->fields, i), item) < 0)
+		{
+			Py_XDECREF(item);
+			Py_CLEAR(record);
+			goto done;
+		}
+		Py_DECREF(item);
+	}
+
+done:
+	PyBuffer_Release(&view);
+	return record;
+}
+
+static Py_ssize_t Schema_length(ZiSchema_t *self)
+{
+	return self->fields ? PyTuple_GET_SIZE(self->fields) : 0;
+}
+
+static PyMethodDef Schema_methods[] = {
+	{ "pack",   (PyCFunction) Schema_pack,   METH_O,
+		"pack(record)\n--\n\nEncode the record's values as an array in field order. "
+		"Missing fields raise KeyError and keys that are not fields raise ValueError." },
+	{ "unpack", (PyCFunction) Schema_unpack, METH_O,
+		"unpack(data)\n--\n\nDecode an array written by pack() back into a dict keyed by field name." },
+	{0}
+};
+
+static PyMemberDef Schema_members[] = {
+	{ "fields", T_OBJECT, offsetof(ZiSchema_t, fields), READONLY,
+		"Tuple of field names in encoded order." },
+	{0}
+};
+
+static PySequenceMethods Schema_as_sequence = {
+	.sq_length = (lenfunc) Schema_length,
+};
+
+PyTypeObject ZiSchemaType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name        = "ziproto.Schema",
+	.tp_doc         = "Schema(fields)\n--\n\n"
+	                  "Encodes dict records as positional arrays of their values in the order of fields, "
+	                  "leaving the keys out of the encoded data.",
+	.tp_basicsize   = sizeof(ZiSchema_t),
+	.tp_flags       = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+	.tp_new         = PyType_GenericNew,
+	.tp_init        = (initproc) Schema_init,
+	.tp_dealloc     = (destructor) Schema_dealloc,
+	.tp_methods     = Schema_methods,
+	.tp_members     = Schema_members,
+	.tp_as_sequence = &Schema_as_sequence,
+};
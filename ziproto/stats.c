@@ -0,0 +1,235 @@
+#include "common.h"
+#include <pthread.h>
+
+// Off by default, checking it is all the counters cost until enable_stats()
+bool StatsEnabled = false;
+
+// Every thread counts into its own ZiThreadStats_t so the hot paths never
+// contend. They are pushed onto this list on first use and, when their
+// thread exits, folded into RetiredStats and freed, so the totals survive
+// the threads that produced them without keeping their memory.
+_Thread_local ZiThreadStats_t *CurrentThreadStats = NULL;
+static ZiThreadStats_t        *AllThreadStats     = NULL;
+static ZiThreadStats_t         RetiredStats       = {0};
+static pthread_mutex_t         StatsLock          = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t           StatsKey;
+static pthread_once_t          StatsKeyOnce       = PTHREAD_ONCE_INIT;
+static bool                    StatsKeyCreated    = false;
+
+// Adds the counters in stats to total.
+static void FoldStats(ZiThreadStats_t *total, const ZiThreadStats_t *stats)
+{
+	total->encoder.reallocs     += stats->encoder.reallocs;
+	total->encoder.reallocbytes += stats->encoder.reallocbytes;
+	if (stats->encoder.peakalloc > total->encoder.peakalloc)
+		total->encoder.peakalloc = stats->encoder.peakalloc;
+	for (size_t i = 0; i < 256; ++i)
+		total->encoder.formats[i] += stats->encoder.formats[i];
+	for (size_t i = 0; i < ZI_API_COUNT; ++i)
+	{
+		total->api[i].calls    += stats->api[i].calls;
+		total->api[i].bytesin  += stats->api[i].bytesin;
+		total->api[i].bytesout += stats->api[i].bytesout;
+		total->api[i].timens   += stats->api[i].timens;
+	}
+}
+
+// Runs when a thread that registered counters exits.
+static void RetireThreadStats(void *arg)
+{
+	ZiThreadStats_t *stats = arg;
+
+	pthread_mutex_lock(&StatsLock);
+	FoldStats(&RetiredStats, stats);
+	for (ZiThreadStats_t **link = &AllThreadStats; *link; link = &(*link)->next)
+	{
+		if (*link == stats)
+		{
+			*link = stats->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&StatsLock);
+
+	CurrentThreadStats = NULL;
+	free(stats);
+}
+
+static void CreateStatsKey(void)
+{
+	StatsKeyCreated = pthread_key_create(&StatsKey, RetireThreadStats) == 0;
+}
+
+/**
+ * @brief Allocates the calling thread's counters and adds them to the list stats() sums.
+ *
+ * @returns The counters, or null if they couldn't be allocated in which case the call just isn't counted.
+ */
+ZiThreadStats_t *RegisterThreadStats(void)
+{
+	// Without a way to hear about the thread exiting the counters would leak
+	pthread_once(&StatsKeyOnce, CreateStatsKey);
+	if (!StatsKeyCreated)
+		return NULL;
+
+	ZiThreadStats_t *stats = calloc(1, sizeof(ZiThreadStats_t));
+	if (!stats)
+		return NULL;
+
+	if (pthread_setspecific(StatsKey, stats) != 0)
+	{
+		free(stats);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&StatsLock);
+	stats->next    = AllThreadStats;
+	AllThreadStats = stats;
+	pthread_mutex_unlock(&StatsLock);
+
+	CurrentThreadStats = stats;
+	return stats;
+}
+
+// Name of a format byte, the FIX* formats are counted together.
+static const char *FormatName(uint8_t byte)
+{
+	if (byte <= 0x7F)
+		return "POSITIVE_FIXINT";
+	if (byte >= ZI_NEGATIVE_FIXINT)
+		return "NEGATIVE_FIXINT";
+	if (byte >= ZI_FIXSTR && byte <= 0xBF)
+		return "FIXSTR";
+	if (byte >= ZI_FIXARRAY && byte <= 0x9F)
+		return "FIXARRAY";
+	if (byte >= ZI_FIXMAP && byte <= 0x8F)
+		return "FIXMAP";
+
+	switch (byte)
+	{
+		case ZI_NIL:      return "NIL";
+		case ZI_FALSE:    return "FALSE";
+		case ZI_TRUE:     return "TRUE";
+		case ZI_BIN8:     return "BIN8";
+		case ZI_BIN16:    return "BIN16";
+		case ZI_BIN32:    return "BIN32";
+		case ZI_FLOAT32:  return "FLOAT32";
+		case ZI_FLOAT64:  return "FLOAT64";
+		case ZI_UINT8:    return "UINT8";
+		case ZI_UINT16:   return "UINT16";
+		case ZI_UINT32:   return "UINT32";
+		case ZI_UINT64:   return "UINT64";
+		case ZI_INT8:     return "INT8";
+		case ZI_INT16:    return "INT16";
+		case ZI_INT32:    return "INT32";
+		case ZI_INT64:    return "INT64";
+		case ZI_STRREF8:  return "STRREF8";
+		case ZI_STRREF16: return "STRREF16";
+		case ZI_STRREF32: return "STRREF32";
+		case ZI_STR8:     return "STR8";
+		case ZI_STR16:    return "STR16";
+		case ZI_STR32:    return "STR32";
+		case ZI_ARRAY16:  return "ARRAY16";
+		case ZI_ARRAY32:  return "ARRAY32";
+		case ZI_MAP16:    return "MAP16";
+		case ZI_MAP32:    return "MAP32";
+		default:          return NULL;
+	}
+}
+
+// Adds value to the int stored under key in dict.
+static int AddCount(PyObject *dict, const char *key, uint64_t value)
+{
+	PyObject *old = PyDict_GetItemString(dict, key);
+	uint64_t  sum = value + (old ? PyLong_AsUnsignedLongLong(old) : 0);
+
+	PyObject *count = PyLong_FromUnsignedLongLong(sum);
+	if (!count)
+		return -1;
+	int ret = PyDict_SetItemString(dict, key, count);
+	Py_DECREF(count);
+	return ret;
+}
+
+PyObject *ziproto_stats(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+	static const char *apinames[ZI_API_COUNT] = {
+		[ZI_API_ENCODE]      = "encode",
+		[ZI_API_ENCODE_INTO] = "encode_into",
+		[ZI_API_DECODE]      = "decode",
+		[ZI_API_DECODE_ALL]  = "decode_all",
+		[ZI_API_PACK]        = "Packer.pack",
+		[ZI_API_UNPACK]      = "Unpacker",
+	};
+
+	// Sum every thread. Threads still encoding may be a few updates ahead of what is read here.
+	ZiThreadStats_t total = {0};
+	pthread_mutex_lock(&StatsLock);
+	FoldStats(&total, &RetiredStats);
+	for (ZiThreadStats_t *stats = AllThreadStats; stats; stats = stats->next)
+		FoldStats(&total, stats);
+	pthread_mutex_unlock(&StatsLock);
+
+	PyObject *formats = PyDict_New();
+	if (!formats)
+		return NULL;
+	for (size_t i = 0; i < 256; ++i)
+	{
+		if (total.encoder.formats[i] && AddCount(formats, FormatName(i), total.encoder.formats[i]) < 0)
+		{
+			Py_DECREF(formats);
+			return NULL;
+		}
+	}
+
+	PyObject *ret = Py_BuildValue("{s:O,s:K,s:K,s:K,s:N}",
+		"enabled",       StatsEnabled ? Py_True : Py_False,
+		"reallocs",      (unsigned long long)total.encoder.reallocs,
+		"realloc_bytes", (unsigned long long)total.encoder.reallocbytes,
+		"peak_buffer",   (unsigned long long)total.encoder.peakalloc,
+		"formats",       formats);
+	if (!ret)
+		return NULL;
+
+	for (size_t i = 0; i < ZI_API_COUNT; ++i)
+	{
+		PyObject *api = Py_BuildValue("{s:K,s:K,s:K,s:K}",
+			"calls",     (unsigned long long)total.api[i].calls,
+			"bytes_in",  (unsigned long long)total.api[i].bytesin,
+			"bytes_out", (unsigned long long)total.api[i].bytesout,
+			"time_ns",   (unsigned long long)total.api[i].timens);
+		if (!api || PyDict_SetItemString(ret, apinames[i], api) < 0)
+		{
+			Py_XDECREF(api);
+			Py_DECREF(ret);
+			return NULL;
+		}
+		Py_DECREF(api);
+	}
+	return ret;
+}
+
+PyObject *ziproto_reset_stats(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+	pthread_mutex_lock(&StatsLock);
+	memset(&RetiredStats, 0, sizeof(RetiredStats));
+	for (ZiThreadStats_t *stats = AllThreadStats; stats; stats = stats->next)
+	{
+		memset(&stats->encoder, 0, sizeof(stats->encoder));
+		memset(stats->api, 0, sizeof(stats->api));
+	}
+	pthread_mutex_unlock(&StatsLock);
+	Py_RETURN_NONE;
+}
+
+PyObject *ziproto_enable_stats(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"enabled", NULL};
+	int          enabled  = 1;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|p:enable_stats", kwlist, &enabled))
+		return NULL;
+
+	StatsEnabled = enabled;
+	Py_RETURN_NONE;
+}
@@ -0,0 +1,177 @@
+#include "common.h"
+
+/**
+ * @struct ZiUnpacker_t
+ * @brief Python object decoding a stream of ZiProto data fed to it in chunks
+ *
+ * Partially decoded containers stay on the decode stack between feed() calls,
+ * so an object split over many chunks is only ever parsed once.
+ */
+typedef struct
+{
+	PyObject_HEAD
+	ZiHandle_t      handle;          /**< Buffered data, _cursor is the read position */
+	ZiDecodeStack_t stack;           /**< Containers of the object being decoded */
+	Py_ssize_t      max_buffer_size; /**< Maximum number of unread bytes, 0 for no limit */
+} ZiUnpacker_t;
+
+static int Unpacker_init(ZiUnpacker_t *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"max_buffer_size", NULL};
+	Py_ssize_t   max_buffer_size = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|n:Unpacker", kwlist, &max_buffer_size))
+		return -1;
+
+	if (max_buffer_size < 0)
+	{
+		PyErr_SetString(PyExc_ValueError, "max_buffer_size must not be negative");
+		return -1;
+	}
+
+	ClearDecodeStack(&self->stack);
+	self->stack.keycache = &DefaultKeyCache;
+	self->handle.szEncodedData = self->handle._cursor = 0;
+	self->max_buffer_size = max_buffer_size;
+	return 0;
+}
+
+static int Unpacker_traverse(ZiUnpacker_t *self, visitproc visit, void *arg)
+{
+	for (size_t i = 0; i < self->stack.depth; ++i)
+	{
+		Py_VISIT(self->stack.frames[i].container);
+		Py_VISIT(self->stack.frames[i].key);
+	}
+	return 0;
+}
+
+static int Unpacker_clear(ZiUnpacker_t *self)
+{
+	ClearDecodeStack(&self->stack);
+	return 0;
+}
+
+static void Unpacker_dealloc(ZiUnpacker_t *self)
+{
+	PyObject_GC_UnTrack(self);
+	Unpacker_clear(self);
+	free(self->handle.EncodedData);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *Unpacker_feed(ZiUnpacker_t *self, PyObject *data)
+{
+	ZiHandle_t *handle = &self->handle;
+	Py_buffer   view;
+
+	if (PyObject_GetBuffer(data, &view, PyBUF_SIMPLE) < 0)
+		return NULL;
+
+	size_t unread = handle->szEncodedData - handle->_cursor;
+	if (self->max_buffer_size && unread + view.len > (size_t)self->max_buffer_size)
+	{
+		PyBuffer_Release(&view);
+		PyErr_Format(PyExc_BufferError, "Unpacker buffer would exceed max_buffer_size (%zd bytes)", self->max_buffer_size);
+		return NULL;
+	}
+
+	if (handle->_allocsz - handle->szEncodedData < (size_t)view.len)
+	{
+		// Drop the bytes that were already decoded instead of growing once
+		// at least as many were consumed as have to be moved, so every byte
+		// is moved at most once on average. Every decoded object lives on
+		// the stack, nothing points into the buffer.
+		if (handle->_cursor && handle->_cursor >= unread)
+		{
+			memmove(handle->EncodedData, handle->EncodedData + handle->_cursor, unread);
+			handle->szEncodedData = unread;
+			handle->_cursor       = 0;
+		}
+
+		if (handle->_allocsz - handle->szEncodedData < (size_t)view.len)
+		{
+			size_t   newsz = (handle->szEncodedData + view.len) * 2;
+			uint8_t *newdata = realloc(handle->EncodedData, newsz);
+			if (!newdata)
+			{
+				PyBuffer_Release(&view);
+				return PyErr_NoMemory();
+			}
+			handle->EncodedData = newdata;
+			handle->_allocsz    = newsz;
+		}
+	}
+
+	memcpy(handle->EncodedData + handle->szEncodedData, view.buf, view.len);
+	handle->szEncodedData += view.len;
+	PyBuffer_Release(&view);
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *Unpacker_iternext(ZiUnpacker_t *self)
+{
+	PyObject        *obj    = NULL;
+	ZiThreadStats_t *stats  = ThreadStats();
+	uint64_t         start  = StatsClock(stats);
+	size_t           mark   = self->handle._cursor;
+	ZiDecodeStatus_t status = DecodeMessageResume(&self->handle, &self->stack, &obj);
+
+	if (status == ZI_DECODE_OK)
+	{
+		CountApiCall(stats, ZI_API_UNPACK, start, self->handle._cursor - mark, 0);
+		return obj;
+	}
+
+	// Count the part of an object received so far, it is finished by a later call.
+	if (stats)
+		stats->api[ZI_API_UNPACK].bytesin += self->handle._cursor - mark;
+
+	// Malformed data can't be resumed from and the cursor can't be moved
+	// past it, so the buffer is dropped like reset() and the next feed()
+	// starts over.
+	if (status != ZI_DECODE_TRUNCATED)
+	{
+		SetDecodeError(status, &self->handle);
+		ClearDecodeStack(&self->stack);
+		self->handle.szEncodedData = self->handle._cursor = 0;
+	}
+
+	// Returning null without an exception ends the iteration until more data is fed.
+	return NULL;
+}
+
+static PyObject *Unpacker_reset(ZiUnpacker_t *self, PyObject *Py_UNUSED(ignored))
+{
+	ClearDecodeStack(&self->stack);
+	self->handle.szEncodedData = self->handle._cursor = 0;
+	Py_RETURN_NONE;
+}
+
+static PyMethodDef Unpacker_methods[] = {
+	{ "feed",  (PyCFunction) Unpacker_feed,  METH_O,
+		"feed(data)\n--\n\nAppend a chunk of encoded data to the internal buffer." },
+	{ "reset", (PyCFunction) Unpacker_reset, METH_NOARGS,
+		"reset()\n--\n\nDiscard all buffered data and any partially decoded object." },
+	{0}
+};
+
+PyTypeObject ZiUnpackerType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name      = "ziproto.Unpacker",
+	.tp_doc       = "Unpacker(max_buffer_size=0)\n--\n\n"
+	                "Incrementally decodes data passed to feed(). Iterating yields every "
+	                "object that is complete so far. Malformed data raises ValueError and "
+	                "discards everything buffered.",
+	.tp_basicsize = sizeof(ZiUnpacker_t),
+	.tp_flags     = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC,
+	.tp_new       = PyType_GenericNew,
+	.tp_init      = (initproc) Unpacker_init,
+	.tp_dealloc   = (destructor) Unpacker_dealloc,
+	.tp_traverse  = (traverseproc) Unpacker_traverse,
+	.tp_clear     = (inquiry) Unpacker_clear,
+	.tp_iter      = PyObject_SelfIter,
+	.tp_iternext  = (iternextfunc) Unpacker_iternext,
+	.tp_methods   = Unpacker_methods,
+};